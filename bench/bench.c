@@ -0,0 +1,144 @@
+/*
+ * unsf-bench converts synthetic SoundFonts of several sizes and reports
+ * the throughput.
+ *
+ * usage: unsf-bench [-n runs] [-k] [case ...]
+ *
+ * The fonts are written to the current directory as unsf-bench-<case>.sf2
+ * and removed afterwards unless -k is given. The patches go to a
+ * temporary directory, which is removed when the benchmark is done.
+ *
+ * license: cc0
+ *
+ * To the extent possible under law, the person who associated CC0 with
+ * unsf has waived all copyright and related or neighboring rights
+ * to unsf.
+ *
+ * You should have received a copy of the CC0 legal code along with this
+ * work. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+ *
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libunsf.h"
+#include "files.h"
+#include "sfgen.h"
+
+typedef struct BenchCase {
+    const char *name;
+    SfGenParams params;             /* banks, presets, zones, layers, stereo %, kits, MB, seed */
+} BenchCase;
+
+static const BenchCase grid[] = {
+    {"small",  {1,  16, 2, 1,  0,  1,   4, 1}},
+    {"medium", {1, 128, 4, 2, 25,  1,  32, 2}},
+    {"large",  {2, 160, 8, 4, 50,  4, 128, 3}},
+    {"drums",  {1,   8, 4, 2, 25, 16,  32, 4}}
+};
+#define GRID_SIZE ((int) (sizeof(grid) / sizeof(grid[0])))
+
+typedef struct BenchResult {
+    double megabytes;
+    int patches;
+    double best;
+} BenchResult;
+
+static double file_megabytes(const char *path) {
+    FILE *f = fopen(path, "rb");
+    long size;
+
+    if (!f) return 0;
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fclose(f);
+    return size / 1048576.0;
+}
+
+/* converts the font of one case runs times, keeping the fastest run */
+static int run_case(const BenchCase *bc, const char *tmp, int runs, int keep, BenchResult *result) {
+    char font[64], out[512];
+    UnSF_Options options;
+    UnSF_Stats stats;
+    int i;
+
+    sprintf(font, "unsf-bench-%s.sf2", bc->name);
+    if (strlen(tmp) + strlen(bc->name) + 2 > sizeof(out)) return -1;
+    strcpy(out, tmp);
+    strcat(out, bc->name);
+    strcat(out, "/");
+    if (sfgen_write(font, &bc->params) < 0) {
+        fprintf(stderr, "Could not write %s: %s\n", font, strerror(errno));
+        return -1;
+    }
+    result->megabytes = file_megabytes(font);
+    result->patches = sfgen_patches(&bc->params);
+    result->best = 0;
+
+    for (i = 0; i < runs; i++) {
+        options = unsf_initialization();
+        options.opt_soundfont = font;
+        options.basename = (char *) bc->name;
+        options.output_directory = out;
+        options.stats = &stats;
+        memset(&stats, 0, sizeof(stats));
+        unsf_convert_sf_to_gus(&options);
+        if (options.cfg_fd) fclose(options.cfg_fd);
+        if (!stats.counters.files) {
+            fprintf(stderr, "Could not convert %s\n", font);
+            if (!keep) remove(font);
+            return -1;
+        }
+        if (!result->best || stats.total < result->best) result->best = stats.total;
+    }
+    if (!keep) remove(font);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    BenchResult results[GRID_SIZE];
+    int selected[GRID_SIZE];
+    char tmp[512];
+    int i, j, runs = 3, keep = 0, any = 0, failed = 0;
+
+    memset(selected, 0, sizeof(selected));
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc) runs = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-k")) keep = 1;
+        else {
+            for (j = 0; j < GRID_SIZE; j++)
+                if (!strcmp(argv[i], grid[j].name)) break;
+            if (j == GRID_SIZE) {
+                fprintf(stderr, "usage: unsf-bench [-n runs] [-k] [small|medium|large|drums ...]\n");
+                return 1;
+            }
+            selected[j] = any = 1;
+        }
+    }
+    if (runs < 1) runs = 1;
+    if (bench_temp_dir("unsf-bench-", tmp, sizeof(tmp)) < 0) {
+        fprintf(stderr, "Could not create a temporary directory: %s\n", strerror(errno));
+        return 1;
+    }
+
+    for (i = 0; i < GRID_SIZE; i++) {
+        if (any && !selected[i]) continue;
+        selected[i] = 1;
+        if (run_case(&grid[i], tmp, runs, keep, &results[i]) < 0) {
+            selected[i] = 0;
+            failed = 1;
+        }
+    }
+    bench_remove_tree(tmp);
+
+    printf("\n%-8s %9s %8s %10s %10s %11s\n", "case", "font MB", "patches", "best s", "MB/s", "patches/s");
+    for (i = 0; i < GRID_SIZE; i++) {
+        if (!selected[i]) continue;
+        printf("%-8s %9.1f %8d %10.4f %10.1f %11.1f\n", grid[i].name, results[i].megabytes, results[i].patches,
+               results[i].best, results[i].megabytes / results[i].best, results[i].patches / results[i].best);
+    }
+    return failed;
+}
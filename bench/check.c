@@ -0,0 +1,642 @@
+/*
+ * unsf-check converts synthetic SoundFonts with different options and
+ * checks that every patch and config file comes out exactly as recorded
+ * below, and that no case has grown much slower or hungrier.
+ *
+ * usage: unsf-check [-n runs] [-t factor] [-l] [case ...]
+ *
+ * The conversions are written as tar streams to temporary files and the
+ * contents of the .pat and .cfg files in them are digested in order; the
+ * tar headers, which carry a time stamp, are left out. -l lists the
+ * digest of every file, to find the one that changed by comparing the
+ * listings of two builds.
+ *
+ * Every case is then converted once more into a directory with each of
+ * the patch file writers (stdio, io_uring, copy_file_range and the patch
+ * store), and the files on disk, read in the order of the tar stream,
+ * have to give the same digest. The store must not change when plain
+ * patches are written again over the links to it, and when no links can
+ * be made the cfg has to lead to the store files from the output
+ * directory, with -S relative to another directory than -O. A conversion cancelled
+ * halfway must leave nothing behind in an empty directory, and leave the
+ * files and cfg of an earlier conversion as they were.
+ *
+ * The SoundFont 3 case is decoded with sfgen_decode(); unless unsf has
+ * libvorbisfile, it also has to refuse the font without a decoder. The
+ * sparse case is a font of almost 4 GB, most of it a hole in the file,
+ * to read past 2 GB and 32-bit file offsets.
+ *
+ * The time budgets are multiplied by -t on slow machines, -t 0 leaves
+ * them out. The wall time is the best of -n runs (3 by default). The
+ * memory is what the library held at its peak (UnSF_Stats), not the
+ * resident set of the process, which only ever grows over the cases run
+ * before and the allocator's caching.
+ *
+ * When the output is meant to change, the new digests printed for the
+ * failing cases replace the old ones in the table.
+ *
+ * license: cc0
+ *
+ * To the extent possible under law, the person who associated CC0 with
+ * unsf has waived all copyright and related or neighboring rights
+ * to unsf.
+ *
+ * You should have received a copy of the CC0 legal code along with this
+ * work. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+ *
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+#include "libunsf.h"
+#include "files.h"
+#include "sfgen.h"
+
+#define CHECK_8BIT      1
+#define CHECK_SMALL     2           /* -s */
+#define CHECK_MONO      4           /* -m */
+#define CHECK_FLAGS     8           /* -F */
+#define CHECK_VOLUME    16          /* -V */
+
+typedef struct CheckCase {
+    const char *name;
+    SfGenParams params;             /* banks, presets, zones, layers, stereo %, kits, MB, seed, sf3, hole MB */
+    int flags;
+    const char *digest;
+    double seconds;                 /* wall time budget */
+    double megabytes;               /* peak memory budget */
+} CheckCase;
+
+static const CheckCase cases[] = {
+    {"stereo", {1,  16, 2, 1, 100, 0, 2, 11}, 0,            "7aa2a21e20d317b1", 0.2, 6},
+    {"layers", {1,  16, 4, 4,  25, 0, 2, 12}, 0,            "7b29e4db9e4de438", 0.2, 6},
+    {"drums",  {1,   4, 4, 2,  25, 4, 2, 13}, 0,            "5ed3ac2a4bfee2a3", 0.75, 6},
+    {"plain",  {1,  16, 4, 2,  50, 1, 2, 14}, 0,            "cae916083e0fbc4d", 0.2, 6},
+    {"8bit",   {1,  16, 4, 2,  50, 1, 2, 14}, CHECK_8BIT,   "39aafd6f96f64812", 0.2, 6},
+    {"small",  {1,  16, 4, 2,  50, 1, 2, 14}, CHECK_SMALL,  "fc03bcf63a3e00cd", 0.2, 6},
+    {"mono",   {1,  16, 4, 2,  50, 1, 2, 14}, CHECK_MONO,   "c779cee157cd624c", 0.2, 6},
+    {"flags",  {1,  16, 4, 2,  50, 1, 2, 14}, CHECK_FLAGS,  "e79e86c8424c558d", 0.2, 6},
+    {"volume", {1,  16, 4, 2,  50, 1, 2, 14}, CHECK_VOLUME, "1feb3d3c0a34cc31", 0.2, 6},
+    {"all",    {2, 160, 3, 3,  50, 2, 8, 15}, CHECK_8BIT | CHECK_MONO | CHECK_FLAGS | CHECK_VOLUME,
+                                                            "eaa7e3ae00140f50", 0.3, 16},
+    {"sf3",    {1,  16, 4, 2,  50, 1, 2, 14, 1}, 0,         "cae916083e0fbc4d", 0.2, 8},
+    /* the samples and pdta within 10 MB of 4 GB, as far as 32-bit RIFF sizes go */
+    {"sparse", {1,  16, 4, 2,  50, 1, 2, 14, 0, 4086}, 0,   "cae916083e0fbc4d", 0.2, 6}
+};
+#define CASES ((int) (sizeof(cases) / sizeof(cases[0])))
+
+typedef struct CheckWriter {
+    const char *name;
+    int writer;                     /* opt_writer */
+    int store;                      /* -S */
+} CheckWriter;
+
+static const CheckWriter writers[] = {
+    {"stdio", UNSF_WRITER_STDIO, 0},
+    {"async", UNSF_WRITER_ASYNC, 0},
+    {"copy",  UNSF_WRITER_COPY,  0},
+    {"store", UNSF_WRITER_AUTO,  1}
+};
+#define WRITERS ((int) (sizeof(writers) / sizeof(writers[0])))
+
+#define OUT_DIR   "unsf-check-out/"
+#define STORE_DIR "unsf-check-store/"
+
+/* the files of a conversion, in the order of its tar stream */
+typedef struct FileList {
+    char **names;
+    int count, alloced;
+} FileList;
+
+static void list_add(FileList *files, const char *name) {
+    if (files->count == files->alloced) {
+        files->alloced = files->alloced ? files->alloced * 2 : 64;
+        files->names = (char **) realloc(files->names, files->alloced * sizeof(char *));
+        if (!files->names) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+    if (!(files->names[files->count] = (char *) malloc(strlen(name) + 1))) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    strcpy(files->names[files->count++], name);
+}
+
+static void list_free(FileList *files) {
+    int i;
+
+    for (i = 0; i < files->count; i++) free(files->names[i]);
+    free(files->names);
+    memset(files, 0, sizeof(FileList));
+}
+
+/* two 32-bit FNV-1a style hashes with different bases side by side, as
+ * long may be only 32 bits wide */
+typedef struct Digest {
+    unsigned long a, b;
+} Digest;
+
+static void digest_init(Digest *d) {
+    d->a = 2166136261UL;
+    d->b = 3735928559UL;
+}
+
+static void digest_add(Digest *d, const unsigned char *p, size_t size) {
+    while (size--) {
+        d->a = ((d->a ^ *p) * 16777619UL) & 0xFFFFFFFFUL;
+        d->b = ((d->b ^ *p++) * 16777619UL + 1) & 0xFFFFFFFFUL;
+    }
+}
+
+static void digest_hex(const Digest *d, char *hex) {
+    sprintf(hex, "%08lx%08lx", d->a, d->b);
+}
+
+static unsigned long tar_number(const unsigned char *field, int width) {
+    unsigned long val = 0;
+    int i;
+
+    for (i = 0; i < width && field[i] >= '0' && field[i] <= '7'; i++) val = val * 8 + (field[i] - '0');
+    return val;
+}
+
+/* digests the names and contents of the files in the tar stream f,
+ * adding their names to files; -1 if it is cut short */
+static int digest_tar(FILE *f, Digest *d, int list, FileList *files) {
+    unsigned char header[512], *data = NULL;
+    char name[260], hex[17];
+    unsigned long size, padded;
+    size_t alloced = 0;
+    Digest file;
+    int i;
+
+    for (;;) {
+        if (fread(header, 1, sizeof(header), f) != sizeof(header)) break;
+        for (i = 0; i < 512 && !header[i]; i++);
+        if (i == 512) {
+            free(data);
+            return 0;                   /* end of archive */
+        }
+
+        /* prefix/name, neither of them terminated when full */
+        memcpy(name, header + 345, 155);
+        name[155] = '\0';
+        if (name[0]) strcat(name, "/");
+        i = (int) strlen(name);
+        memcpy(name + i, header, 100);
+        name[i + 100] = '\0';
+        size = tar_number(header + 124, 12);
+        padded = (size + 511) & ~511UL;
+        if (padded > alloced) {
+            alloced = padded;
+            if (!(data = (unsigned char *) realloc(data, alloced))) {
+                fprintf(stderr, "Out of memory\n");
+                exit(1);
+            }
+        }
+        if (padded && fread(data, 1, padded, f) != padded) break;
+        if (header[156] != '0') continue;
+
+        digest_add(d, (const unsigned char *) name, strlen(name) + 1);
+        digest_add(d, data, size);
+        list_add(files, name);
+        if (list) {
+            digest_init(&file);
+            digest_add(&file, data, size);
+            digest_hex(&file, hex);
+            printf("  %s %8lu %s\n", hex, size, name);
+        }
+    }
+    free(data);
+    return -1;
+}
+
+/* digests the files of the list below dir the way digest_tar() does;
+ * -1 if one is missing */
+static int digest_files(const char *dir, const FileList *files, Digest *d) {
+    unsigned char buf[65536];
+    char path[512];
+    size_t n;
+    FILE *f;
+    int i;
+
+    for (i = 0; i < files->count; i++) {
+        if (strlen(dir) + strlen(files->names[i]) >= sizeof(path)) return -1;
+        strcpy(path, dir);
+        strcat(path, files->names[i]);
+        if (!(f = fopen(path, "rb"))) return -1;
+        digest_add(d, (const unsigned char *) files->names[i], strlen(files->names[i]) + 1);
+        while ((n = fread(buf, 1, sizeof(buf), f)) > 0) digest_add(d, buf, n);
+        fclose(f);
+    }
+    return 0;
+}
+
+/* adds the files below dir + rel to files, as paths relative to dir */
+static void list_tree(const char *dir, const char *rel, FileList *files) {
+    char path[512], sub[512];
+#ifdef _WIN32
+    struct _finddata_t fd;
+    intptr_t h;
+
+    if (strlen(dir) + strlen(rel) + 2 > sizeof(path)) return;
+    sprintf(path, "%s%s*", dir, rel);
+    if ((h = _findfirst(path, &fd)) == -1) return;
+    do {
+        if (!strcmp(fd.name, ".") || !strcmp(fd.name, "..")) continue;
+        if (strlen(rel) + strlen(fd.name) + 2 > sizeof(sub)) continue;
+        strcpy(sub, rel);
+        strcat(sub, fd.name);
+        if (fd.attrib & _A_SUBDIR) {
+            strcat(sub, "/");
+            list_tree(dir, sub, files);
+        } else list_add(files, sub);
+    } while (_findnext(h, &fd) == 0);
+    _findclose(h);
+#else
+    struct dirent *e;
+    struct stat st;
+    DIR *d;
+
+    if (strlen(dir) + strlen(rel) + 1 > sizeof(path)) return;
+    strcpy(path, dir);
+    strcat(path, rel);
+    if (!(d = opendir(path))) return;
+    while ((e = readdir(d)) != NULL) {
+        if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")) continue;
+        if (strlen(rel) + strlen(e->d_name) + 2 > sizeof(sub)) continue;
+        strcpy(sub, rel);
+        strcat(sub, e->d_name);
+        strcpy(path, dir);
+        strcat(path, sub);
+        if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+            strcat(sub, "/");
+            list_tree(dir, sub, files);
+        } else list_add(files, sub);
+    }
+    closedir(d);
+#endif
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+typedef struct CheckResult {
+    char digest[17];
+    double best;
+    double peak;                    /* MB */
+    int ok;
+    char writers[64];               /* the writers whose files differ */
+} CheckResult;
+
+static void case_options(const CheckCase *cc, const char *font, UnSF_Options *options) {
+    *options = unsf_initialization();
+    options->opt_soundfont = (char *) font;
+    options->basename = "check";            /* the same file names for every case */
+    options->opt_8bit = (cc->flags & CHECK_8BIT) != 0;
+    options->opt_small = (cc->flags & CHECK_SMALL) != 0;
+    options->opt_mono = (cc->flags & CHECK_MONO) != 0;
+    options->opt_adjust_sample_flags = (cc->flags & CHECK_FLAGS) != 0;
+    if (cc->flags & CHECK_VOLUME) options->opt_adjust_volume = 0;
+    if (cc->params.sf3) options->vorbis_decoder = sfgen_decode;
+}
+
+/* converts the case again into the directory the store linked its
+ * patches into, with other options so that the patches differ, once
+ * with every plain writer; the store has to stay as it is */
+static int store_unchanged(const CheckCase *cc, const char *font) {
+    UnSF_Options options;
+    FileList store;
+    Digest before, after;
+    int i, ok;
+
+    memset(&store, 0, sizeof(store));
+    list_tree(STORE_DIR, "", &store);
+    qsort(store.names, store.count, sizeof(char *), compare_names);
+    digest_init(&before);
+    ok = store.count > 0 && digest_files(STORE_DIR, &store, &before) == 0;
+    for (i = 0; ok && i < WRITERS; i++) {
+        if (writers[i].store) continue;
+        case_options(cc, font, &options);
+        options.output_directory = OUT_DIR;
+        options.opt_writer = writers[i].writer;
+        options.opt_adjust_volume = !options.opt_adjust_volume;
+        options.opt_adjust_sample_flags = !options.opt_adjust_sample_flags;
+        unsf_convert_sf_to_gus(&options);
+        if (options.cfg_fd) fclose(options.cfg_fd);
+
+        digest_init(&after);
+        ok = digest_files(STORE_DIR, &store, &after) == 0 && after.a == before.a && after.b == before.b;
+    }
+    list_free(&store);
+    return ok;
+}
+
+static volatile int cancel_flag;
+
+static void cancel_halfway(void *progress_data, const UnSF_Progress *progress) {
+    (void) progress_data;
+    if (progress->patches_done && progress->patches_done * 2 >= progress->patches_total) cancel_flag = 1;
+}
+
+/* converts font into OUT_DIR with the default writers, cancelling
+ * halfway when cancel is set; volume toggles opt_adjust_volume */
+static void convert_to_dir(const CheckCase *cc, const char *font, int cancel, int volume) {
+    UnSF_Options options;
+
+    case_options(cc, font, &options);
+    options.output_directory = OUT_DIR;
+    if (volume) options.opt_adjust_volume = !options.opt_adjust_volume;
+    if (cancel) {
+        cancel_flag = 0;
+        options.progress = cancel_halfway;
+        options.cancel = &cancel_flag;
+    }
+    unsf_convert_sf_to_gus(&options);
+    if (options.cfg_fd) fclose(options.cfg_fd);
+}
+
+/* a cancelled conversion has to take away what it made, directories
+ * included, and leave the files of an earlier run where they are and
+ * the cfg as it was */
+static int cancel_cleans_up(const CheckCase *cc, const char *font) {
+    FileList before, after;
+    Digest cfg_before, cfg_after;
+    FileList cfg;
+    char *name = "check.cfg";
+    int i, ok;
+
+    bench_remove_tree(OUT_DIR);
+    convert_to_dir(cc, font, 1, 0);
+    ok = bench_dir_empty(OUT_DIR);
+
+    bench_remove_tree(OUT_DIR);
+    convert_to_dir(cc, font, 0, 0);
+    memset(&before, 0, sizeof(before));
+    memset(&after, 0, sizeof(after));
+    cfg.names = &name;
+    cfg.count = cfg.alloced = 1;
+    digest_init(&cfg_before);
+    digest_init(&cfg_after);
+    list_tree(OUT_DIR, "", &before);
+    if (digest_files(OUT_DIR, &cfg, &cfg_before) < 0) ok = 0;
+
+    convert_to_dir(cc, font, 1, 1);
+    list_tree(OUT_DIR, "", &after);
+    if (digest_files(OUT_DIR, &cfg, &cfg_after) < 0 || cfg_after.a != cfg_before.a || cfg_after.b != cfg_before.b)
+        ok = 0;
+    if (before.count != after.count) ok = 0;
+    if (ok) {
+        qsort(before.names, before.count, sizeof(char *), compare_names);
+        qsort(after.names, after.count, sizeof(char *), compare_names);
+        for (i = 0; i < before.count; i++)
+            if (strcmp(before.names[i], after.names[i])) ok = 0;
+    }
+    list_free(&before);
+    list_free(&after);
+    bench_remove_tree(OUT_DIR);
+    return ok;
+}
+
+/* a patch of the cfg in OUT_DIR that can't be read from there */
+static int cfg_patch_missing(const char *path) {
+    char file[512], head[8];
+    FILE *f;
+    int ok;
+
+    if (strlen(OUT_DIR) + strlen(path) + 5 > sizeof(file)) return 1;
+#ifdef _WIN32
+    if (path[0] == '/' || path[0] == '\\' || (path[0] && path[1] == ':')) file[0] = '\0';
+#else
+    if (path[0] == '/') file[0] = '\0';
+#endif
+    else strcpy(file, OUT_DIR);
+    strcat(file, path);
+    strcat(file, ".pat");
+    if (!(f = fopen(file, "rb"))) return 1;
+    ok = fread(head, 1, sizeof(head), f) == sizeof(head) && !memcmp(head, "GF1PATCH", sizeof(head));
+    fclose(f);
+    return !ok;
+}
+
+/* converts font into the store with a directory in the place of every
+ * patch file, so that no link can be made, and reads the patches back
+ * the way a player does, from the cfg in OUT_DIR */
+static int store_without_links(const CheckCase *cc, const char *font, const FileList *files) {
+    UnSF_Options options;
+    char path[512], line[600], name[512];
+    FILE *cfg;
+    char *slash;
+    int i, patches = 0, ok = 1;
+
+    bench_remove_tree(OUT_DIR);
+    bench_remove_tree(STORE_DIR);
+    bench_mkdir(OUT_DIR);
+    for (i = 0; ok && i < files->count; i++) {
+        if (strlen(OUT_DIR) + strlen(files->names[i]) + 1 > sizeof(path)) ok = 0;
+        else if (strstr(files->names[i], ".pat")) {
+            strcpy(path, OUT_DIR);
+            strcat(path, files->names[i]);
+            for (slash = strchr(path + strlen(OUT_DIR), '/'); slash; slash = strchr(slash + 1, '/')) {
+                *slash = '\0';
+                bench_mkdir(path);
+                *slash = '/';
+            }
+            if (bench_mkdir(path) != 0) ok = 0;
+        }
+    }
+    case_options(cc, font, &options);
+    options.output_directory = OUT_DIR;
+    options.store_directory = STORE_DIR;
+    if (ok) unsf_convert_sf_to_gus(&options);
+    if (options.cfg_fd) fclose(options.cfg_fd);
+
+    if (ok && (cfg = fopen(OUT_DIR "check.cfg", "r")) != NULL) {
+        while (fgets(line, sizeof(line), cfg)) {
+            if (line[0] != '\t' || sscanf(line, "\t%d %511[^\t\n]", &i, name) != 2) continue;
+            patches++;
+            if (cfg_patch_missing(name)) ok = 0;
+        }
+        fclose(cfg);
+    } else ok = 0;
+    bench_remove_tree(OUT_DIR);
+    bench_remove_tree(STORE_DIR);
+    return ok && patches > 0;
+}
+
+/* converts font into a directory with every writer, comparing the files
+ * with the digest of the tar stream */
+static void check_writers(const CheckCase *cc, const char *font, const FileList *files, CheckResult *result) {
+    UnSF_Options options;
+    Digest d;
+    char hex[17];
+    int i;
+
+    result->writers[0] = '\0';
+    for (i = 0; i < WRITERS; i++) {
+        bench_remove_tree(OUT_DIR);
+        bench_remove_tree(STORE_DIR);
+        case_options(cc, font, &options);
+        options.output_directory = OUT_DIR;
+        options.opt_writer = writers[i].writer;
+        if (writers[i].store) options.store_directory = STORE_DIR;
+        unsf_convert_sf_to_gus(&options);
+        if (options.cfg_fd) fclose(options.cfg_fd);
+
+        digest_init(&d);
+        if (digest_files(OUT_DIR, files, &d) == 0) digest_hex(&d, hex);
+        else hex[0] = '\0';
+        if (strcmp(hex, result->digest)) {
+            if (result->writers[0]) strcat(result->writers, ",");
+            strcat(result->writers, writers[i].name);
+        } else if (writers[i].store && !store_unchanged(cc, font)) {
+            if (result->writers[0]) strcat(result->writers, ",");
+            strcat(result->writers, "store overwritten");
+        }
+    }
+    if (!store_without_links(cc, font, files)) {
+        if (result->writers[0]) strcat(result->writers, ",");
+        strcat(result->writers, "store paths");
+    }
+    if (!cancel_cleans_up(cc, font)) {
+        if (result->writers[0]) strcat(result->writers, ",");
+        strcat(result->writers, "cancel");
+    }
+    bench_remove_tree(OUT_DIR);
+    bench_remove_tree(STORE_DIR);
+}
+
+#ifndef HAVE_VORBISFILE
+/* without a decoder an SF3 font has to be refused, not converted with
+ * its compressed samples left out */
+static int refused_without_decoder(const CheckCase *cc, const char *font) {
+    UnSF_Options options;
+    UnSF_Stats stats;
+    FILE *tar;
+
+    if (!(tar = tmpfile())) return 0;
+    case_options(cc, font, &options);
+    options.vorbis_decoder = NULL;
+    options.tar_fd = tar;
+    options.stats = &stats;
+    memset(&stats, 0, sizeof(stats));
+    unsf_convert_sf_to_gus(&options);
+    if (options.cfg_fd) fclose(options.cfg_fd);
+    fclose(tar);
+    return !stats.counters.bytes_written;
+}
+#endif
+
+static int run_case(const CheckCase *cc, int runs, int list, CheckResult *result) {
+    char font[64];
+    UnSF_Options options;
+    UnSF_Stats stats;
+    FileList files;
+    Digest d;
+    FILE *tar;
+    int i, ok = 0;
+
+    sprintf(font, "unsf-check-%s.%s", cc->name, cc->params.sf3 ? "sf3" : "sf2");
+    if (sfgen_write(font, &cc->params) < 0) {
+        fprintf(stderr, "Could not write %s: %s\n", font, strerror(errno));
+        return -1;
+    }
+    result->best = result->peak = 0;
+    memset(&files, 0, sizeof(files));
+
+    for (i = 0; i < runs; i++) {
+        if (!(tar = tmpfile())) {
+            fprintf(stderr, "Could not create a temporary file\n");
+            break;
+        }
+        case_options(cc, font, &options);
+        options.tar_fd = tar;
+        options.stats = &stats;
+        memset(&stats, 0, sizeof(stats));
+        unsf_convert_sf_to_gus(&options);
+        if (options.cfg_fd) fclose(options.cfg_fd);
+
+        /* the output only needs checking once */
+        if (!i) {
+            rewind(tar);
+            digest_init(&d);
+            if (!stats.counters.bytes_written || digest_tar(tar, &d, list, &files) < 0) {
+                fprintf(stderr, "Could not convert %s\n", font);
+                fclose(tar);
+                break;
+            }
+            digest_hex(&d, result->digest);
+        }
+        fclose(tar);
+        if (!result->best || stats.total < result->best) result->best = stats.total;
+        if (stats.memory_peak.total / 1048576.0 > result->peak) result->peak = stats.memory_peak.total / 1048576.0;
+        ok = 1;
+    }
+    if (ok) check_writers(cc, font, &files, result);
+#ifndef HAVE_VORBISFILE
+    if (ok && cc->params.sf3 && !refused_without_decoder(cc, font)) {
+        if (result->writers[0]) strcat(result->writers, ",");
+        strcat(result->writers, "no decoder");
+    }
+#endif
+    list_free(&files);
+    remove(font);
+    return ok ? 0 : -1;
+}
+
+int main(int argc, char *argv[]) {
+    CheckResult result;
+    int selected[CASES];
+    double factor = 1;
+    int i, j, runs = 3, list = 0, any = 0, failed = 0, slow;
+
+    memset(selected, 0, sizeof(selected));
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc) runs = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-t") && i + 1 < argc) factor = atof(argv[++i]);
+        else if (!strcmp(argv[i], "-l")) list = 1;
+        else {
+            for (j = 0; j < CASES; j++)
+                if (!strcmp(argv[i], cases[j].name)) break;
+            if (j == CASES) {
+                fprintf(stderr, "usage: unsf-check [-n runs] [-t factor] [-l] [case ...]\ncases:");
+                for (j = 0; j < CASES; j++) fprintf(stderr, " %s", cases[j].name);
+                fprintf(stderr, "\n");
+                return 1;
+            }
+            selected[j] = any = 1;
+        }
+    }
+    if (runs < 1) runs = 1;
+    if (factor < 0) factor = 1;
+
+    for (i = 0; i < CASES; i++) {
+        if (any && !selected[i]) continue;
+        if (list) printf("%s:\n", cases[i].name);
+        if (run_case(&cases[i], runs, list, &result) < 0) {
+            printf("%-8s FAILED to convert\n", cases[i].name);
+            failed = 1;
+            continue;
+        }
+        result.ok = !strcmp(result.digest, cases[i].digest);
+        slow = factor > 0 && result.best > cases[i].seconds * factor;
+        printf("%-8s %s %-7s %8.3f s of %6.2f %-4s %7.2f MB of %6.1f %-4s files %s\n", cases[i].name,
+               result.digest, result.ok ? "same" : "CHANGED", result.best, cases[i].seconds * factor,
+               slow ? "SLOW" : "ok", result.peak, cases[i].megabytes, result.peak > cases[i].megabytes ? "OVER" : "ok",
+               result.writers[0] ? result.writers : "ok");
+        if (!result.ok || slow || result.peak > cases[i].megabytes || result.writers[0]) failed = 1;
+    }
+    return failed;
+}
@@ -0,0 +1,140 @@
+/*
+ * Temporary directories for the benchmark and check programs.
+ *
+ * license: cc0
+ *
+ * To the extent possible under law, the person who associated CC0 with
+ * unsf has waived all copyright and related or neighboring rights
+ * to unsf.
+ *
+ * You should have received a copy of the CC0 legal code along with this
+ * work. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+ *
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <direct.h>
+#include <io.h>
+#define rmdir _rmdir
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "files.h"
+
+int bench_temp_dir(const char *prefix, char *dir, size_t size) {
+#ifdef _WIN32
+    char *name = _tempnam(NULL, prefix);
+
+    if (!name) return -1;
+    if (strlen(name) + 2 > size) {
+        free(name);
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(dir, name);
+    free(name);
+    if (_mkdir(dir) != 0) return -1;
+#else
+    const char *tmp = getenv("TMPDIR");
+
+    if (!tmp || !*tmp) tmp = "/tmp";
+    if (strlen(tmp) + strlen(prefix) + 9 > size) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    sprintf(dir, "%s/%sXXXXXX", tmp, prefix);
+    if (!mkdtemp(dir)) return -1;
+#endif
+    strcat(dir, "/");
+    return 0;
+}
+
+/* removes dir and everything below it; dir ends in a slash */
+void bench_remove_tree(const char *dir) {
+    char path[512];
+#ifdef _WIN32
+    struct _finddata_t fd;
+    intptr_t h;
+
+    if (strlen(dir) + 2 > sizeof(path)) return;
+    sprintf(path, "%s*", dir);
+    if ((h = _findfirst(path, &fd)) != -1) {
+        do {
+            if (!strcmp(fd.name, ".") || !strcmp(fd.name, "..")) continue;
+            if (strlen(dir) + strlen(fd.name) + 2 > sizeof(path)) continue;
+            strcpy(path, dir);
+            strcat(path, fd.name);
+            if (fd.attrib & _A_SUBDIR) {
+                strcat(path, "/");
+                bench_remove_tree(path);
+            } else remove(path);
+        } while (_findnext(h, &fd) == 0);
+        _findclose(h);
+    }
+#else
+    struct dirent *e;
+    DIR *d;
+
+    if ((d = opendir(dir)) != NULL) {
+        while ((e = readdir(d)) != NULL) {
+            if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")) continue;
+            if (strlen(dir) + strlen(e->d_name) + 2 > sizeof(path)) continue;
+            strcpy(path, dir);
+            strcat(path, e->d_name);
+            /* a directory can't be removed like a file */
+            if (remove(path) != 0) {
+                strcat(path, "/");
+                bench_remove_tree(path);
+            }
+        }
+        closedir(d);
+    }
+#endif
+    strcpy(path, dir);
+    path[strlen(path) - 1] = '\0';
+    rmdir(path);
+}
+
+int bench_mkdir(const char *path) {
+#ifdef _WIN32
+    if (_mkdir(path) == 0 || errno == EEXIST) return 0;
+#else
+    if (mkdir(path, 0755) == 0 || errno == EEXIST) return 0;
+#endif
+    return -1;
+}
+
+int bench_dir_empty(const char *dir) {
+    int empty = 1;
+#ifdef _WIN32
+    char path[512];
+    struct _finddata_t fd;
+    intptr_t h;
+
+    if (strlen(dir) + 2 > sizeof(path)) return 0;
+    sprintf(path, "%s*", dir);
+    if ((h = _findfirst(path, &fd)) != -1) {
+        do {
+            if (strcmp(fd.name, ".") && strcmp(fd.name, "..")) empty = 0;
+        } while (empty && _findnext(h, &fd) == 0);
+        _findclose(h);
+    }
+#else
+    struct dirent *e;
+    DIR *d;
+
+    if ((d = opendir(dir)) != NULL) {
+        while (empty && (e = readdir(d)) != NULL)
+            if (strcmp(e->d_name, ".") && strcmp(e->d_name, "..")) empty = 0;
+        closedir(d);
+    }
+#endif
+    return empty;
+}
@@ -0,0 +1,17 @@
+#ifndef UNSF_BENCH_FILES_H
+#define UNSF_BENCH_FILES_H
+
+#include <stddef.h>
+
+/* makes a new directory below the system's temporary directory, named
+after prefix, and puts its path, ending in a slash, in dir; 0 on
+success, -1 with errno set if it could not be made */
+int bench_temp_dir(const char *prefix, char *dir, size_t size);
+/* removes dir, which ends in a slash, and everything below it */
+void bench_remove_tree(const char *dir);
+/* makes the directory path; 0 on success or if it is there already */
+int bench_mkdir(const char *path);
+/* 1 if there is nothing in dir, which ends in a slash, or it isn't there */
+int bench_dir_empty(const char *dir);
+
+#endif
@@ -0,0 +1,239 @@
+/*
+ * unsf-kernels times the hot inner functions of libunsf.c on their own,
+ * so that a rewrite of one can be measured against the current version.
+ *
+ * usage: unsf-kernels [-t seconds] [kernel ...]
+ *
+ * Every kernel is called on the same synthetic input until it has run
+ * for the given time (0.2 seconds by default), five times over, and the
+ * fastest round is reported as ns per operation and, where the CPU has
+ * a time stamp counter, input bytes per cycle of that counter.
+ *
+ * license: cc0
+ *
+ * To the extent possible under law, the person who associated CC0 with
+ * unsf has waived all copyright and related or neighboring rights
+ * to unsf.
+ *
+ * You should have received a copy of the CC0 legal code along with this
+ * work. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#include <intrin.h>
+#define HAVE_TSC 1
+#define read_tsc() ((double) __rdtsc())
+#elif defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define HAVE_TSC 1
+#define read_tsc() ((double) __builtin_ia32_rdtsc())
+#else
+#define HAVE_TSC 0
+#define read_tsc() 0.0
+#endif
+
+#include "libunsf_kernels.h"
+
+#define WORDS   (1 << 19)       /* get16 input */
+#define NAMES   4096
+#define GENS    60              /* generators per zone */
+#define PITCHES 4096
+#define TIMES   4096
+#define FRAMES  (1 << 16)       /* waveform samples */
+#define GROWTH  (1 << 22)       /* bytes written into a growing buffer */
+
+static FILE *words;
+static char names[NAMES * 20];
+static unsigned short gens[GENS * 2];
+static int keys[PITCHES], tunes[PITCHES];
+static int timecents[TIMES];
+static short pcm[FRAMES];
+
+/* results of the kernels, only kept so they aren't optimized away */
+static volatile unsigned long sink;
+
+static unsigned long lcg = 1;
+
+static int next_random(void) {
+    lcg = (lcg * 1103515245UL + 12345UL) & 0xFFFFFFFFUL;
+    return (int) (lcg >> 16);
+}
+
+/* the generators of a typical instrument zone, repeated */
+static void make_gens(void) {
+    static const unsigned short zone[][2] = {
+        {43, 0x7F00},   /* keyRange */
+        {44, 0x7F00},   /* velRange */
+        {8, 9500},      /* initialFilterFc */
+        {17, 0xFE0C},   /* pan -500 */
+        {34, 0xE0C0},   /* attackVolEnv */
+        {36, 0xF830},   /* decayVolEnv */
+        {37, 100},      /* sustainVolEnv */
+        {38, 0xFC18},   /* releaseVolEnv */
+        {48, 60},       /* initialAttenuation */
+        {51, 0xFFFE},   /* coarseTune -2 */
+        {52, 7},        /* fineTune */
+        {54, 1},        /* sampleModes */
+    };
+    int i, n = (int) (sizeof(zone) / sizeof(zone[0]));
+
+    for (i = 0; i < GENS; i++) {
+        gens[i * 2] = zone[i % n][0];
+        gens[i * 2 + 1] = zone[i % n][1];
+    }
+}
+
+static void make_inputs(void) {
+    static const char *words_of[] = {"Grand", "Piano", "Str/Ens", "Brass", "Kit#1", "Pad & Sweep", "Lead*"};
+    int i, j;
+
+    words = tmpfile();
+    if (!words) {
+        fprintf(stderr, "Could not create a temporary file\n");
+        exit(1);
+    }
+    for (i = 0; i < WORDS; i++) {
+        j = next_random();
+        putc(j & 0xFF, words);
+        putc((j >> 8) & 0xFF, words);
+    }
+
+    /* space padded like SoundFont names, some with characters to replace */
+    memset(names, ' ', sizeof(names));
+    for (i = 0; i < NAMES; i++) {
+        const char *w = words_of[next_random() % 7];
+        memcpy(names + i * 20, w, strlen(w));
+        names[i * 20 + 19] = next_random() % 4 ? ' ' : '\0';
+    }
+
+    make_gens();
+    for (i = 0; i < PITCHES; i++) {
+        keys[i] = next_random() % 128;
+        tunes[i] = next_random() % 199 - 99;
+    }
+    for (i = 0; i < TIMES; i++) timecents[i] = next_random() % 12000 - 12000;
+    for (i = 0; i < FRAMES; i++) pcm[i] = (short) ((i * 97 % 65536) - 32768 + next_random() % 1024 - 512);
+}
+
+typedef struct Kernel {
+    const char *name;
+    const char *op;
+    double ops;                     /* per call */
+    double bytes;                   /* input bytes per call, 0 when it isn't about bytes */
+    void (*run)(void);
+} Kernel;
+
+static void run_get16(void) {
+    rewind(words);
+    sink += unsf_kernel_get16(words, WORDS);
+}
+
+static void run_getname(void) {
+    sink += unsf_kernel_getname(names, NAMES);
+}
+
+static void run_apply_generator(void) {
+    sink += unsf_kernel_apply_generator(gens, GENS, 0);
+}
+
+static void run_root_pitch(void) {
+    sink += unsf_kernel_root_pitch(keys, tunes, PITCHES);
+}
+
+static void run_envelope(void) {
+    sink += unsf_kernel_envelope(timecents, TIMES, 250);
+}
+
+static void run_adjust_volume(void) {
+    sink += (unsigned long) unsf_kernel_adjust_volume(pcm, FRAMES);
+}
+
+static void run_pcm8(void) {
+    sink += (unsigned long) unsf_kernel_pcm8(pcm, FRAMES, 0.8f);
+}
+
+static void run_mem_write8(void) {
+    sink += (unsigned long) unsf_kernel_mem_write8(GROWTH);
+}
+
+static const Kernel kernels[] = {
+    {"get16",           "word",      WORDS,  WORDS * 2.0,  run_get16},
+    {"getname",         "name",      NAMES,  NAMES * 20.0, run_getname},
+    {"apply_generator", "generator", GENS,   GENS * 4.0,   run_apply_generator},
+    {"root_pitch",      "call",      PITCHES, 0,           run_root_pitch},
+    {"envelope",        "call",      TIMES,  0,            run_envelope},
+    {"adjust_volume",   "sample",    FRAMES, FRAMES * 2.0, run_adjust_volume},
+    {"pcm8",            "sample",    FRAMES, FRAMES * 2.0, run_pcm8},
+    {"mem_write8",      "byte",      GROWTH, GROWTH,       run_mem_write8}
+};
+#define KERNELS ((int) (sizeof(kernels) / sizeof(kernels[0])))
+
+/* seconds and time stamp counter ticks per call of the fastest round */
+static void measure(const Kernel *k, double seconds, double *per_call, double *ticks_per_call) {
+    double start, elapsed, tsc;
+    long calls = 1, i;
+    int round;
+
+    /* warm up, and find how many calls fill the time */
+    for (;;) {
+        start = unsf_kernel_clock();
+        for (i = 0; i < calls; i++) k->run();
+        elapsed = unsf_kernel_clock() - start;
+        if (elapsed >= seconds || calls >= 1L << 30) break;
+        calls = elapsed > seconds / 100 ? (long) (calls * seconds / elapsed) + 1 : calls * 10;
+    }
+
+    *per_call = *ticks_per_call = 0;
+    for (round = 0; round < 5; round++) {
+        tsc = read_tsc();
+        start = unsf_kernel_clock();
+        for (i = 0; i < calls; i++) k->run();
+        elapsed = (unsf_kernel_clock() - start) / calls;
+        tsc = (read_tsc() - tsc) / calls;
+        if (!*per_call || elapsed < *per_call) {
+            *per_call = elapsed;
+            *ticks_per_call = tsc;
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int selected[KERNELS];
+    double seconds = 0.2, per_call, ticks;
+    int i, j, any = 0;
+
+    memset(selected, 0, sizeof(selected));
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-t") && i + 1 < argc) seconds = atof(argv[++i]);
+        else {
+            for (j = 0; j < KERNELS; j++)
+                if (!strcmp(argv[i], kernels[j].name)) break;
+            if (j == KERNELS) {
+                fprintf(stderr, "usage: unsf-kernels [-t seconds] [kernel ...]\nkernels:");
+                for (j = 0; j < KERNELS; j++) fprintf(stderr, " %s", kernels[j].name);
+                fprintf(stderr, "\n");
+                return 1;
+            }
+            selected[j] = any = 1;
+        }
+    }
+    if (seconds <= 0) seconds = 0.2;
+
+    make_inputs();
+    printf("%-16s %-10s %10s %12s\n", "kernel", "op", "ns/op", "bytes/cycle");
+    for (i = 0; i < KERNELS; i++) {
+        if (any && !selected[i]) continue;
+        measure(&kernels[i], seconds, &per_call, &ticks);
+        printf("%-16s %-10s %10.2f ", kernels[i].name, kernels[i].op, per_call * 1e9 / kernels[i].ops);
+        if (HAVE_TSC && kernels[i].bytes && ticks > 0) printf("%12.3f\n", kernels[i].bytes / ticks);
+        else printf("%12s\n", "-");
+    }
+
+    unsf_kernel_free();
+    fclose(words);
+    return 0;
+}
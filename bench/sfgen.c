@@ -0,0 +1,461 @@
+/*
+ * sfgen writes synthetic SoundFonts to benchmark and test unsf with,
+ * so that no copyrighted font needs to be shipped.
+ *
+ * license: cc0
+ *
+ * To the extent possible under law, the person who associated CC0 with
+ * unsf has waived all copyright and related or neighboring rights
+ * to unsf.
+ *
+ * You should have received a copy of the CC0 legal code along with this
+ * work. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+ *
+ */
+
+#if defined(HAVE_FSEEKO) && !defined(_FILE_OFFSET_BITS)
+#define _FILE_OFFSET_BITS 64
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sfgen.h"
+
+/* the keys the drum kits cover, as in General MIDI */
+#define DRUM_KEY_FIRST 35
+#define DRUM_KEY_LAST  81
+
+/* SoundFont generators used */
+#define GEN_PAN               17
+#define GEN_SUSTAIN_MOD_ENV   29
+#define GEN_ATTACK_VOL_ENV    34
+#define GEN_DECAY_VOL_ENV     36
+#define GEN_SUSTAIN_VOL_ENV   37
+#define GEN_RELEASE_VOL_ENV   38
+#define GEN_INSTRUMENT        41
+#define GEN_KEY_RANGE         43
+#define GEN_VEL_RANGE         44
+#define GEN_INITIAL_ATTEN     48
+#define GEN_SAMPLE_ID         53
+#define GEN_SAMPLE_MODES      54
+
+#define MONO_SAMPLE  1
+#define RIGHT_SAMPLE 2
+#define LEFT_SAMPLE  4
+#define SF3_COMPRESSED 0x10
+
+/* PCM bytes on each Ogg page of a SoundFont 3 sample, one packet a page */
+#define OGG_PAGE_DATA 32768
+
+typedef struct Buf {
+    unsigned char *data;
+    size_t size, alloced;
+} Buf;
+
+static void put8(Buf *b, int val) {
+    if (b->size == b->alloced) {
+        b->alloced = b->alloced ? b->alloced * 2 : 4096;
+        if (!(b->data = (unsigned char *) realloc(b->data, b->alloced))) {
+            fprintf(stderr, "Error: cannot allocate memory\n");
+            exit(1);
+        }
+    }
+    b->data[b->size++] = (unsigned char) val;
+}
+
+static void put16(Buf *b, int val) {
+    put8(b, val & 0xFF);
+    put8(b, (val >> 8) & 0xFF);
+}
+
+static void put32(Buf *b, unsigned long val) {
+    put16(b, (int) (val & 0xFFFF));
+    put16(b, (int) ((val >> 16) & 0xFFFF));
+}
+
+static void put_name(Buf *b, const char *name) {
+    int i;
+
+    for (i = 0; i < 20; i++) put8(b, i < (int) strlen(name) ? name[i] : 0);
+}
+
+static void put_gen(Buf *b, int oper, int amount) {
+    put16(b, oper);
+    put16(b, amount & 0xFFFF);
+}
+
+static void put_range(Buf *b, int oper, int lo, int hi) {
+    put16(b, oper);
+    put8(b, lo);
+    put8(b, hi);
+}
+
+/* a 32-bit mix of the seed and a number, the same on every platform */
+static unsigned long mix(unsigned long seed, unsigned long n) {
+    unsigned long h = (seed ^ (n * 0x9E3779B1UL)) & 0xFFFFFFFFUL;
+
+    h = ((h ^ (h >> 16)) * 0x85EBCA6BUL) & 0xFFFFFFFFUL;
+    h = ((h ^ (h >> 13)) * 0xC2B2AE35UL) & 0xFFFFFFFFUL;
+    return h ^ (h >> 16);
+}
+
+void sfgen_defaults(SfGenParams *params) {
+    params->banks = 1;
+    params->presets = 16;
+    params->zones = 4;
+    params->layers = 1;
+    params->stereo = 25;
+    params->kits = 1;
+    params->megabytes = 4;
+    params->seed = 1;
+    params->sf3 = 0;
+    params->hole = 0;
+}
+
+static int instruments(const SfGenParams *params) {
+    return params->presets + params->kits;
+}
+
+static int drum_kit(const SfGenParams *params, int inst) {
+    return inst >= params->presets;
+}
+
+static int is_stereo(const SfGenParams *params, int inst, int zone) {
+    unsigned long n = (unsigned long) inst * 128 + zone;
+
+    return (int) (mix(params->seed, n) % 100) < params->stereo;
+}
+
+/* the keys of split zone of the instrument */
+static void key_range(const SfGenParams *params, int inst, int zone, int *lo, int *hi) {
+    int first = 0, keys = 128;
+
+    if (drum_kit(params, inst)) {
+        first = DRUM_KEY_FIRST;
+        keys = DRUM_KEY_LAST - DRUM_KEY_FIRST + 1;
+    }
+    *lo = first + zone * keys / params->zones;
+    *hi = first + (zone + 1) * keys / params->zones - 1;
+}
+
+int sfgen_patches(const SfGenParams *params) {
+    return params->presets + params->kits * (DRUM_KEY_LAST - DRUM_KEY_FIRST + 1);
+}
+
+/* bytes an Ogg page holding len bytes takes: the header, a lacing value
+for every 255 bytes and one more ending the packet */
+static unsigned long ogg_page_size(unsigned long len) {
+    return 27 + len / 255 + 1 + len;
+}
+
+/* bytes sample data of the given frames takes in smpl */
+static unsigned long sample_size(const SfGenParams *params, unsigned long frames) {
+    unsigned long bytes = frames * 2;
+
+    if (!params->sf3) return bytes + 46 * 2;
+    return bytes / OGG_PAGE_DATA * ogg_page_size(OGG_PAGE_DATA) +
+           (bytes % OGG_PAGE_DATA ? ogg_page_size(bytes % OGG_PAGE_DATA) : 0);
+}
+
+static int write_ogg_page(FILE *f, unsigned long n, unsigned long page, unsigned long granule, int last,
+                          const unsigned char *data, size_t len) {
+    unsigned char head[27 + 255];
+    int i, segments = (int) (len / 255) + 1;
+
+    memcpy(head, "OggS", 4);
+    head[4] = 0;
+    head[5] = (unsigned char) ((page ? 0 : 2) | (last ? 4 : 0));
+    for (i = 0; i < 4; i++) {
+        head[6 + i] = (unsigned char) ((granule >> (8 * i)) & 0xFF);
+        head[10 + i] = 0;
+        head[14 + i] = (unsigned char) ((n >> (8 * i)) & 0xFF);
+        head[18 + i] = (unsigned char) ((page >> (8 * i)) & 0xFF);
+        head[22 + i] = 0;   /* no checksum */
+    }
+    head[26] = (unsigned char) segments;
+    for (i = 0; i < segments; i++) head[27 + i] = (unsigned char) (i < segments - 1 ? 255 : len % 255);
+    if (fwrite(head, 1, 27 + segments, f) != (size_t) (27 + segments)) return -1;
+    if (fwrite(data, 1, len, f) != len) return -1;
+    return 0;
+}
+
+/* the sample data of sample n, a sawtooth with some noise on it */
+static int write_sample(FILE *f, const SfGenParams *params, unsigned long n, unsigned long frames) {
+    unsigned char buf[OGG_PAGE_DATA];
+    unsigned long i, lcg = mix(params->seed, n + 0x10000UL);
+    unsigned long period = 64 + mix(params->seed, n) % 400;
+    unsigned long points = params->sf3 ? frames : frames + 46, page = 0;
+    size_t fill = 0;
+    long val;
+
+    for (i = 0; i < points; i++) {
+        if (i < frames) {
+            lcg = (lcg * 1103515245UL + 12345UL) & 0xFFFFFFFFUL;
+            val = (long) ((i % period) * 48000 / period) - 24000 + (long) ((lcg >> 16) & 0x7FF) - 1024;
+        } else val = 0;                     /* the 46 zero points behind each sample */
+        buf[fill++] = (unsigned char) (val & 0xFF);
+        buf[fill++] = (unsigned char) ((val >> 8) & 0xFF);
+        if (fill == sizeof(buf) || i == points - 1) {
+            if (params->sf3) {
+                if (write_ogg_page(f, n, page++, i + 1, i == points - 1, buf, fill) < 0) return -1;
+            } else if (fwrite(buf, 1, fill, f) != fill) return -1;
+            fill = 0;
+        }
+    }
+    return 0;
+}
+
+int sfgen_decode(const void *data, size_t size, short *pcm, unsigned long frames) {
+    const unsigned char *p = (const unsigned char *) data;
+    size_t pos = 0, len;
+    unsigned long got = 0;
+    int i, segments;
+
+    while (pos + 27 <= size && !memcmp(p + pos, "OggS", 4)) {
+        segments = p[pos + 26];
+        if (pos + 27 + segments > size) return 0;
+        for (len = 0, i = 0; i < segments; i++) len += p[pos + 27 + i];
+        pos += 27 + segments;
+        if (pos + len > size || len % 2) return 0;
+        for (; len && got < frames; len -= 2, pos += 2)
+            pcm[got++] = (short) (p[pos] | (p[pos + 1] << 8));
+        pos += len;
+    }
+    if (pos != size || got != frames) return 0;
+    return 1;
+}
+
+/* seeks over size bytes, a step at a time so that each fits a long */
+static int write_hole(FILE *f, unsigned long size) {
+    long step;
+
+    while (size) {
+        step = size > 0x40000000UL ? 0x40000000L : (long) size;
+        if (fseek(f, step, SEEK_CUR) != 0) return -1;
+        size -= (unsigned long) step;
+    }
+    return 0;
+}
+
+static int write_chunk(FILE *f, const char *id, const Buf *b) {
+    unsigned char head[8];
+
+    memcpy(head, id, 4);
+    head[4] = (unsigned char) (b->size & 0xFF);
+    head[5] = (unsigned char) ((b->size >> 8) & 0xFF);
+    head[6] = (unsigned char) ((b->size >> 16) & 0xFF);
+    head[7] = (unsigned char) ((b->size >> 24) & 0xFF);
+    if (fwrite(head, 1, 8, f) != 8) return -1;
+    if (b->size && fwrite(b->data, 1, b->size, f) != b->size) return -1;
+    return 0;
+}
+
+int sfgen_write(const char *path, const SfGenParams *params) {
+    /* pdta sub-chunks, in the order they are written */
+    static const char *ids[9] = {"phdr", "pbag", "pmod", "pgen", "inst", "ibag", "imod", "igen", "shdr"};
+    Buf pdta[9], info, head;
+    Buf *phdr = &pdta[0], *pbag = &pdta[1], *pmod = &pdta[2], *pgen = &pdta[3], *inst = &pdta[4];
+    Buf *ibag = &pdta[5], *imod = &pdta[6], *igen = &pdta[7], *shdr = &pdta[8];
+    unsigned long samples = 0, frames, total_frames, offset, s, smpl_size, pdta_size, hole_size, sdta_size;
+    int i, z, l, c, channels, lo, hi, bag = 0, ok = 0;
+    char name[32];
+    FILE *f;
+
+    if (params->banks < 1 || params->presets < 0 || params->presets > params->banks * 128 || params->zones < 1 ||
+        params->zones > DRUM_KEY_LAST - DRUM_KEY_FIRST + 1 || params->layers < 1 || params->layers > 128 ||
+        params->kits < 0 || params->kits > 128 || params->megabytes < 0 || params->megabytes > 4000 ||
+        params->hole < 0 || params->hole > 4095 || instruments(params) < 1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* every split gets samples of its own, all of the same length */
+    for (i = 0; i < instruments(params); i++)
+        for (z = 0; z < params->zones; z++)
+            for (l = 0; l < params->layers; l++) samples += is_stereo(params, i, z) ? 2 : 1;
+    /* bag and generator indices are 16 bits wide: at most 3 generators per
+    instrument and 8 per sample */
+    if (samples > 0xFFFFUL || 3UL * instruments(params) + 8 * samples > 0xFFFFUL) {
+        errno = EINVAL;
+        return -1;
+    }
+    total_frames = (unsigned long) params->megabytes * 1048576UL / 2;
+    frames = total_frames / samples > 46 + 32 ? total_frames / samples - 46 : 32;
+
+    memset(pdta, 0, sizeof(pdta));
+    memset(&info, 0, sizeof(info));
+    memset(&head, 0, sizeof(head));
+
+    /* presets, one zone each pointing at an instrument of its own */
+    for (i = 0; i < instruments(params); i++) {
+        if (drum_kit(params, i)) {
+            c = i - params->presets;
+            sprintf(name, "Kit %d", c);
+            put_name(phdr, name);
+            put16(phdr, c < 16 ? c * 8 : c);
+            put16(phdr, 128);
+        } else {
+            sprintf(name, "Synth %d-%d", i % params->banks, i / params->banks);
+            put_name(phdr, name);
+            put16(phdr, i / params->banks);
+            put16(phdr, i % params->banks);
+        }
+        put16(phdr, i);
+        put32(phdr, 0);
+        put32(phdr, 0);
+        put32(phdr, 0);
+        put16(pbag, i);
+        put16(pbag, 0);
+        put_gen(pgen, GEN_INSTRUMENT, i);
+    }
+    put_name(phdr, "EOP");
+    put16(phdr, 0);
+    put16(phdr, 0);
+    put16(phdr, i);
+    put32(phdr, 0);
+    put32(phdr, 0);
+    put32(phdr, 0);
+    put16(pbag, i);
+    put16(pbag, 0);
+    put_gen(pgen, 0, 0);
+
+    /* instruments: a global zone, then a zone per split and channel */
+    s = 0;
+    offset = 0;
+    for (i = 0; i < instruments(params); i++) {
+        sprintf(name, drum_kit(params, i) ? "Kit %d" : "Synth %d", drum_kit(params, i) ? i - params->presets : i);
+        put_name(inst, name);
+        put16(inst, bag);
+
+        put16(ibag, (int) (igen->size / 4));
+        put16(ibag, 0);
+        bag++;
+        put_gen(igen, GEN_DECAY_VOL_ENV, -1200 + (int) (mix(params->seed, i) % 2400));
+        put_gen(igen, GEN_SUSTAIN_VOL_ENV, 100);
+        put_gen(igen, GEN_RELEASE_VOL_ENV, drum_kit(params, i) ? -2400 : 0);
+
+        for (z = 0; z < params->zones; z++) {
+            key_range(params, i, z, &lo, &hi);
+            for (l = 0; l < params->layers; l++) {
+                channels = is_stereo(params, i, z) ? 2 : 1;
+                for (c = 0; c < channels; c++) {
+                    put16(ibag, (int) (igen->size / 4));
+                    put16(ibag, 0);
+                    bag++;
+                    put_range(igen, GEN_KEY_RANGE, lo, hi);
+                    put_range(igen, GEN_VEL_RANGE, l * 128 / params->layers, (l + 1) * 128 / params->layers - 1);
+                    put_gen(igen, GEN_INITIAL_ATTEN, (params->layers - 1 - l) * 30);
+                    if (channels == 2) put_gen(igen, GEN_PAN, c ? 500 : -500);
+                    put_gen(igen, GEN_ATTACK_VOL_ENV, -7973 + (int) (mix(params->seed, s) % 3000));
+                    /* a held modulation envelope keeps unsf -F from adding sustain */
+                    if (i % 2) put_gen(igen, GEN_SUSTAIN_MOD_ENV, 1000);
+                    put_gen(igen, GEN_SAMPLE_MODES, drum_kit(params, i) ? 0 : 1);
+                    put_gen(igen, GEN_SAMPLE_ID, (int) s);
+
+                    sprintf(name, "smp%06lu", s);
+                    put_name(shdr, name);
+                    if (params->sf3) {
+                        /* the byte range of the stream, loops from its start */
+                        put32(shdr, offset);
+                        put32(shdr, offset + sample_size(params, frames));
+                        put32(shdr, frames / 4);
+                        put32(shdr, frames - 8);
+                        offset += sample_size(params, frames);
+                    } else {
+                        put32(shdr, offset);
+                        put32(shdr, offset + frames);
+                        put32(shdr, offset + frames / 4);
+                        put32(shdr, offset + frames - 8);
+                        offset += frames + 46;
+                    }
+                    put32(shdr, s & 1 ? 22050 : 44100);
+                    put8(shdr, drum_kit(params, i) ? lo : (lo + hi) / 2);
+                    put8(shdr, 0);
+                    put16(shdr, channels == 2 ? (int) (c ? s - 1 : s + 1) : 0);
+                    put16(shdr, (channels == 2 ? (c ? RIGHT_SAMPLE : LEFT_SAMPLE) : MONO_SAMPLE) |
+                                    (params->sf3 ? SF3_COMPRESSED : 0));
+                    s++;
+                }
+            }
+        }
+    }
+    put_name(inst, "EOI");
+    put16(inst, bag);
+    put16(ibag, (int) (igen->size / 4));
+    put16(ibag, 0);
+    put_gen(igen, 0, 0);
+    put_name(shdr, "EOS");
+    for (i = 0; i < 26; i++) put8(shdr, 0);
+
+    /* no modulators, only the terminal records */
+    for (i = 0; i < 10; i++) {
+        put8(pmod, 0);
+        put8(imod, 0);
+    }
+
+    put16(&info, params->sf3 ? 3 : 2);
+    put16(&info, 1);
+
+    /* Ogg pages can leave smpl an odd size, which RIFF pads */
+    smpl_size = params->sf3 ? (offset + 1) & ~1UL : offset * 2;
+    pdta_size = 4;
+    for (i = 0; i < 9; i++) pdta_size += 8 + pdta[i].size;
+    hole_size = (unsigned long) params->hole * 1048576UL;
+    sdta_size = 4 + (hole_size ? 8 + hole_size : 0) + 8 + smpl_size;
+
+    /* RIFF sizes are 32 bits */
+    if (smpl_size > 0xFFFFFFFFUL - 96 || hole_size > 0xFFFFFFFFUL - 96 - smpl_size ||
+        pdta_size > 0xFFFFFFFFUL - 4 - 8 - 4 - 8 - 4 - 8 - 20 - 8 - sdta_size - 8) {
+        for (i = 0; i < 9; i++) free(pdta[i].data);
+        free(info.data);
+        errno = EFBIG;
+        return -1;
+    }
+
+    if (!(f = fopen(path, "wb"))) ok = -1;
+    else {
+        /* RIFF sfbk, LIST INFO, LIST sdta */
+        put32(&head, 4 + 8 + 4 + 8 + 4 + 8 + 20 + 8 + sdta_size + 8 + pdta_size);
+        if (fwrite("RIFF", 1, 4, f) != 4 || fwrite(head.data, 1, 4, f) != 4 || fwrite("sfbkLIST", 1, 8, f) != 8)
+            ok = -1;
+        head.size = 0;
+        put32(&head, 4 + 8 + 4 + 8 + 20);
+        if (!ok && (fwrite(head.data, 1, 4, f) != 4 || fwrite("INFO", 1, 4, f) != 4 ||
+                    write_chunk(f, "ifil", &info) < 0))
+            ok = -1;
+        head.size = 0;
+        put_name(&head, "unsf synthetic font");
+        if (!ok && write_chunk(f, "INAM", &head) < 0) ok = -1;
+        head.size = 0;
+        put32(&head, sdta_size);
+        put32(&head, hole_size);
+        put32(&head, smpl_size);
+        if (!ok && (fwrite("LIST", 1, 4, f) != 4 || fwrite(head.data, 1, 4, f) != 4 || fwrite("sdta", 1, 4, f) != 4))
+            ok = -1;
+        if (!ok && hole_size && (fwrite("JUNK", 1, 4, f) != 4 || fwrite(head.data + 4, 1, 4, f) != 4 ||
+                                 write_hole(f, hole_size) < 0))
+            ok = -1;
+        if (!ok && (fwrite("smpl", 1, 4, f) != 4 || fwrite(head.data + 8, 1, 4, f) != 4))
+            ok = -1;
+        for (s = 0; !ok && s < samples; s++)
+            if (write_sample(f, params, s, frames) < 0) ok = -1;
+        if (!ok && smpl_size > offset * (params->sf3 ? 1 : 2) && fputc(0, f) == EOF) ok = -1;
+
+        /* LIST pdta */
+        head.size = 0;
+        put32(&head, pdta_size);
+        if (!ok && (fwrite("LIST", 1, 4, f) != 4 || fwrite(head.data, 1, 4, f) != 4 || fwrite("pdta", 1, 4, f) != 4))
+            ok = -1;
+        for (i = 0; !ok && i < 9; i++)
+            if (write_chunk(f, ids[i], &pdta[i]) < 0) ok = -1;
+        if (fclose(f) != 0) ok = -1;
+    }
+
+    for (i = 0; i < 9; i++) free(pdta[i].data);
+    free(info.data);
+    free(head.data);
+    return ok;
+}
@@ -0,0 +1,35 @@
+#ifndef UNSF_SFGEN_H
+#define UNSF_SFGEN_H
+
+#include <stddef.h>
+
+/* shape of a synthetic SoundFont. The same parameters always give the
+same file, byte for byte, on every platform. */
+typedef struct SfGenParams
+{
+    int banks;                      /* melodic banks the presets are spread over */
+    int presets;                    /* melodic presets in all, at most 128 per bank */
+    int zones;                      /* key splits per instrument */
+    int layers;                     /* velocity layers per key split */
+    int stereo;                     /* percentage of the splits with a stereo pair of samples */
+    int kits;                       /* drum kits, their splits spanning several keys each */
+    int megabytes;                  /* sample data, shared out evenly among the samples */
+    unsigned long seed;
+    int sf3;                        /* a SoundFont 3 font, see sfgen_decode() */
+    int hole;                       /* megabytes of unused chunk ahead of smpl, seeked over so that the
+                                    file is sparse where the file system allows */
+} SfGenParams;
+
+void sfgen_defaults(SfGenParams *params);
+/* patch files unsf makes of the font: one per melodic preset, one per
+drum key */
+int sfgen_patches(const SfGenParams *params);
+/* writes the font to path; 0 on success, -1 with errno set if it could
+not be written */
+int sfgen_write(const char *path, const SfGenParams *params);
+/* the samples of an sfgen SoundFont 3 font are Ogg streams, but their
+packets hold 16-bit PCM rather than Vorbis, so that no codec is needed to
+test with. This decodes them, as a vorbis_decoder of UnSF_Options. */
+int sfgen_decode(const void *data, size_t size, short *pcm, unsigned long frames);
+
+#endif
@@ -0,0 +1,88 @@
+/*
+ * unsf-sfgen writes a synthetic SoundFont.
+ *
+ * usage: unsf-sfgen [-b banks] [-p presets] [-z zones] [-l layers]
+ *                   [-s stereo %] [-k kits] [-m megabytes] [-r seed]
+ *                   [-f 2|3] [-g megabytes] <file>
+ *
+ * -f 3 writes a SoundFont 3 font, whose samples only sfgen_decode() can
+ * decode. -g puts a gap of unused data ahead of the samples, seeked over
+ * rather than written.
+ *
+ * license: cc0
+ *
+ * To the extent possible under law, the person who associated CC0 with
+ * unsf has waived all copyright and related or neighboring rights
+ * to unsf.
+ *
+ * You should have received a copy of the CC0 legal code along with this
+ * work. If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+ *
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sfgen.h"
+
+static void usage(void) {
+    fprintf(stderr, "usage: unsf-sfgen [-b banks] [-p presets] [-z zones] [-l layers] [-s stereo %%] [-k kits]\n"
+                    "[-m megabytes] [-r seed] [-f 2|3] [-g megabytes] <file>\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    SfGenParams params;
+    int i;
+
+    sfgen_defaults(&params);
+
+    /* getopt isn't everywhere this is built */
+    for (i = 1; i < argc && argv[i][0] == '-' && argv[i][1]; i += 2) {
+        if (argv[i][2] || i + 1 >= argc) usage();
+        switch (argv[i][1]) {
+            case 'b':
+                params.banks = atoi(argv[i + 1]);
+                break;
+            case 'p':
+                params.presets = atoi(argv[i + 1]);
+                break;
+            case 'z':
+                params.zones = atoi(argv[i + 1]);
+                break;
+            case 'l':
+                params.layers = atoi(argv[i + 1]);
+                break;
+            case 's':
+                params.stereo = atoi(argv[i + 1]);
+                break;
+            case 'k':
+                params.kits = atoi(argv[i + 1]);
+                break;
+            case 'm':
+                params.megabytes = atoi(argv[i + 1]);
+                break;
+            case 'r':
+                params.seed = strtoul(argv[i + 1], NULL, 10);
+                break;
+            case 'f':
+                params.sf3 = atoi(argv[i + 1]) == 3;
+                break;
+            case 'g':
+                params.hole = atoi(argv[i + 1]);
+                break;
+            default:
+                usage();
+        }
+    }
+    if (i != argc - 1) usage();
+
+    if (sfgen_write(argv[i], &params) < 0) {
+        fprintf(stderr, "Could not write %s: %s\n", argv[i], strerror(errno));
+        return 1;
+    }
+    printf("Wrote %s, %d patches\n", argv[i], sfgen_patches(&params));
+    return 0;
+}
@@ -13,27 +13,57 @@
  *
  */
 
+#if defined(HAVE_COPY_FILE_RANGE) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+#if defined(HAVE_FSEEKO) && !defined(_FILE_OFFSET_BITS)
+#define _FILE_OFFSET_BITS 64
+#endif
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
 #include <math.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #ifdef _WIN32
 #ifndef WIN32_LEAN_AND_MEAN
 #define WIN32_LEAN_AND_MEAN
 #endif
 #include <windows.h>
+#include <io.h>
+#include <fcntl.h>
 #elif defined(__OS2__)
 #define INCL_DOS
 #define INCL_DOSERRORS
 #include <os2.h>
 #include <io.h>
+#include <fcntl.h>
 #else
 #include <unistd.h>
+#include <fcntl.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#endif
+#ifdef HAVE_GETRUSAGE
+#include <sys/resource.h>
+#endif
+#ifdef HAVE_VORBISFILE
+#include <vorbis/vorbisfile.h>
+#endif
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#if defined(__linux__) && defined(HAVE_PERF_EVENT)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
 #endif
 
 #include "libunsf.h"
@@ -42,10 +72,6 @@
 #include "strtok_r.h"
 #endif
 
-#ifdef _WIN32
-#define strdup _strdup
-#endif
-
 #ifndef TRUE
 #define TRUE         1
 #define FALSE        0
@@ -66,6 +92,135 @@
 
 #define UNSF_RANGE 128
 
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#if defined(_MSC_VER) && (_MSC_VER < 1300)
+typedef unsigned __int64 unsf_uint64;
+#else
+typedef unsigned long long unsf_uint64;
+#endif
+#define UNSF_U64(hi, lo) ((((unsf_uint64) (hi)) << 32) | (unsf_uint64) (lo))
+
+/* file offsets, 64-bit where the C library allows it */
+#if defined(_MSC_VER) && (_MSC_VER >= 1400)
+typedef __int64 unsf_off_t;
+#define unsf_fseek _fseeki64
+#define unsf_ftell _ftelli64
+#elif defined(HAVE_FSEEKO)
+typedef off_t unsf_off_t;
+#define unsf_fseek fseeko
+#define unsf_ftell ftello
+#else
+typedef long unsf_off_t;
+#define unsf_fseek fseek
+#define unsf_ftell ftell
+#endif
+
+/* seconds on a monotonic clock, for the stage timings */
+static double unsf_clock(void) {
+#ifdef _WIN32
+    LARGE_INTEGER count, freq;
+
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&freq);
+    return (double) count.QuadPart / (double) freq.QuadPart;
+#elif defined(HAVE_CLOCK_GETTIME)
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#else
+    return (double) clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+/* the most memory the process has had resident, in bytes; 0 where it
+ * can't be told */
+static double max_rss(void) {
+#ifdef HAVE_GETRUSAGE
+    struct rusage ru;
+
+    if (getrusage(RUSAGE_SELF, &ru) != 0) return 0;
+#ifdef __APPLE__
+    return (double) ru.ru_maxrss;
+#else
+    return (double) ru.ru_maxrss * 1024;
+#endif
+#else
+    return 0;
+#endif
+}
+
+/* sample positions are kept in ints, so this many frames at most */
+#define SMPL_MAX_FRAMES 0x7FFFFFFFUL
+
+/* the counts of the conversion running on this thread. They are kept
+ * apart from PatchOutput so that the allocator and the directory helpers,
+ * which aren't handed one, can count as well. */
+#if defined(_MSC_VER)
+#define UNSF_THREAD_LOCAL __declspec(thread)
+#elif defined(__GNUC__) && !defined(__EMX__)
+#define UNSF_THREAD_LOCAL __thread
+#else
+#define UNSF_THREAD_LOCAL
+#endif
+
+static UNSF_THREAD_LOCAL UnSF_Counters unsf_counters;
+
+/* the bytes held by the main structures, and the most they held */
+static UNSF_THREAD_LOCAL UnSF_Memory unsf_memory, unsf_memory_peak;
+
+#define MEM_HOLD(what, bytes)    mem_account(&unsf_memory.what, &unsf_memory_peak.what, (double) (bytes))
+#define MEM_RELEASE(what, bytes) mem_account(&unsf_memory.what, &unsf_memory_peak.what, -(double) (bytes))
+
+static void mem_account(double *held, double *peak, double bytes) {
+    *held += bytes;
+    if (*held > *peak) *peak = *held;
+    unsf_memory.total += bytes;
+    if (unsf_memory.total > unsf_memory_peak.total) unsf_memory_peak.total = unsf_memory.total;
+}
+
+/* malloc() and friends, counted; what they return is free()d as usual */
+static void *unsf_malloc(size_t size) {
+    void *p = malloc(size);
+
+    if (p) {
+        unsf_counters.allocations++;
+        unsf_counters.allocated += size;
+    }
+    return p;
+}
+
+static void *unsf_calloc(size_t count, size_t size) {
+    void *p = calloc(count, size);
+
+    if (p) {
+        unsf_counters.allocations++;
+        unsf_counters.allocated += (double) count * size;
+    }
+    return p;
+}
+
+static void *unsf_realloc(void *old, size_t size) {
+    void *p = realloc(old, size);
+
+    if (p) {
+        unsf_counters.allocations++;
+        unsf_counters.allocated += size;
+    }
+    return p;
+}
+
+static char *unsf_strdup(const char *s) {
+    size_t size = strlen(s) + 1;
+    char *p = (char *) unsf_malloc(size);
+
+    if (p) memcpy(p, s, size);
+    return p;
+}
+
 /* SoundFont parameters for the current sample */
 typedef struct SF_Meta {
     int mode;
@@ -157,18 +312,37 @@ typedef struct SampleBank {
     int drum_samples_left[UNSF_RANGE][UNSF_RANGE];
     int drum_samples_right[UNSF_RANGE][UNSF_RANGE];
     VelocityRangeList *drum_velocity[UNSF_RANGE][UNSF_RANGE];
+    /* cfg name of a patch when it lives in the patch store instead of the bank directory */
+    char *voice_path[UNSF_RANGE][UNSF_RANGE];
+    char *drum_path[UNSF_RANGE][UNSF_RANGE];
+    /* hash of the zones sounding on each drum key, and 1 + the key whose patch it shares (0 for none) */
+    unsf_uint64 drum_zones[UNSF_RANGE][UNSF_RANGE];
+    unsigned char drum_alias[UNSF_RANGE][UNSF_RANGE];
     char cpyrt[256];
 } SampleBank;
 
 
 /* SoundFont chunk format and ID values */
 typedef struct RIFF_CHUNK {
-    int size;
+    unsigned long size;
     int id;
     int type;
-    int end;
+    unsf_off_t end;
 } RIFF_CHUNK;
 
+/* the SoundFont being read. The position is counted rather than asked
+ * for, so that a pipe, which can't seek or tell, is read front to back. */
+typedef struct SfInput {
+    FILE *f;
+    unsf_off_t pos;
+    int seekable;
+} SfInput;
+
+/* a stretch of smpl the instruments use */
+typedef struct SmplRange {
+    unsigned long start, end;           /* in samples */
+} SmplRange;
+
 /* SoundFont preset headers */
 typedef struct sfPresetHeader {
     char achPresetName[20];
@@ -236,6 +410,311 @@ typedef struct sfSample {
     unsigned short sfSampleType;        /* 1 mono,2 right,4 left,linked 8,0x8000=ROM */
 } sfSample;
 
+/* index entry of a packed patch archive */
+typedef struct ArchiveEntry {
+    unsigned char flags;
+    unsigned char bank;
+    unsigned char program;
+    unsigned long name_offset;
+    unsigned long name_length;
+    unsigned char frame;                /* ARCHIVE_LZ and ARCHIVE_DELTA */
+    unsf_uint64 offset;
+    unsf_uint64 length;
+    unsf_uint64 stored;                 /* length in the archive */
+    unsf_uint64 hash;
+    int next;                           /* next entry in the same hash bucket */
+} ArchiveEntry;
+
+#define ARCHIVE_DRUM 1
+#define ARCHIVE_LZ 1
+#define ARCHIVE_DELTA 2
+#define ARCHIVE_ALIGN 64
+#define ARCHIVE_HEADER_SIZE 64
+#define ARCHIVE_ENTRY_SIZE 32
+#define ARCHIVE_BUCKETS 4096
+
+/* a patch file of the inspect listing */
+typedef struct InspectFile {
+    char *path;
+    int order;                          /* later ones overwrite earlier ones */
+    unsf_uint64 size;
+} InspectFile;
+
+/* sample data to be handed to the patch sink in place of a copy */
+typedef struct PatchView {
+    size_t offset;                      /* position in the patch buffer */
+    const short *data;
+    int length;                         /* in samples */
+} PatchView;
+
+typedef struct AsyncWriter AsyncWriter;
+
+/* where a SoundFont 3 sample is in smpl, and its decoded PCM if cached */
+typedef struct Sf3Sample {
+    unsigned long offset;               /* in bytes */
+    unsigned long size;
+    unsigned long frames;
+    int compressed;
+    short *pcm;
+    unsigned long alloced;              /* in samples */
+    unsigned long last_use;
+} Sf3Sample;
+
+/* what an output patch was made from, for incremental conversion */
+typedef struct ManifestEntry {
+    char *path;                         /* "<bank directory>/<patch name>.pat" */
+    unsf_uint64 hash;                   /* of all inputs of the patch */
+    long size;
+    VelocityRangeList **vlist;          /* cleared if the patch failed */
+    int next;                           /* next entry in the same hash bucket */
+} ManifestEntry;
+
+#define MANIFEST_BUCKETS 4096
+#define MANIFEST_VERSION 1
+
+typedef struct Manifest {
+    ManifestEntry *entries;
+    int count;
+    int alloced;
+    int buckets[MANIFEST_BUCKETS];
+} Manifest;
+
+/* a span of the conversion, for the Chrome trace */
+typedef struct TraceEvent {
+    const char *name;
+    const char *cat;
+    double start, end;                  /* unsf_clock() */
+    int drum, bank, program, layer;     /* -1 where they don't apply */
+    const char *channel;
+    size_t bytes;
+} TraceEvent;
+
+/* one line of the opt_report */
+typedef struct PatchCost {
+    int drum, bank, program;
+    int layers, stereo;
+    unsigned long samples;
+    double input, output;               /* bytes */
+    double resolve, encode, write;      /* seconds */
+} PatchCost;
+
+/* where the counters stood before a patch, to tell what it cost */
+typedef struct CostMark {
+    unsigned long samples;
+    double input, output;
+    double resolve, encode, write;
+} CostMark;
+
+/* what writing a plain patch file did, for a cancelled conversion */
+#define PATCH_CREATED  1
+#define PATCH_REPLACED 2
+
+/* where the finished patches go */
+typedef struct PatchOutput {
+    /* packed patch archive */
+    FILE *archive_fd;
+    char *archive_name;
+    char *archive_path;                 /* the temporary file it is written to */
+    unsf_uint64 archive_pos;
+    ArchiveEntry *entries;
+    int entry_count;
+    int entries_alloced;
+    char *names;
+    unsigned long names_size;
+    unsigned long names_alloced;
+    int buckets[ARCHIVE_BUCKETS];
+    int archive_compress;               /* 1 LZ frames, 2 with delta encoded waveforms */
+    unsigned char *frame;
+    size_t frame_alloced;
+    unsigned int *lz_table;
+
+    /* in-memory sink */
+    int zero_copy;
+    PatchView *views;
+    int view_count;
+    int views_alloced;
+    UnSF_Segment *segments;
+    int segments_alloced;
+
+    /* patch store, as the cfg refers to it when a link can't be made */
+    char *store_path;
+
+    /* asynchronous writer for plain patch files, if available */
+    AsyncWriter *async;
+
+    /* SoundFont 3: the smpl chunk and the samples decoded from it */
+    int sf3;
+    unsigned char *sf3_data;
+    unsigned long sf3_size;
+    Sf3Sample *sf3_samples;
+    int sf3_count;
+    int (*decoder)(const void *data, size_t size, short *pcm, unsigned long frames);
+    sfSample *sf_samples;
+    unsigned long cache_size;
+    unsigned long cache_limit;
+    unsigned long cache_clock;
+
+    /* soundfont the 16-bit waveforms are copied from by the kernel, and
+     * the patches put back together for the other writers */
+    int source_fd;
+    long source_block;
+    unsigned char *flat;
+    size_t flat_alloced;
+    unsf_off_t smpl_offset;
+    const short *smpl_data;
+    unsigned long smpl_frames;
+
+    /* open output directory and the bank directories made in it */
+    int root_fd;
+    int dir_count;
+    char *dir_names[2 * UNSF_RANGE];
+    int dir_fds[2 * UNSF_RANGE];
+
+    /* ustar stream the patches and the cfg go to instead of files */
+    FILE *tar_fd;
+    unsigned long tar_mtime;
+
+    /* cfg kept in memory, for the tar stream or for publishing */
+    int cfg_in_memory;
+    char *cfg_text;
+    size_t cfg_size;
+    size_t cfg_alloced;
+    size_t cfg_head;                    /* the soundfont info at the top */
+
+    /* the cfg replaces the old one once the conversion is done; in
+     * priority mode it is republished as patches get done */
+    char *publish_path;
+    int progressive;
+    int cfg_existed;
+    time_t published_at;
+    unsigned char done[2][UNSF_RANGE][UNSF_RANGE];
+
+    /* incremental conversion: the manifest of the last run and of this one */
+    Manifest *manifest_old;
+    Manifest *manifest_new;
+    int resolve_only;                   /* only hash the inputs of a patch */
+    unsf_uint64 input_hash;
+
+    /* inspect mode: patches are sized, not encoded */
+    int inspect;
+    unsf_uint64 inspect_size;           /* waveform bytes of the patch so far */
+    unsf_uint64 patch_sizes[2][UNSF_RANGE][UNSF_RANGE];
+
+    UnSF_Stats stats;
+
+    /* opt_report: the cost of each patch, and the PCM the patches read */
+    PatchCost *costs;
+    int cost_count, costs_alloced;
+    double sample_bytes;
+
+    /* progress reports, and whether the caller has cancelled */
+    UnSF_Progress progress;
+    double progress_start;
+    int cancelled;
+    unsigned char written[2][UNSF_RANGE][UNSF_RANGE];   /* plain patch files: PATCH_CREATED or PATCH_REPLACED */
+    unsigned char made_dir[2][UNSF_RANGE];              /* bank directories this run made */
+
+    /* opt_perf: the hardware counters that could be opened, as one group
+     * led by the first, and the UNSF_PERF_ bit each one counts */
+    int perf_count;
+    int perf_fd[4];
+    int perf_bit[4];
+    UnSF_PerfCounters perf_start;
+
+    /* the spans recorded for options->trace_file. Only the thread running
+     * the conversion adds to them, so they need no lock. */
+    TraceEvent *trace;
+    int trace_count, trace_alloced;
+    double trace_start;
+    unsigned long trace_tid;
+} PatchOutput;
+
+/* the hardware counters of the thread so far; FALSE when they aren't
+ * open or can't be read */
+static int perf_read(PatchOutput *out, UnSF_PerfCounters *now) {
+#if defined(__linux__) && defined(HAVE_PERF_EVENT)
+    /* PERF_FORMAT_GROUP: nr, time enabled, time running, the values */
+    unsf_uint64 buf[3 + 4];
+    double scale;
+    int i;
+
+    if (!out->perf_count) return FALSE;
+    memset(now, 0, sizeof(UnSF_PerfCounters));
+    if (read(out->perf_fd[0], buf, sizeof(buf)) < (ssize_t) ((3 + out->perf_count) * sizeof(unsf_uint64)))
+        return FALSE;
+    /* scaled up for the time the group wasn't on the processor */
+    scale = buf[2] ? (double) buf[1] / (double) buf[2] : 0;
+    for (i = 0; i < out->perf_count; i++) {
+        switch (out->perf_bit[i]) {
+            case UNSF_PERF_CYCLES: now->cycles = buf[3 + i] * scale; break;
+            case UNSF_PERF_INSTRUCTIONS: now->instructions = buf[3 + i] * scale; break;
+            case UNSF_PERF_CACHE_MISSES: now->cache_misses = buf[3 + i] * scale; break;
+            case UNSF_PERF_BRANCH_MISSES: now->branch_misses = buf[3 + i] * scale; break;
+        }
+    }
+    return TRUE;
+#else
+    (void) out;
+    (void) now;
+    return FALSE;
+#endif
+}
+
+/* adds what the counters did since from to stage */
+static void perf_add(PatchOutput *out, UnSF_PerfCounters *stage, const UnSF_PerfCounters *from) {
+    UnSF_PerfCounters now;
+
+    if (!perf_read(out, &now)) return;
+    stage->cycles += now.cycles - from->cycles;
+    stage->instructions += now.instructions - from->instructions;
+    stage->cache_misses += now.cache_misses - from->cache_misses;
+    stage->branch_misses += now.branch_misses - from->branch_misses;
+}
+
+static void perf_close(PatchOutput *out) {
+#if defined(__linux__) && defined(HAVE_PERF_EVENT)
+    /* members before the leader */
+    while (out->perf_count > 0) close(out->perf_fd[--out->perf_count]);
+#else
+    (void) out;
+#endif
+}
+
+/* opens what it can of the counters and starts them. Any of them may be
+ * missing from the processor or the kernel, and all of them are where
+ * perf_event_paranoid or a seccomp filter forbids perf_event_open. */
+static void perf_open(UnSF_Options *options, PatchOutput *out) {
+#if defined(__linux__) && defined(HAVE_PERF_EVENT) && defined(SYS_perf_event_open)
+    static const unsigned long long config[4] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+    };
+    struct perf_event_attr attr;
+    int i, fd;
+
+    if (!options->opt_perf || !options->stats) return;
+    for (i = 0; i < 4; i++) {
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = config[i];
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        attr.disabled = !out->perf_count;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = (int) syscall(SYS_perf_event_open, &attr, 0, -1, out->perf_count ? out->perf_fd[0] : -1, 0);
+        if (fd < 0) continue;
+        out->perf_fd[out->perf_count] = fd;
+        out->perf_bit[out->perf_count++] = 1 << i;
+    }
+    if (out->perf_count && ioctl(out->perf_fd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP) < 0) perf_close(out);
+    for (i = 0; i < out->perf_count; i++) out->stats.perf.available |= out->perf_bit[i];
+    perf_read(out, &out->perf_start);
+#else
+    (void) options;
+    (void) out;
+#endif
+}
+
 /* list of the layers waiting to be dealt with */
 typedef struct EMPTY_WHITE_ROOM {
     sfSample *sample;
@@ -577,59 +1056,357 @@ static const double bend_coarse[UNSF_RANGE] = {
 
 
 /* reads a byte from the input file */
-static int get8(FILE *f) {
-    return getc(f);
+static int get8(SfInput *in) {
+    in->pos++;
+    unsf_counters.bytes_read++;
+    return getc(in->f);
 }
 
 /* reads a word from the input file (little endian) */
-static int get16(FILE *f) {
+static int get16(SfInput *in) {
     int b1, b2;
 
-    b1 = get8(f);
-    b2 = get8(f);
+    b1 = get8(in);
+    b2 = get8(in);
 
     return ((b2 << 8) | b1);
 }
 
 /* reads a int from the input file (little endian) */
-static int get32(FILE *f) {
+static int get32(SfInput *in) {
     int b1, b2, b3, b4;
 
-    b1 = get8(f);
-    b2 = get8(f);
-    b3 = get8(f);
-    b4 = get8(f);
+    b1 = get8(in);
+    b2 = get8(in);
+    b3 = get8(in);
+    b4 = get8(in);
 
     return ((b4 << 24) | (b3 << 16) | (b2 << 8) | b1);
 }
 
 
-/* calculates the file offset for the end of a chunk */
-static void calc_end(RIFF_CHUNK *chunk, FILE *f) {
-    chunk->end = ftell(f) + chunk->size + (chunk->size & 1);
+/* reads an unsigned 32-bit size or offset from the input file */
+static unsigned long getu32(SfInput *in) {
+    return (unsigned long) get32(in) & 0xFFFFFFFFUL;
+}
+
+
+static size_t sf_read(SfInput *in, void *data, size_t size) {
+    size_t n = fread(data, 1, size, in->f);
+
+    in->pos += n;
+    unsf_counters.bytes_read += n;
+    return n;
+}
+
+
+/* reads 16-bit samples (little endian) */
+static int sf_read_samples(SfInput *in, short *data, unsigned long count) {
+    unsigned char buf[8192];
+    size_t i, n;
+
+    while (count) {
+        n = count < sizeof(buf) / 2 ? (size_t) count : sizeof(buf) / 2;
+        if (sf_read(in, buf, n * 2) != n * 2) return FALSE;
+        for (i = 0; i < n; i++) data[i] = (short) (buf[2 * i] | (buf[2 * i + 1] << 8));
+        data += n;
+        count -= n;
+    }
+    return TRUE;
+}
+
+
+/* moves on to a file offset; an input that can't seek is read up to it,
+ * so it can only go forward. Running into the end of the file is left
+ * for feof() to find. */
+static int sf_skip_to(SfInput *in, unsf_off_t pos) {
+    char buf[8192];
+    size_t n;
+
+    if (in->seekable) {
+        if (unsf_fseek(in->f, pos, SEEK_SET) < 0) return FALSE;
+        in->pos = pos;
+        return TRUE;
+    }
+    if (pos < in->pos) {
+#ifdef ESPIPE
+        errno = ESPIPE;
+#endif
+        return FALSE;
+    }
+    while (in->pos < pos) {
+        n = pos - in->pos < (unsf_off_t) sizeof(buf) ? (size_t) (pos - in->pos) : sizeof(buf);
+        if (sf_read(in, buf, n) != n) return !ferror(in->f);
+    }
+    return TRUE;
+}
+
+
+/* calculates the file offset for the end of a chunk, FALSE if it is
+ * past what a file offset can hold */
+static int calc_end(RIFF_CHUNK *chunk, SfInput *in) {
+    unsf_off_t pos = in->pos;
+    unsf_uint64 end = (unsf_uint64) pos + chunk->size + (chunk->size & 1);
+
+    if (pos < 0) return FALSE;
+    chunk->end = (unsf_off_t) end;
+    return chunk->end >= pos && (unsf_uint64) chunk->end == end;
+}
+
+
+#define HASH_PRIME1 UNSF_U64(0x9E3779B1, 0x85EBCA87)
+#define HASH_PRIME2 UNSF_U64(0xC2B2AE3D, 0x27D4EB4F)
+#define HASH_PRIME3 UNSF_U64(0x165667B1, 0x9E3779F9)
+#define HASH_PRIME4 UNSF_U64(0x85EBCA77, 0xC2B2AE63)
+#define HASH_PRIME5 UNSF_U64(0x27D4EB2F, 0x165667C5)
+#define HASH_ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static unsf_uint64 hash_read64(const unsigned char *p) {
+    return UNSF_U64((unsigned long) p[4] | ((unsigned long) p[5] << 8) | ((unsigned long) p[6] << 16) |
+                    ((unsigned long) p[7] << 24),
+                    (unsigned long) p[0] | ((unsigned long) p[1] << 8) | ((unsigned long) p[2] << 16) |
+                    ((unsigned long) p[3] << 24));
+}
+
+static unsf_uint64 hash_round(unsf_uint64 acc, unsf_uint64 input) {
+    acc += input * HASH_PRIME2;
+    acc = HASH_ROTL(acc, 31);
+    return acc * HASH_PRIME1;
+}
+
+static unsf_uint64 hash_merge(unsf_uint64 acc, unsf_uint64 val) {
+    acc ^= hash_round(0, val);
+    return acc * HASH_PRIME1 + HASH_PRIME4;
+}
+
+/* 64-bit hash of a block (xxHash64). The four independent lanes of the
+ * main loop let the compiler keep several multiplies in flight. */
+static unsf_uint64 unsf_hash(const void *data, size_t len, unsf_uint64 seed) {
+    const unsigned char *p = (const unsigned char *) data;
+    const unsigned char *end = p + len;
+    unsf_uint64 h, k;
+
+    if (len >= 32) {
+        unsf_uint64 v1 = seed + HASH_PRIME1 + HASH_PRIME2;
+        unsf_uint64 v2 = seed + HASH_PRIME2;
+        unsf_uint64 v3 = seed;
+        unsf_uint64 v4 = seed - HASH_PRIME1;
+        const unsigned char *limit = end - 32;
+
+        do {
+            v1 = hash_round(v1, hash_read64(p));
+            v2 = hash_round(v2, hash_read64(p + 8));
+            v3 = hash_round(v3, hash_read64(p + 16));
+            v4 = hash_round(v4, hash_read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+
+        h = HASH_ROTL(v1, 1) + HASH_ROTL(v2, 7) + HASH_ROTL(v3, 12) + HASH_ROTL(v4, 18);
+        h = hash_merge(h, v1);
+        h = hash_merge(h, v2);
+        h = hash_merge(h, v3);
+        h = hash_merge(h, v4);
+    } else h = seed + HASH_PRIME5;
+
+    h += (unsf_uint64) len;
+
+    while (p + 8 <= end) {
+        k = hash_round(0, hash_read64(p));
+        h ^= k;
+        h = HASH_ROTL(h, 27) * HASH_PRIME1 + HASH_PRIME4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        k = (unsf_uint64) ((unsigned long) p[0] | ((unsigned long) p[1] << 8) | ((unsigned long) p[2] << 16) |
+                           ((unsigned long) p[3] << 24));
+        h ^= k * HASH_PRIME1;
+        h = HASH_ROTL(h, 23) * HASH_PRIME2 + HASH_PRIME3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= (*p++) * HASH_PRIME5;
+        h = HASH_ROTL(h, 11) * HASH_PRIME1;
+    }
+
+    h ^= h >> 33;
+    h *= HASH_PRIME2;
+    h ^= h >> 29;
+    h *= HASH_PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+
+static unsf_uint64 get_le(const unsigned char *p, int bytes) {
+    unsf_uint64 val = 0;
+    while (bytes--) val = (val << 8) | p[bytes];
+    return val;
+}
+
+/* the id the trace shows for the converting thread */
+static unsigned long trace_thread_id(void) {
+#ifdef _WIN32
+    return (unsigned long) GetCurrentThreadId();
+#elif defined(__linux__) && defined(SYS_gettid)
+    return (unsigned long) syscall(SYS_gettid);
+#else
+    return 1;
+#endif
+}
+
+/* records a span from start until now when tracing; the caller fills in
+ * what it knows of the patch */
+static TraceEvent *trace_add(PatchOutput *out, const char *name, const char *cat, double start) {
+    TraceEvent *e;
+
+    if (!out->trace_tid) return NULL;
+    if (out->trace_count == out->trace_alloced) {
+        out->trace_alloced = out->trace_alloced ? out->trace_alloced * 2 : 256;
+        out->trace = (TraceEvent *) unsf_realloc(out->trace, out->trace_alloced * sizeof(TraceEvent));
+        if (!out->trace) BAD_ALLOCATE();
+    }
+    e = &out->trace[out->trace_count++];
+    e->name = name;
+    e->cat = cat;
+    e->start = start;
+    e->end = unsf_clock();
+    e->drum = e->bank = e->program = e->layer = -1;
+    e->channel = NULL;
+    e->bytes = 0;
+    return e;
+}
+
+/* records a span of work on one patch */
+static TraceEvent *trace_patch(PatchOutput *out, const char *name, int drum, int bank, int program, double start,
+                               size_t bytes) {
+    TraceEvent *e = trace_add(out, name, "patch", start);
+
+    if (e) {
+        e->drum = drum;
+        e->bank = bank;
+        e->program = program;
+        e->bytes = bytes;
+    }
+    return e;
+}
+
+/* writes the recorded spans as Chrome trace events, in microseconds from
+ * the start of the conversion */
+static void trace_write(UnSF_Options *options, PatchOutput *out) {
+    FILE *f;
+    TraceEvent *e;
+    int i;
+
+    if (!(f = fopen(options->trace_file, "w"))) {
+        fprintf(stderr, "Couldn't open %s for writing.\n", options->trace_file);
+        return;
+    }
+    fprintf(f, "{\"traceEvents\": [\n");
+    fprintf(f, "  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %lu, "
+               "\"args\": {\"name\": \"unsf\"}}", out->trace_tid);
+    for (i = 0; i < out->trace_count; i++) {
+        e = &out->trace[i];
+        fprintf(f, ",\n  {\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, "
+                   "\"pid\": 1, \"tid\": %lu", e->name, e->cat, (e->start - out->trace_start) * 1e6,
+                (e->end - e->start) * 1e6, out->trace_tid);
+        if (e->bank >= 0) {
+            fprintf(f, ", \"args\": {\"%s\": %d, \"program\": %d, ", e->drum ? "drumset" : "bank", e->bank,
+                    e->program);
+            if (e->layer >= 0) fprintf(f, "\"layer\": %d, ", e->layer);
+            if (e->channel) fprintf(f, "\"channel\": \"%s\", ", e->channel);
+            fprintf(f, "\"bytes\": %lu}", (unsigned long) e->bytes);
+        }
+        fprintf(f, "}");
+    }
+    fprintf(f, "\n], \"displayTimeUnit\": \"ms\"}\n");
+    if (fclose(f) != 0) fprintf(stderr, "Could not write %s\n", options->trace_file);
+}
+
+/* writes to the config file; when it goes into a tar stream or gets
+ * published bit by bit it is kept in memory, room having been made by
+ * emit_cfg() */
+static void cfg_printf(UnSF_Options *options, PatchOutput *out, const char *fmt, ...) {
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    if (out->cfg_in_memory) out->cfg_size += vsprintf(out->cfg_text + out->cfg_size, fmt, ap);
+    else if ((n = vfprintf(options->cfg_fd, fmt, ap)) > 0) unsf_counters.bytes_written += n;
+    va_end(ap);
 }
 
+/* writes a line of the config file, or hands it to the cfg sink */
+static void emit_cfg(UnSF_Options *options, PatchOutput *out, const UnSF_CfgEntry *entry) {
+    if (options->cfg_sink) {
+        options->cfg_sink(options->sink_data, entry);
+        return;
+    }
+    if (out->cfg_in_memory) {
+        size_t room = out->cfg_size + 128 + strlen(entry->name) + (entry->text ? strlen(entry->text) : 0);
+        if (room > out->cfg_alloced) {
+            MEM_RELEASE(buffers, out->cfg_alloced);
+            out->cfg_alloced = (room + 4095) & ~(size_t) 4095;
+            MEM_HOLD(buffers, out->cfg_alloced);
+            if (!(out->cfg_text = (char *) unsf_realloc(out->cfg_text, out->cfg_alloced))) BAD_ALLOCATE();
+        }
+    } else if (!options->cfg_fd) return;
+
+    switch (entry->type) {
+        case UNSF_CFG_INFO:
+            cfg_printf(options, out, "# %-12s%s\n", entry->name, entry->text);
+            break;
+        case UNSF_CFG_DIR:
+            cfg_printf(options, out, "\ndir %s\n", entry->name);
+            break;
+        case UNSF_CFG_BANK:
+            cfg_printf(options, out, "\nbank %d #N %s\n", entry->bank, entry->name);
+            break;
+        case UNSF_CFG_DRUMSET:
+            cfg_printf(options, out, "\ndrumset %d #N %s\n", entry->bank, entry->name);
+            break;
+        case UNSF_CFG_PATCH:
+            cfg_printf(options, out, "\t%d %s", entry->program, entry->name);
+            if (entry->velocity_ranges > 1) cfg_printf(options, out, "\t# %d velocity ranges", entry->velocity_ranges);
+            if (entry->stereo) {
+                if (entry->velocity_ranges == 1) cfg_printf(options, out, "\t# stereo");
+                else cfg_printf(options, out, ", stereo");
+            }
+            cfg_printf(options, out, "\n");
+            break;
+        case UNSF_CFG_MISSING:
+            cfg_printf(options, out, "\t# %d %s could not be extracted\n", entry->program, entry->name);
+            break;
+    }
+}
 
 /* reads and displays a SoundFont text/copyright message */
-static void print_sf_string(UnSF_Options *options, FILE *f, const char *title, int opt_no_write, SampleBank *samplebank) {
+static void print_sf_string(UnSF_Options *options, SfInput *in, const char *title, int opt_no_write, SampleBank *samplebank,
+                            PatchOutput *out) {
     char buf[256];
     char ch;
     int i = 0;
 
     do {
-        ch = get8(f);
+        ch = get8(in);
         buf[i++] = ch;
     } while ((ch) && (i < 256));
 
     if (i & 1)
-        get8(f);
+        get8(in);
 
     if (!strncmp(title, "Made", 4)) {
         strcpy(samplebank->cpyrt, "Made by ");
         strcat(samplebank->cpyrt, buf);
     }
 
-    if (!opt_no_write) fprintf(options->cfg_fd, "# %-12s%s\n", title, buf);
+    if (!opt_no_write) {
+        UnSF_CfgEntry entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.type = UNSF_CFG_INFO;
+        entry.name = title;
+        entry.text = buf;
+        emit_cfg(options, out, &entry);
+    }
 }
 
 static char *getname(char *p) {
@@ -704,8 +1481,9 @@ record_velocity_range(UnSF_Options *options, SampleBank *sample_bank, int drum,
     }
 
     if (!vlist) {
-        vlist = (VelocityRangeList *) malloc(sizeof(VelocityRangeList));
+        vlist = (VelocityRangeList *) unsf_malloc(sizeof(VelocityRangeList));
         if (!vlist) BAD_ALLOCATE();
+        MEM_HOLD(banks, sizeof(VelocityRangeList));
         if (drum) sample_bank->drum_velocity[banknum][program] = vlist;
         else sample_bank->voice_velocity[banknum][program] = vlist;
         vlist->range_count = 0;
@@ -813,14 +1591,14 @@ static int grab_soundfont_banks(UnSF_Options *options, int sf_num_presets, sfPre
 
         if (drum) {
             if (!sample_bank->drumset_name[options->opt_drum_bank]) {
-                sample_bank->drumset_short_name[options->opt_drum_bank] = strdup(s);
+                sample_bank->drumset_short_name[options->opt_drum_bank] = unsf_strdup(s);
                 sprintf(tmpname, "%s-%s", options->basename, s);
-                sample_bank->drumset_name[options->opt_drum_bank] = strdup(tmpname);
+                sample_bank->drumset_name[options->opt_drum_bank] = unsf_strdup(tmpname);
                 if (options->opt_verbose) printf("drumset #%d %s\n", options->opt_drum_bank, s);
             }
         } else {
             if (!sample_bank->voice_name[options->opt_bank][wanted_patch]) {
-                sample_bank->voice_name[options->opt_bank][wanted_patch] = strdup(s);
+                sample_bank->voice_name[options->opt_bank][wanted_patch] = unsf_strdup(s);
                 if (options->opt_verbose) printf("bank #%d voice #%d %s\n", options->opt_bank, wanted_patch, s);
                 sample_bank->tonebank[options->opt_bank] = TRUE;
             }
@@ -979,10 +1757,24 @@ static int grab_soundfont_banks(UnSF_Options *options, int sf_num_presets, sfPre
 
                         if (drum) {
                             int pool_num;
+                            int zone[7];
+
+                            /* identifies the zone for drum patch sharing */
+                            zone[0] = pnum;
+                            zone[1] = inum;
+                            zone[2] = lnum;
+                            zone[3] = (int) (iheader - sf_instruments);
+                            zone[4] = velmin;
+                            zone[5] = velmax;
+                            zone[6] = sample->sfSampleType;
+
                             for (pool_num = keymin; pool_num <= keymax; pool_num++) {
                                 drumnum = pool_num;
+                                sample_bank->drum_zones[options->opt_drum_bank][drumnum] =
+                                        unsf_hash(zone, sizeof(zone),
+                                                  sample_bank->drum_zones[options->opt_drum_bank][drumnum]);
                                 if (!sample_bank->drum_name[options->opt_drum_bank][drumnum]) {
-                                    sample_bank->drum_name[options->opt_drum_bank][drumnum] = strdup(s);
+                                    sample_bank->drum_name[options->opt_drum_bank][drumnum] = unsf_strdup(s);
                                     if (options->opt_verbose)
                                         printf("drumset #%d drum #%d %s\n", options->opt_drum_bank, drumnum, s);
                                 }
@@ -1019,7 +1811,7 @@ static char *unsf_concat(const char *s1, const char *s2) {
     size_t len1 = strlen(s1);
     size_t len2 = strlen(s2);
     char *result = NULL;
-    if (!(result = (char *) malloc(len1 + len2 + 1))) { /* +1 for the zero-terminator */
+    if (!(result = (char *) unsf_malloc(len1 + len2 + 1))) { /* +1 for the zero-terminator */
         fprintf(stderr, "Memory allocation failed with mem size %lu\n", (long unsigned int) (len1 + len2 + 1));
         exit(1); /* FIXME: library must NOT exit() */
     }
@@ -1028,39 +1820,110 @@ static char *unsf_concat(const char *s1, const char *s2) {
     return result;
 }
 
+/* "<dir>/<name>", the way patches are named in the cfg */
+static char *unsf_patch_name(const char *dir, const char *name) {
+    char *result = (char *) unsf_malloc(strlen(dir) + strlen(name) + 2);
+    if (!result) BAD_ALLOCATE();
+    sprintf(result, "%s/%s", dir, name);
+    return result;
+}
+
 #ifdef _WIN32
 static int sys_mkdir(const char *p) {
-    if (CreateDirectory(p, NULL) != 0) return 0;
+    if (CreateDirectory(p, NULL) != 0) {
+        unsf_counters.directories++;
+        return 0;
+    }
     if (GetLastError() == ERROR_ALREADY_EXISTS) return 0;
     return -1;
 }
+
+static int sys_rmdir(const char *p) {
+    return RemoveDirectory(p) != 0 ? 0 : -1;
+}
 #elif defined(__OS2__)
 static int sys_mkdir(const char *p) {
     FILESTATUS3 fs;
     APIRET rc = DosCreateDir(p, NULL);
-    if (rc == NO_ERROR) return 0;
+    if (rc == NO_ERROR) {
+        unsf_counters.directories++;
+        return 0;
+    }
     if (DosQueryPathInfo(p, FIL_STANDARD, &fs, sizeof(fs)) == NO_ERROR) {
         if (fs.attrFile & FILE_DIRECTORY)
             return 0;
     }
     return -1;
 }
+
+static int sys_rmdir(const char *p) {
+    return DosDeleteDir(p) == NO_ERROR ? 0 : -1;
+}
 #elif defined(__SOME_FOO_PLATFORM__)
 static int sys_mkdir(const char *p) {
 #error implement me..
     return -1;
 }
+
+static int sys_rmdir(const char *p) {
+    return -1;
+}
 #else /* unix */
 static int sys_mkdir(const char *p) {
     int rc = mkdir(p, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH);
-    if (rc == -1 && errno == EEXIST) {
+    if (rc == 0) unsf_counters.directories++;
+    else if (errno == EEXIST) {
         struct stat st;
         if (stat(p, &st) == 0 && S_ISDIR(st.st_mode))
             return 0;
     }
     return rc;
 }
+
+static int sys_rmdir(const char *p) {
+    return rmdir(p);
+}
+#endif
+
+/* makes p a hard link to the existing file, replacing whatever was at p */
+#ifdef _WIN32
+static int sys_link(const char *existing, const char *p) {
+    DeleteFile(p);
+    if (CreateHardLink(p, existing, NULL) != 0) return 0;
+    return -1;
+}
+#elif defined(__OS2__)
+static int sys_link(const char *existing, const char *p) {
+    return -1; /* no hard links, the cfg will point into the store */
+}
+#else /* unix */
+static int sys_link(const char *existing, const char *p) {
+    struct stat st_existing, st;
+    if (stat(existing, &st_existing) == 0 && stat(p, &st) == 0 &&
+        st.st_dev == st_existing.st_dev && st.st_ino == st_existing.st_ino)
+        return 0; /* already linked by an earlier run or drum key */
+    unlink(p);
+    return link(existing, p);
+}
+#endif
+
+/* the absolute path of an existing directory, ending in '/', or NULL */
+static char *sys_fullpath(const char *dir) {
+    char *full, *result;
+#if defined(_WIN32) || defined(__OS2__)
+    char buf[_MAX_PATH];
+    if (!_fullpath(buf, dir, sizeof(buf))) return NULL;
+    full = buf;
+#else
+    if (!(full = realpath(dir, NULL))) return NULL;
+#endif
+    if (full[0] && (full[strlen(full) - 1] == '/' || full[strlen(full) - 1] == '\\')) result = unsf_strdup(full);
+    else result = unsf_concat(full, "/");
+#if !defined(_WIN32) && !defined(__OS2__)
+    free(full);
 #endif
+    return result;
+}
 
 static int unsf_mkdir(char *dir) {
     char *dup_dir;
@@ -1072,7 +1935,7 @@ static int unsf_mkdir(char *dir) {
 
     assert(dir && *dir);
 
-    dup_dir = strdup(dir);
+    dup_dir = unsf_strdup(dir);
 
     if (dup_dir[0] == '/' || dup_dir[0] == '\\')
         absolute_path = 1;
@@ -1112,46 +1975,190 @@ static int unsf_mkdir(char *dir) {
     return 0;
 }
 
-static void make_directories(UnSF_Options *options, SampleBank *sample_bank) {
+/*----------------------------------------------------------------
+ * ustar stream
+ *
+ * The bank directories, the patches and last the cfg are written as a
+ * POSIX ustar archive to a stream the caller opened, usually stdout,
+ * without touching the file system. Patches are written straight from
+ * the encode buffer.
+ *----------------------------------------------------------------*/
+
+#define TAR_BLOCK 512
+
+/* fills a numeric header field: width - 1 octal digits and a NUL */
+static void tar_octal(unsigned char *field, int width, unsigned long val) {
+    int i;
+
+    field[width - 1] = '\0';
+    for (i = width - 2; i >= 0; i--) {
+        field[i] = (unsigned char) ('0' + (val & 7));
+        val >>= 3;
+    }
+}
+
+static int tar_add(PatchOutput *out, const char *name, int directory, const void *data, size_t size) {
+    static const unsigned char zeros[TAR_BLOCK] = {0};
+    unsigned char header[TAR_BLOCK];
+    size_t len = strlen(name), split, pad = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+    unsigned long sum = 0;
+    int i;
+
+    memset(header, 0, sizeof(header));
+    if (len > 100) {
+        /* long names are split at a '/' into prefix and name */
+        for (split = len - 1; split > 0; split--)
+            if (name[split] == '/' && split <= 155 && len - split - 1 <= 100) break;
+        if (!split) {
+            fprintf(stderr, "\n%s is too long a name for a tar archive\n", name);
+            return FALSE;
+        }
+        memcpy(header + 345, name, split);
+        memcpy(header, name + split + 1, len - split - 1);
+    } else memcpy(header, name, len);
+
+    tar_octal(header + 100, 8, directory ? 0755 : 0644);   /* mode */
+    tar_octal(header + 108, 8, 0);                          /* uid */
+    tar_octal(header + 116, 8, 0);                          /* gid */
+    tar_octal(header + 124, 12, (unsigned long) size);
+    tar_octal(header + 136, 12, out->tar_mtime);
+    header[156] = directory ? '5' : '0';
+    memcpy(header + 257, "ustar", 6);
+    memcpy(header + 263, "00", 2);
+
+    memset(header + 148, ' ', 8);                           /* checksum */
+    for (i = 0; i < TAR_BLOCK; i++) sum += header[i];
+    tar_octal(header + 148, 7, sum);
+
+    if (fwrite(header, 1, TAR_BLOCK, out->tar_fd) != TAR_BLOCK ||
+        (size && fwrite(data, 1, size, out->tar_fd) != size) ||
+        fwrite(zeros, 1, pad, out->tar_fd) != pad) {
+        fprintf(stderr, "\nCould not write %s to the tar stream\n", name);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static int tar_directory(PatchOutput *out, const char *dir) {
+    char *name = unsf_concat(dir, "/");
+    int ok = tar_add(out, name, TRUE, NULL, 0);
+
+    free(name);
+    return ok;
+}
+
+/* adds the cfg and the end of archive marker */
+static void tar_close(UnSF_Options *options, PatchOutput *out) {
+    static const unsigned char zeros[2 * TAR_BLOCK] = {0};
+    char *name = unsf_concat(options->basename, ".cfg");
+
+    if (tar_add(out, name, FALSE, out->cfg_text, out->cfg_size)) unsf_counters.bytes_written += out->cfg_size;
+    if (fwrite(zeros, 1, sizeof(zeros), out->tar_fd) != sizeof(zeros) || fflush(out->tar_fd) != 0)
+        fprintf(stderr, "Could not finish the tar stream\n");
+    free(name);
+}
+
+/* returns an open descriptor of the bank directory <name> below the
+ * output directory, making it the first time round; -1 on failure */
+static int bank_directory_fd(PatchOutput *out, const char *name) {
+#ifdef HAVE_OPENAT
+    int i, fd;
+
+    for (i = 0; i < out->dir_count; i++)
+        if (!strcmp(out->dir_names[i], name)) return out->dir_fds[i];
+    if (out->root_fd < 0 || out->dir_count == 2 * UNSF_RANGE) return -1;
+
+    if (mkdirat(out->root_fd, name, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) == 0)
+        unsf_counters.directories++;
+    else if (errno != EEXIST) return -1;
+    if ((fd = openat(out->root_fd, name, O_RDONLY | O_DIRECTORY)) < 0) return -1;
+    if (!(out->dir_names[out->dir_count] = unsf_strdup(name))) BAD_ALLOCATE();
+    out->dir_fds[out->dir_count++] = fd;
+    return fd;
+#else
+    return -1;
+#endif
+}
+
+static void close_directories(PatchOutput *out) {
+#ifdef HAVE_OPENAT
+    int i;
+
+    for (i = 0; i < out->dir_count; i++) {
+        close(out->dir_fds[i]);
+        free(out->dir_names[i]);
+    }
+    out->dir_count = 0;
+    if (out->root_fd >= 0) close(out->root_fd);
+    out->root_fd = -1;
+#endif
+}
+
+/* makes a bank directory unless it is there already; *made is set if
+ * this made it */
+static int make_bank_directory(UnSF_Options *options, PatchOutput *out, const char *name, unsigned char *made) {
+    unsigned long directories = unsf_counters.directories;
+    char *directory;
+    int rc;
+
+    if (out->root_fd >= 0) {
+        if (bank_directory_fd(out, name) >= 0) {
+            *made = unsf_counters.directories != directories;
+            return 0;
+        }
+        fprintf(stderr, "Could not create directory %s%s, errno: %d, reason: %s\n", options->output_directory, name,
+                errno, strerror(errno));
+        return -1;
+    }
+    directory = unsf_concat(options->output_directory, name);
+    rc = unsf_mkdir(directory);
+    free(directory);
+    *made = unsf_counters.directories != directories;
+    return rc;
+}
+
+static void make_directories(UnSF_Options *options, SampleBank *sample_bank, PatchOutput *out) {
     int i, tonebank_count = 0;
     char tmpname[80];
-    char *directory = NULL;
 
     if (options->opt_verbose)
         printf("Making bank directories.\n");
 
     for (i = 0; i < UNSF_RANGE; i++) if (sample_bank->tonebank[i]) tonebank_count++;
 
+#ifdef HAVE_OPENAT
+    if (!options->opt_no_write && !options->opt_archive && !options->patch_sink && !out->tar_fd)
+        out->root_fd = open(options->output_directory, O_RDONLY | O_DIRECTORY);
+#endif
+
     for (i = 0; i < UNSF_RANGE; i++) {
         if (sample_bank->tonebank[i]) {
             if (tonebank_count > 1) {
                 sprintf(tmpname, "%s-B%d", options->basename, i);
-                sample_bank->tonebank_name[i] = strdup(tmpname);
-            } else sample_bank->tonebank_name[i] = strdup(options->basename);
-            if (options->opt_no_write) continue;
-            directory = unsf_concat(options->output_directory, sample_bank->tonebank_name[i]);
-            if (unsf_mkdir(directory) < 0) {
+                sample_bank->tonebank_name[i] = unsf_strdup(tmpname);
+            } else sample_bank->tonebank_name[i] = unsf_strdup(options->basename);
+            if (out->tar_fd) tar_directory(out, sample_bank->tonebank_name[i]);
+            if (options->opt_no_write || options->opt_archive || options->patch_sink || out->tar_fd) continue;
+            if (make_bank_directory(options, out, sample_bank->tonebank_name[i], &out->made_dir[0][i]) < 0) {
                 exit(1); /* FIXME: library must NOT exit() */
             }
-            free(directory);
-            directory = NULL;
         }
     }
-    directory = NULL;
-    if (options->opt_no_write) return;
+    if (out->tar_fd) {
+        for (i = 0; i < UNSF_RANGE; i++)
+            if (sample_bank->drumset_name[i]) tar_directory(out, sample_bank->drumset_name[i]);
+        return;
+    }
+    if (options->opt_no_write || options->opt_archive || options->patch_sink) return;
     for (i = 0; i < UNSF_RANGE; i++) {
         if (sample_bank->drumset_name[i]) {
-            directory = unsf_concat(options->output_directory, sample_bank->drumset_name[i]);
-            if (unsf_mkdir(directory) < 0) {
+            if (make_bank_directory(options, out, sample_bank->drumset_name[i], &out->made_dir[1][i]) < 0) {
                 exit(1); /* FIXME: library must NOT exit() */
             }
-            free(directory);
-            directory = NULL;
         }
     }
 }
 
-
 static void sort_velocity_layers(UnSF_Options *options, SampleBank *sample_bank) {
     int i, j, k, velmin, velmax, velcount, left_patches, right_patches, mono_patches;
     int width, widest;
@@ -1270,11 +2277,15 @@ static void shorten_drum_names(SampleBank *sample_bank) {
 }
 
 /* writes a block of data the memory buffer */
-static void mem_write_block(const void *data, int size, unsigned char **mem, int *mem_size, int *mem_alloced) {
+static void mem_write_block(const void *data, size_t size, unsigned char **mem, size_t *mem_size,
+                            size_t *mem_alloced) {
     if (*mem_size + size > *mem_alloced) {
-        *mem_alloced = (*mem_alloced + size + 4095) & ~4095;
-        if (!(*mem = (unsigned char *) malloc(*mem_alloced))) {
-            fprintf(stderr, "Memory allocation of %d failed with mem size %d\n", *mem_alloced, *mem_size);
+        MEM_RELEASE(patch, *mem_alloced);
+        *mem_alloced = (*mem_alloced + size + 4095) & ~(size_t) 4095;
+        MEM_HOLD(patch, *mem_alloced);
+        if (*mem_alloced < *mem_size + size || !(*mem = (unsigned char *) unsf_malloc(*mem_alloced))) {
+            fprintf(stderr, "Memory allocation of %lu failed with mem size %lu\n", (unsigned long) *mem_alloced,
+                    (unsigned long) *mem_size);
             exit(1); /* FIXME: library must NOT exit() */
         }
     }
@@ -1284,11 +2295,14 @@ static void mem_write_block(const void *data, int size, unsigned char **mem, int
 }
 
 /* writes a byte to the memory buffer */
-static void mem_write8(int val, unsigned char **mem, int *mem_size, int *mem_alloced) {
+static void mem_write8(int val, unsigned char **mem, size_t *mem_size, size_t *mem_alloced) {
     if (*mem_size >= *mem_alloced) {
-        *mem_alloced += (*mem_size + 1048575) & ~1048575;
-        if (!(*mem = (unsigned char *) realloc(*mem, *mem_alloced))) {
-            fprintf(stderr, "Memory allocation of %d failed with mem size %d\n", *mem_alloced, *mem_size);
+        MEM_RELEASE(patch, *mem_alloced);
+        *mem_alloced += (*mem_size + 1048575) & ~(size_t) 1048575;
+        MEM_HOLD(patch, *mem_alloced);
+        if (*mem_alloced <= *mem_size || !(*mem = (unsigned char *) unsf_realloc(*mem, *mem_alloced))) {
+            fprintf(stderr, "Memory allocation of %lu failed with mem size %lu\n", (unsigned long) *mem_alloced,
+                    (unsigned long) *mem_size);
             exit(1); /* FIXME: library must NOT exit() */
         }
     }
@@ -1298,19 +2312,28 @@ static void mem_write8(int val, unsigned char **mem, int *mem_size, int *mem_all
 }
 
 /* writes a word to the memory buffer (little endian) */
-static void mem_write16(int val, unsigned char **mem, int *mem_size, int *mem_alloced) {
+static void mem_write16(int val, unsigned char **mem, size_t *mem_size, size_t *mem_alloced) {
     mem_write8(val & 0xFF, mem, mem_size, mem_alloced);
     mem_write8((val >> 8) & 0xFF, mem, mem_size, mem_alloced);
 }
 
 /* writes a int to the memory buffer (little endian) */
-static void mem_write32(int val, unsigned char **mem, int *mem_size, int *mem_alloced) {
+static void mem_write32(unsigned long val, unsigned char **mem, size_t *mem_size, size_t *mem_alloced) {
     mem_write8(val & 0xFF, mem, mem_size, mem_alloced);
     mem_write8((val >> 8) & 0xFF, mem, mem_size, mem_alloced);
     mem_write8((val >> 16) & 0xFF, mem, mem_size, mem_alloced);
     mem_write8((val >> 24) & 0xFF, mem, mem_size, mem_alloced);
 }
 
+/* writes a waveform as unsigned 8-bit samples scaled by vol */
+static void mem_write_pcm8(const short *pcm, int length, float vol, unsigned char **mem, size_t *mem_size,
+                           size_t *mem_alloced) {
+    int i;
+
+    for (i = 0; i < length; i++)
+        mem_write8((int) ((pcm[i] >> 8) * vol) ^ 0x80, mem, mem_size, mem_alloced);
+}
+
 /* converts AWE32 (MIDI) pitches to GUS (frequency) format */
 /*
 static int key2freq(int note, int cents) {
@@ -1350,6 +2373,8 @@ static int msec2gus(int t, int r) {
 
 /* interprets a SoundFont generator object */
 static void apply_generator(UnSF_Options *options, SF_Meta *sf_meta, sfGenList *g, int preset, int global) {
+    unsf_counters.generators++;
+
     switch (g->sfGenOper) {
 
         case SFGEN_startAddrsOffset:
@@ -1980,7 +3005,7 @@ static int getmodes(UnSF_Options *options, int sf_sustain_mod_env, int sampleFla
     return modes;
 }
 
-static int adjust_volume(short *sf_sample_data, int start, int length) {
+static int adjust_volume(const short *sf_sample_data, int start, int length) {
     /* Try to determine a volume scaling factor for the sample.
        This is a very crude adjustment, but things sound more
        balanced with it. Still, this should be a runtime option. */
@@ -1988,7 +3013,7 @@ static int adjust_volume(short *sf_sample_data, int start, int length) {
     unsigned int countsamp, numsamps = length;
     unsigned int higher = 0, highcount = 0;
     short maxamp = 0, a;
-    short *tmpdta = (short *) sf_sample_data + start;
+    const short *tmpdta = sf_sample_data + start;
     double new_vol;
     countsamp = numsamps;
     while (countsamp--) {
@@ -1998,7 +3023,7 @@ static int adjust_volume(short *sf_sample_data, int start, int length) {
         if (a > maxamp)
             maxamp = a;
     }
-    tmpdta = (short *) sf_sample_data + start;
+    tmpdta = sf_sample_data + start;
     countsamp = numsamps;
     while (countsamp--) {
         a = *tmpdta++;
@@ -2017,18 +3042,242 @@ static int adjust_volume(short *sf_sample_data, int start, int length) {
     return (int) (new_vol * 255.0);
 }
 
-/* copies data from the waiting list into a GUS .pat struct */
-static int grab_soundfont_sample(UnSF_Options *options, char *name, int program, int banknum, int wanted_bank,
-                                 int waiting_list_count, EMPTY_WHITE_ROOM *waiting_list, unsigned char **mem,
-                                 int *mem_alloced, int *mem_size, short *sf_sample_data, SampleBank *sample_bank) {
-    sfSample *sample;
-    sfGenList *igen;
-    sfGenList *pgen;
-    sfGenList *global_izone;
-    sfGenList *global_pzone;
-    float vol, total_vol;
-    int igen_count;
-    int pgen_count;
+/*----------------------------------------------------------------
+ * SoundFont 3 samples
+ *
+ * SF3 files keep every sample as an Ogg Vorbis stream in smpl, with
+ * dwStart and dwEnd the byte range of the stream and the loop points
+ * relative to the start of the sample. Once the font is loaded each
+ * sample is given a range of its own in a virtual sample space, so the
+ * rest of unsf goes on working with sample positions, and a sample is
+ * only decoded when a patch needs it. Decoded samples are kept in a
+ * cache of limited size, the least recently used going first.
+ *----------------------------------------------------------------*/
+
+#define SF3_COMPRESSED 0x10
+#define SF3_CACHE_SIZE (32UL << 20)
+
+#ifdef HAVE_VORBISFILE
+typedef struct VorbisSource {
+    const unsigned char *data;
+    size_t size;
+    size_t pos;
+} VorbisSource;
+
+static size_t vorbis_read(void *ptr, size_t size, size_t count, void *datasource) {
+    VorbisSource *src = (VorbisSource *) datasource;
+    size_t n = size ? (src->size - src->pos) / size : 0;
+
+    if (count < n) n = count;
+    memcpy(ptr, src->data + src->pos, n * size);
+    src->pos += n * size;
+    return n;
+}
+
+static int vorbis_seek(void *datasource, ogg_int64_t offset, int whence) {
+    VorbisSource *src = (VorbisSource *) datasource;
+    ogg_int64_t pos = offset;
+
+    if (whence == SEEK_CUR) pos += src->pos;
+    else if (whence == SEEK_END) pos += src->size;
+    if (pos < 0 || pos > (ogg_int64_t) src->size) return -1;
+    src->pos = (size_t) pos;
+    return 0;
+}
+
+static long vorbis_tell(void *datasource) {
+    return (long) ((VorbisSource *) datasource)->pos;
+}
+
+static int vorbisfile_decode(const void *data, size_t size, short *pcm, unsigned long frames) {
+    ov_callbacks callbacks;
+    OggVorbis_File vf;
+    VorbisSource src;
+    size_t want = (size_t) frames * 2, got = 0;
+    long n;
+    int section;
+#ifdef WORDS_BIGENDIAN
+    int big_endian = 1;
+#else
+    int big_endian = 0;
+#endif
+
+    src.data = (const unsigned char *) data;
+    src.size = size;
+    src.pos = 0;
+    callbacks.read_func = vorbis_read;
+    callbacks.seek_func = vorbis_seek;
+    callbacks.close_func = NULL;
+    callbacks.tell_func = vorbis_tell;
+    if (ov_open_callbacks(&src, &vf, NULL, 0, callbacks) != 0) return FALSE;
+    if (ov_info(&vf, -1)->channels != 1) {
+        ov_clear(&vf);
+        return FALSE;
+    }
+    while (got < want && (n = ov_read(&vf, (char *) pcm + got, (int) (want - got), big_endian, 2, 1, &section)) > 0)
+        got += n;
+    ov_clear(&vf);
+    memset((char *) pcm + got, 0, want - got);
+    return got > 0;
+}
+#endif
+
+/* samples in an Ogg stream, going by the granule position of the last
+ * page; 0 if it isn't one */
+static unsigned long ogg_frames(const unsigned char *p, size_t size) {
+    unsf_uint64 frames = 0, granule;
+    size_t pos = 0, len;
+    int i, segments;
+
+    while (pos + 27 <= size && !memcmp(p + pos, "OggS", 4)) {
+        segments = p[pos + 26];
+        len = 27 + segments;
+        if (pos + len > size) return 0;
+        for (i = 0; i < segments; i++) len += p[pos + 27 + i];
+        granule = get_le(p + pos + 6, 8);
+        if (granule != ~(unsf_uint64) 0) frames = granule;   /* no packet ends on this page */
+        pos += len;
+    }
+    if (pos != size || frames > 0x7FFFFFFFUL) return 0;
+    return (unsigned long) frames;
+}
+
+/* gives every sample of an SF3 font its range of the virtual sample space;
+ * FALSE if it has compressed samples and there is no decoder for them */
+static int sf3_prepare(UnSF_Options *options, PatchOutput *out, sfSample *sf_samples, int sf_num_samples) {
+    unsigned long base = 0, start;
+    Sf3Sample *s3;
+    sfSample *sample;
+    int i, compressed = 0;
+
+    if (!(out->sf3_samples = (Sf3Sample *) unsf_calloc(sf_num_samples, sizeof(Sf3Sample)))) BAD_ALLOCATE();
+    out->sf3_count = sf_num_samples;
+    out->sf_samples = sf_samples;
+    out->cache_limit = options->sample_cache_size ? (unsigned long) options->sample_cache_size : SF3_CACHE_SIZE;
+    out->decoder = options->vorbis_decoder;
+#ifdef HAVE_VORBISFILE
+    if (!out->decoder) out->decoder = vorbisfile_decode;
+#endif
+
+    for (i = 0; i < sf_num_samples; i++) {
+        sample = &sf_samples[i];
+        s3 = &out->sf3_samples[i];
+        start = 0;
+        if (sample->sfSampleType & SF3_COMPRESSED) {
+            if (sample->dwEnd > sample->dwStart && sample->dwEnd <= out->sf3_size) {
+                s3->compressed = TRUE;
+                compressed++;
+                s3->offset = sample->dwStart;
+                s3->size = sample->dwEnd - sample->dwStart;
+                s3->frames = ogg_frames(out->sf3_data + s3->offset, s3->size);
+            }
+        } else if (sample->dwEnd > sample->dwStart && sample->dwEnd <= out->sf3_size / 2) {
+            /* left as 16-bit PCM */
+            s3->offset = sample->dwStart * 2;
+            s3->size = (sample->dwEnd - sample->dwStart) * 2;
+            s3->frames = sample->dwEnd - sample->dwStart;
+            start = sample->dwStart;
+        }
+        if (s3->frames > SMPL_MAX_FRAMES - base) {
+            fprintf(stderr, "Warning: SoundFont 3 sample %.20s is past the %lu frames that can be addressed\n",
+                    sample->achSampleName, SMPL_MAX_FRAMES);
+            if (s3->compressed) compressed--;
+            s3->compressed = FALSE;
+            s3->frames = 0;
+        }
+        sample->sfSampleType &= ~SF3_COMPRESSED;
+        sample->dwStartloop = sample->dwStartloop - start + base;
+        sample->dwEndloop = sample->dwEndloop - start + base;
+        sample->dwStart = base;
+        sample->dwEnd = base + s3->frames;
+        base += s3->frames;
+    }
+    if (compressed && !out->decoder) {
+        fprintf(stderr, "Error: %d samples are Ogg Vorbis compressed and unsf was built without a decoder for them\n",
+                compressed);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static void sf3_evict(PatchOutput *out, Sf3Sample *s3) {
+    out->cache_size -= s3->alloced * 2;
+    MEM_RELEASE(cache, s3->alloced * 2);
+    free(s3->pcm);
+    s3->pcm = NULL;
+    s3->alloced = 0;
+}
+
+static void sf3_free(PatchOutput *out) {
+    int i;
+
+    if (!out->sf3_samples) return;
+    for (i = 0; i < out->sf3_count; i++) free(out->sf3_samples[i].pcm);
+    free(out->sf3_samples);
+    out->sf3_samples = NULL;
+}
+
+/* the PCM of a sample, at least length samples of it, decoding it if it
+ * isn't in the cache; NULL if it can't be decoded */
+static const short *sample_pcm(PatchOutput *out, short *sf_sample_data, sfSample *sample, int length) {
+    Sf3Sample *s3, *lru;
+    unsigned long need;
+    int i, n, ok = TRUE;
+
+    if (!out->sf3_samples) {
+        if (sample->dwStart > out->smpl_frames || (unsigned long) length > out->smpl_frames - sample->dwStart) {
+            fprintf(stderr, "\nSample %.20s is outside the sample data\n", sample->achSampleName);
+            return NULL;
+        }
+        return sf_sample_data + sample->dwStart;
+    }
+
+    n = (int) (sample - out->sf_samples);
+    s3 = &out->sf3_samples[n];
+    s3->last_use = ++out->cache_clock;
+    need = s3->frames > (unsigned long) length ? s3->frames : (unsigned long) length;
+    if (s3->pcm && s3->alloced >= need) return s3->pcm;
+    if (s3->pcm) sf3_evict(out, s3);
+
+    /* make room, least recently used first */
+    while (out->cache_size + need * 2 > out->cache_limit) {
+        lru = NULL;
+        for (i = 0; i < out->sf3_count; i++)
+            if (out->sf3_samples[i].pcm && (!lru || out->sf3_samples[i].last_use < lru->last_use))
+                lru = &out->sf3_samples[i];
+        if (!lru) break;
+        sf3_evict(out, lru);
+    }
+
+    if (!(s3->pcm = (short *) unsf_calloc(need ? need : 1, sizeof(short)))) BAD_ALLOCATE();
+    s3->alloced = need;
+    out->cache_size += need * 2;
+    MEM_HOLD(cache, need * 2);
+    if (s3->compressed) ok = out->decoder(out->sf3_data + s3->offset, s3->size, s3->pcm, s3->frames);
+    else
+        for (i = 0; i < (int) s3->frames; i++)
+            s3->pcm[i] = (short) (out->sf3_data[s3->offset + 2 * i] | (out->sf3_data[s3->offset + 2 * i + 1] << 8));
+    if (!ok) {
+        fprintf(stderr, "\nCould not decode the SoundFont 3 sample %.20s\n", sample->achSampleName);
+        sf3_evict(out, s3);
+        return NULL;
+    }
+    return s3->pcm;
+}
+
+/* copies data from the waiting list into a GUS .pat struct */
+static int grab_soundfont_sample(UnSF_Options *options, char *name, int program, int banknum, int wanted_bank,
+                                 int waiting_list_count, EMPTY_WHITE_ROOM *waiting_list, unsigned char **mem,
+                                 size_t *mem_alloced, size_t *mem_size, short *sf_sample_data, SampleBank *sample_bank,
+                                 PatchOutput *out) {
+    sfSample *sample;
+    sfGenList *igen;
+    sfGenList *pgen;
+    sfGenList *global_izone;
+    sfGenList *global_pzone;
+    float vol, total_vol;
+    int igen_count;
+    int pgen_count;
     int global_izone_count;
     int global_pzone_count;
     int length;
@@ -2041,6 +3290,8 @@ static int grab_soundfont_sample(UnSF_Options *options, char *name, int program,
     /* int mod_delay; */
     int freq_scale;
     unsigned int sample_volume;
+    const short *pcm;
+    UnSF_PerfCounters perf;
 
     /* SoundFont parameters for the current sample */
     SF_Meta sf_meta;
@@ -2052,6 +3303,8 @@ static int grab_soundfont_sample(UnSF_Options *options, char *name, int program,
         int velcount, velcount_part1, k, velmin, velmax, left_patches, right_patches;
 
         *mem_size = 0;
+        out->view_count = 0;
+        out->inspect_size = 0;
 
         mem_write_block("GF1PATCH110\0ID#000002\0", 22, mem, mem_size, mem_alloced);
 
@@ -2219,6 +3472,7 @@ static int grab_soundfont_sample(UnSF_Options *options, char *name, int program,
     }
 
     /* for each sample... */
+    perf_read(out, &perf);
     for (n = 0; n < waiting_list_count; n++) {
         sample = waiting_list[n].sample;
         igen = waiting_list[n].igen;
@@ -2307,11 +3561,12 @@ static int grab_soundfont_sample(UnSF_Options *options, char *name, int program,
 
         /* convert SoundFont values into some more useful formats */
         length = sf_meta.end - sf_meta.start;
-
         if (length < 0) {
             fprintf(stderr, "\nSample for %s has negative length.\n", name);
             return FALSE;
         }
+        if (out->inspect) pcm = NULL;
+        else if (!(pcm = sample_pcm(out, sf_sample_data, sample, length))) return FALSE;
         sf_meta.loop_start = MID(0, sf_meta.loop_start - sf_meta.start, sf_meta.end);
         sf_meta.loop_end = MID(0, sf_meta.loop_end - sf_meta.start, sf_meta.end);
 
@@ -2385,9 +3640,9 @@ static int grab_soundfont_sample(UnSF_Options *options, char *name, int program,
             mem_write32(sf_meta.loop_start, mem, mem_size, mem_alloced);      /* loop start */
             mem_write32(sf_meta.loop_end, mem, mem_size, mem_alloced);        /* loop end */
         } else {
-            mem_write32(length * 2, mem, mem_size, mem_alloced);           /* waveform size */
-            mem_write32(sf_meta.loop_start * 2, mem, mem_size, mem_alloced);    /* loop start */
-            mem_write32(sf_meta.loop_end * 2, mem, mem_size, mem_alloced);      /* loop end */
+            mem_write32((unsigned long) length * 2, mem, mem_size, mem_alloced);           /* waveform size */
+            mem_write32((unsigned long) sf_meta.loop_start * 2, mem, mem_size, mem_alloced);    /* loop start */
+            mem_write32((unsigned long) sf_meta.loop_end * 2, mem, mem_size, mem_alloced);      /* loop end */
         }
 
         mem_write16(sample->dwSampleRate, mem, mem_size, mem_alloced);  /* sample freq */
@@ -2452,9 +3707,9 @@ static int grab_soundfont_sample(UnSF_Options *options, char *name, int program,
         mem_write16(sp_meta.freq_center, mem, mem_size, mem_alloced);
         mem_write16(freq_scale, mem, mem_size, mem_alloced);           /* scale factor */
 
-        if (options->opt_adjust_volume) {
+        if (options->opt_adjust_volume && pcm) {
             if (options->opt_veryverbose) printf("vol comp %d", sp_meta.volume);
-            sample_volume = adjust_volume(sf_sample_data, sample->dwStart, length);
+            sample_volume = adjust_volume(pcm, 0, length);
             if (options->opt_veryverbose) printf(" -> %d\n", sample_volume);
         } else sample_volume = sp_meta.volume;
 
@@ -2509,25 +3764,76 @@ static int grab_soundfont_sample(UnSF_Options *options, char *name, int program,
             mem_write8(255, mem, mem_size, mem_alloced);
         else mem_write8(sf_meta.instrument_unused5, mem, mem_size, mem_alloced);
 
-        if (options->opt_8bit) {                     /* sample waveform */
-            for (i = 0; i < length; i++)
-                mem_write8((int) ((sf_sample_data[sample->dwStart + i] >> 8) * vol) ^ 0x80, mem, mem_size, mem_alloced);
+        unsf_counters.samples++;
+        out->sample_bytes += (double) length * 2;
+        if (out->inspect) {                          /* sample waveform */
+            out->inspect_size += options->opt_8bit ? (unsf_uint64) length : (unsf_uint64) length * 2;
+        } else if (options->opt_8bit) {
+            mem_write_pcm8(pcm, length, vol, mem, mem_size, mem_alloced);
+        } else if (out->zero_copy) {
+            /* the sink gets the sample data itself instead of a copy */
+            if (out->view_count == out->views_alloced) {
+                MEM_RELEASE(patch, sizeof(PatchView) * out->views_alloced);
+                out->views_alloced = out->views_alloced ? out->views_alloced * 2 : 64;
+                MEM_HOLD(patch, sizeof(PatchView) * out->views_alloced);
+                out->views = (PatchView *) unsf_realloc(out->views, sizeof(PatchView) * out->views_alloced);
+                if (!out->views) BAD_ALLOCATE();
+            }
+            out->views[out->view_count].offset = *mem_size;
+            out->views[out->view_count].data = pcm;
+            out->views[out->view_count].length = length;
+            out->view_count++;
         } else {
             for (i = 0; i < length; i++)
-                mem_write16(sf_sample_data[sample->dwStart + i], mem, mem_size, mem_alloced);
+                mem_write16(pcm[i], mem, mem_size, mem_alloced);
         }
     }
+    perf_add(out, &out->stats.perf.encode, &perf);
     return TRUE;
 }
 
+/* folds the zones and sample data one layer is made from into the
+ * input hash of the patch */
+static void hash_waiting_list(PatchOutput *out, int waiting_list_count, EMPTY_WHITE_ROOM *waiting_list,
+                              short *sf_sample_data) {
+    unsf_uint64 h = out->input_hash;
+    sfSample *sample;
+    long header[8];
+    int n;
+
+    for (n = 0; n < waiting_list_count; n++) {
+        sample = waiting_list[n].sample;
+        header[0] = sample->dwStart;
+        header[1] = sample->dwEnd;
+        header[2] = sample->dwStartloop;
+        header[3] = sample->dwEndloop;
+        header[4] = sample->dwSampleRate;
+        header[5] = sample->byOriginalKey;
+        header[6] = sample->chCorrection;
+        header[7] = waiting_list[n].stereo_mode;
+        h = unsf_hash(header, sizeof(header), h);
+        h = unsf_hash(waiting_list[n].global_izone, sizeof(sfGenList) * waiting_list[n].global_izone_count, h);
+        h = unsf_hash(waiting_list[n].igen, sizeof(sfGenList) * waiting_list[n].igen_count, h);
+        h = unsf_hash(waiting_list[n].global_pzone, sizeof(sfGenList) * waiting_list[n].global_pzone_count, h);
+        h = unsf_hash(waiting_list[n].pgen, sizeof(sfGenList) * waiting_list[n].pgen_count, h);
+        if (out->sf3_samples) {
+            /* the samples as they are in the font, no need to decode them */
+            Sf3Sample *s3 = &out->sf3_samples[sample - out->sf_samples];
+            h = unsf_hash(out->sf3_data + s3->offset, s3->size, h);
+        } else if (sample->dwEnd > sample->dwStart && sample->dwEnd <= out->smpl_frames)
+            h = unsf_hash(sf_sample_data + sample->dwStart, sizeof(short) * (sample->dwEnd - sample->dwStart), h);
+    }
+    out->input_hash = h;
+}
+
 /* converts loaded SoundFont data */
 static
 int grab_soundfont(UnSF_Options *options, int num, int drum, char *name, int wanted_velmin, int wanted_velmax,
                    int sf_num_presets, sfPresetHeader *sf_presets,
                    sfPresetBag *sf_preset_indexes, sfGenList *sf_preset_generators,
                    sfInst *sf_instruments, sfInstBag *sf_instrument_indexes,
-                   sfGenList *sf_instrument_generators, sfSample *sf_samples, unsigned char **mem, int *mem_alloced,
-                   int *mem_size, short *sf_sample_data, SampleBank *sample_bank) {
+                   sfGenList *sf_instrument_generators, sfSample *sf_samples, unsigned char **mem, size_t *mem_alloced,
+                   size_t *mem_size, short *sf_sample_data, SampleBank *sample_bank, PatchOutput *out) {
     sfPresetBag *pindex;
     sfGenList *pgen;
     sfInst *iheader;
@@ -2548,8 +3854,9 @@ int grab_soundfont(UnSF_Options *options, int num, int drum, char *name, int wan
     int wanted_keymin, wanted_keymax;
     int velmin, velmax;
     int waiting_room_full;
-    int i;
+    int i, ok;
     char *s;
+    double t;
 
     EMPTY_WHITE_ROOM waiting_list[MAX_WAITING];
     int waiting_list_count;
@@ -2576,6 +3883,7 @@ int grab_soundfont(UnSF_Options *options, int num, int drum, char *name, int wan
         int global_preset_layer, global_preset_velmin, global_preset_velmax, preset_velmin, preset_velmax;
         int global_preset_keymin, global_preset_keymax, preset_keymin, preset_keymax;
 
+        unsf_counters.presets_scanned++;
         if ((sf_presets[pnum].wPreset == wanted_patch) && (sf_presets[pnum].wBank == wanted_bank)) {
             /* find what substructures it uses */
             pindex = &sf_preset_indexes[sf_presets[pnum].wPresetBagNdx];
@@ -2618,6 +3926,7 @@ int grab_soundfont(UnSF_Options *options, int num, int drum, char *name, int wan
                 int global_instrument_keymin, global_instrument_keymax,
                         instrument_keymin, instrument_keymax;
 
+                unsf_counters.zones_visited++;
                 pgen = &sf_preset_generators[pindex[inum].wGenNdx];
                 pgen_count = pindex[inum + 1].wGenNdx - pindex[inum].wGenNdx;
 
@@ -2674,6 +3983,7 @@ int grab_soundfont(UnSF_Options *options, int num, int drum, char *name, int wan
 
                     /* for each layer in this instrument */
                     for (lnum = 0; lnum < iindex_count; lnum++) {
+                        unsf_counters.zones_visited++;
                         igen = &sf_instrument_generators[iindex[lnum].wInstGenNdx];
                         igen_count = iindex[lnum + 1].wInstGenNdx - iindex[lnum].wInstGenNdx;
 
@@ -2859,14 +4169,21 @@ int grab_soundfont(UnSF_Options *options, int num, int drum, char *name, int wan
                     fprintf(stderr, "\nFor instrument %s found %d samples in unknown channel.\n",
                             name, vlist->other_patches[k]);
                 }
+                if (out->resolve_only) {
+                    hash_waiting_list(out, waiting_list_count, waiting_list, sf_sample_data);
+                    return TRUE;
+                }
+                t = unsf_clock();
                 if (drum)
-                    return grab_soundfont_sample(options, name, wanted_keymin, wanted_patch, wanted_bank,
-                                                 waiting_list_count, waiting_list, mem, mem_alloced, mem_size,
-                                                 sf_sample_data, sample_bank);
+                    ok = grab_soundfont_sample(options, name, wanted_keymin, wanted_patch, wanted_bank,
+                                               waiting_list_count, waiting_list, mem, mem_alloced, mem_size,
+                                               sf_sample_data, sample_bank, out);
                 else
-                    return grab_soundfont_sample(options, name, wanted_patch, wanted_bank, wanted_bank,
-                                                 waiting_list_count, waiting_list, mem, mem_alloced, mem_size,
-                                                 sf_sample_data, sample_bank);
+                    ok = grab_soundfont_sample(options, name, wanted_patch, wanted_bank, wanted_bank,
+                                               waiting_list_count, waiting_list, mem, mem_alloced, mem_size,
+                                               sf_sample_data, sample_bank, out);
+                out->stats.encode += unsf_clock() - t;
+                return ok;
             } else {
                 fprintf(stderr, "\nStrange... no valid layers found in instrument %s bank %d prog %d\n",
                         name, drum ? wanted_patch : wanted_bank, drum ? wanted_keymin : wanted_patch);
@@ -2878,368 +4195,2399 @@ int grab_soundfont(UnSF_Options *options, int num, int drum, char *name, int wan
     return FALSE;
 }
 
-static void make_patch_files(UnSF_Options *options, int sf_num_presets, sfPresetHeader *sf_presets,
-                             sfPresetBag *sf_preset_indexes, sfGenList *sf_preset_generators,
-                             sfInst *sf_instruments, sfInstBag *sf_instrument_indexes,
-                             sfGenList *sf_instrument_generators, sfSample *sf_samples, short *sf_sample_data,
-                             SampleBank *sample_bank) {
-    int i, j, k, velcount, right_patches;
-    char tmpname[80];
-    char *file_path = NULL;
-    FILE *pf;
-    VelocityRangeList *vlist;
-    int abort_this_one;
-    int wanted_velmin, wanted_velmax;
+/* puts the file at tmp_path in the place of the one at path, in one step */
+static int replace_file(const char *tmp_path, const char *path) {
+#ifdef _WIN32
+    return MoveFileExA(tmp_path, path, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    return rename(tmp_path, path) == 0;
+#endif
+}
 
-    /* scratch buffer for generating new patch files */
-    unsigned char *mem = NULL;
-    int mem_size = 0;
-    int mem_alloced = 0;
+/* removes the file a patch is about to be written to. It may be a hard
+ * link into a patch store from an earlier run, which must never be
+ * written through; TRUE if there was a file. */
+static int unlink_patch(int dir_fd, const char *file_name, const char *file_path) {
+#ifdef HAVE_OPENAT
+    if (dir_fd >= 0) return unlinkat(dir_fd, file_name, 0) == 0;
+#endif
+    return remove(file_path) == 0;
+}
 
-    if (options->opt_verbose)
-        printf("Melodic patch files.\n");
-    for (i = 0; i < UNSF_RANGE; i++) {
-        if (sample_bank->tonebank[i]) {
-            for (j = 0; j < UNSF_RANGE; j++) {
-                if (sample_bank->voice_name[i][j]) {
-                    abort_this_one = FALSE;
-                    vlist = sample_bank->voice_velocity[i][j];
-                    if (vlist) velcount = vlist->range_count;
-                    else velcount = 1;
-                    if (options->opt_small) velcount = 1;
-                    options->opt_bank = i;
-                    options->opt_header = TRUE;
-                    for (k = 0; k < velcount; k++) {
-                        if (vlist) {
-                            wanted_velmin = vlist->velmin[k];
-                            wanted_velmax = vlist->velmax[k];
-                            right_patches = vlist->right_patches[k];
-                        } else {
-                            wanted_velmin = 0;
-                            wanted_velmax = 127;
-                            right_patches = sample_bank->voice_samples_right[i][j];
-                        }
-                        options->opt_left_channel = TRUE;
-                        options->opt_right_channel = FALSE;
-                        if (!grab_soundfont(options, j, FALSE, sample_bank->voice_name[i][j], wanted_velmin,
-                                            wanted_velmax, sf_num_presets, sf_presets, sf_preset_indexes,
-                                            sf_preset_generators,
-                                            sf_instruments, sf_instrument_indexes, sf_instrument_generators,
-                                            sf_samples, &mem, &mem_alloced, &mem_size, sf_sample_data, sample_bank)) {
-                            fprintf(stderr, "Could not create patch %s for bank %s\n",
-                                    sample_bank->voice_name[i][j], sample_bank->tonebank_name[i]);
-                            fprintf(stderr, "\tlayer %d of %d layer(s)\n", k + 1, velcount);
-                            if (sample_bank->voice_velocity[i][j]) free(sample_bank->voice_velocity[i][j]);
-                            sample_bank->voice_velocity[i][j] = NULL;
-                            abort_this_one = TRUE;
-                            break;
-                        }
-                        options->opt_header = FALSE;
-                        if (abort_this_one) continue;
-                        if (vlist) right_patches = vlist->right_patches[k];
-                        if (right_patches && !options->opt_mono) {
-                            options->opt_left_channel = FALSE;
-                            options->opt_right_channel = TRUE;
-                            if (!grab_soundfont(options, j, FALSE, sample_bank->voice_name[i][j], wanted_velmin,
-                                                wanted_velmax,
-                                                sf_num_presets, sf_presets, sf_preset_indexes, sf_preset_generators,
-                                                sf_instruments, sf_instrument_indexes, sf_instrument_generators,
-                                                sf_samples, &mem, &mem_alloced, &mem_size, sf_sample_data,
-                                                sample_bank)) {
-                                fprintf(stderr, "Could not create right patch %s for bank %s\n",
-                                        sample_bank->voice_name[i][j], sample_bank->tonebank_name[i]);
-                                fprintf(stderr, "\tlayer %d of %d layer(s)\n", k + 1, velcount);
-                                if (sample_bank->voice_velocity[i][j]) free(sample_bank->voice_velocity[i][j]);
-                                sample_bank->voice_velocity[i][j] = NULL;
-                                abort_this_one = TRUE;
-                                break;
-                            }
-                        }
-                    }
-                    if (abort_this_one || options->opt_no_write) continue;
-                    sprintf(tmpname, "%s/%s.pat", sample_bank->tonebank_name[i], sample_bank->voice_name[i][j]);
-                    file_path = unsf_concat(options->output_directory, tmpname);
-                    if (!(pf = fopen(file_path, "wb"))) {
-                        fprintf(stderr, "\nCould not open patch file %s\n", file_path);
-                        if (sample_bank->voice_velocity[i][j]) free(sample_bank->voice_velocity[i][j]);
-                        sample_bank->voice_velocity[i][j] = NULL;
-                        free(file_path); file_path = NULL;
-                        continue;
-                    }
-                    if (fwrite(mem, 1, mem_size, pf) != mem_size) {
-                        fprintf(stderr, "\nCould not write to patch file %s\n", file_path);
-                        if (sample_bank->voice_velocity[i][j]) free(sample_bank->voice_velocity[i][j]);
-                        sample_bank->voice_velocity[i][j] = NULL;
-                    }
-                    fclose(pf);
-                    free(file_path);
-                    file_path = NULL;
-                }
-            }
-        }
+/* writes a patch file the plain stdio way, opening it relative to its
+ * directory when there is a descriptor for it */
+static int write_file(int dir_fd, const char *file_name, const char *file_path, const unsigned char *mem,
+                      size_t mem_size) {
+    FILE *pf = NULL;
+    int ok = TRUE;
+
+#ifdef HAVE_OPENAT
+    if (dir_fd >= 0) {
+        int fd = openat(dir_fd, file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0 && !(pf = fdopen(fd, "wb"))) close(fd);
+    } else
+#endif
+    pf = fopen(file_path, "wb");
+    if (!pf) {
+        fprintf(stderr, "\nCould not open patch file %s\n", file_path);
+        return FALSE;
     }
-    if (options->opt_verbose)
-        printf("\nDrum patch files.\n");
-    for (i = 0; i < UNSF_RANGE; i++) {
-        if (sample_bank->drumset_name[i]) {
-            for (j = 0; j < UNSF_RANGE; j++) {
-                if (sample_bank->drum_name[i][j]) {
-                    abort_this_one = FALSE;
-                    vlist = sample_bank->drum_velocity[i][j];
-                    if (vlist) velcount = vlist->range_count;
-                    else velcount = 1;
-                    if (!vlist)
-                        fprintf(stderr, "Uh oh, drum #%d %s has no velocity list\n", i, sample_bank->drumset_name[i]);
-                    if (options->opt_small) velcount = 1;
-                    options->opt_drum_bank = i;
-                    options->opt_header = TRUE;
-                    for (k = 0; k < velcount; k++) {
-                        if (vlist) {
-                            wanted_velmin = vlist->velmin[k];
-                            wanted_velmax = vlist->velmax[k];
-                            right_patches = vlist->right_patches[k];
-                        } else {
-                            wanted_velmin = 0;
-                            wanted_velmax = 127;
-                            right_patches = sample_bank->drum_samples_right[i][j];
-                        }
-                        options->opt_left_channel = TRUE;
-                        options->opt_right_channel = FALSE;
-                        if (!grab_soundfont(options, j, TRUE, sample_bank->drum_name[i][j], wanted_velmin,
-                                            wanted_velmax,
-                                            sf_num_presets, sf_presets, sf_preset_indexes, sf_preset_generators,
-                                            sf_instruments, sf_instrument_indexes, sf_instrument_generators,
-                                            sf_samples, &mem, &mem_alloced, &mem_size, sf_sample_data, sample_bank)) {
-                            fprintf(stderr, "Could not create left/mono patch %s for bank %s\n",
-                                    sample_bank->drum_name[i][j], sample_bank->drumset_name[i]);
-                            fprintf(stderr, "\tlayer %d of %d layer(s)\n", k + 1, velcount);
-                            if (sample_bank->drum_velocity[i][j]) free(sample_bank->drum_velocity[i][j]);
-                            sample_bank->drum_velocity[i][j] = NULL;
-                            abort_this_one = TRUE;
-                            break;
-                        }
-                        options->opt_header = FALSE;
-                        if (abort_this_one) continue;
-                        if (vlist) right_patches = vlist->right_patches[k];
-                        if (right_patches && !options->opt_mono) {
-                            options->opt_left_channel = FALSE;
-                            options->opt_right_channel = TRUE;
-                            if (!grab_soundfont(options, j, TRUE, sample_bank->drum_name[i][j], wanted_velmin,
-                                                wanted_velmax,
-                                                sf_num_presets, sf_presets, sf_preset_indexes, sf_preset_generators,
-                                                sf_instruments, sf_instrument_indexes, sf_instrument_generators,
-                                                sf_samples, &mem, &mem_alloced, &mem_size, sf_sample_data,
-                                                sample_bank)) {
-                                fprintf(stderr, "Could not create right patch %s for bank %s\n",
-                                        sample_bank->drum_name[i][j], sample_bank->drumset_name[i]);
-                                fprintf(stderr, "\tlayer %d of %d layer(s)\n", k + 1, velcount);
-                                if (sample_bank->drum_velocity[i][j]) free(sample_bank->drum_velocity[i][j]);
-                                sample_bank->drum_velocity[i][j] = NULL;
-                                abort_this_one = TRUE;
-                                break;
-                            }
-                        }
-                    }
-                    if (abort_this_one || options->opt_no_write) continue;
-                    sprintf(tmpname, "%s/%s.pat", sample_bank->drumset_name[i], sample_bank->drum_name[i][j]);
-                    file_path = unsf_concat(options->output_directory, tmpname);
-                    if (!(pf = fopen(file_path, "wb"))) {
-                        fprintf(stderr, "\nCould not open patch file %s\n", file_path);
-                        if (sample_bank->drum_velocity[i][j]) free(sample_bank->drum_velocity[i][j]);
-                        sample_bank->drum_velocity[i][j] = NULL;
-                        free(file_path); file_path = NULL;
-                        continue;
-                    }
-                    if (fwrite(mem, 1, mem_size, pf) != mem_size) {
-                        fprintf(stderr, "\nCould not write to patch file %s\n", file_path);
-                        if (sample_bank->drum_velocity[i][j]) free(sample_bank->drum_velocity[i][j]);
-                        sample_bank->drum_velocity[i][j] = NULL;
-                    }
-                    fclose(pf);
-                    free(file_path);
-                    file_path = NULL;
-                }
-            }
-        }
+    if (fwrite(mem, 1, mem_size, pf) != mem_size) {
+        fprintf(stderr, "\nCould not write to patch file %s\n", file_path);
+        ok = FALSE;
     }
-    if (options->opt_verbose)
-        printf("\n");
+    fclose(pf);
+    return ok;
+}
 
-    /* clean up after outselves */
-    free(mem);
+#ifdef HAVE_COPY_FILE_RANGE
+static int write_all(int fd, const unsigned char *data, size_t size) {
+    ssize_t n;
+
+    while (size) {
+        n = write(fd, data, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return FALSE;
+        data += n;
+        size -= n;
+    }
+    return TRUE;
 }
 
-static void gen_config_file(UnSF_Options *options, SampleBank *sample_bank) {
-    int i, j, velcount, right_patches;
-    VelocityRangeList *vlist;
+/* copies a waveform from the smpl chunk to the patch file in the kernel,
+ * which lets file systems like XFS or btrfs share the blocks instead.
+ * Where that doesn't work (old kernel, the soundfont on another file
+ * system or not a file) the rest of the run writes from memory. */
+static int copy_waveform(PatchOutput *out, int fd, const PatchView *view) {
+    unsigned char buf[4096];
+    size_t total = (size_t) view->length * 2, done = 0, n;
+    loff_t in = (loff_t) out->smpl_offset + 2 * (view->data - out->smpl_data);
+    ssize_t copied;
+
+    while (done < total && out->source_fd >= 0) {
+        copied = copy_file_range(out->source_fd, &in, fd, NULL, total - done, 0);
+        if (copied > 0) done += copied;
+        else if (copied < 0 && errno == EINTR) continue;
+        else out->source_fd = -1;
+    }
 
-    if (options->opt_no_write) return;
+    /* the same bytes, little endian as in the soundfont */
+    while (done < total) {
+        for (n = 0; n < sizeof(buf) && done + n < total; n++)
+            buf[n] = (unsigned char) (((done + n) & 1 ? view->data[(done + n) >> 1] >> 8
+                                                      : view->data[(done + n) >> 1]) & 0xFF);
+        if (!write_all(fd, buf, n)) return FALSE;
+        done += n;
+    }
+    return TRUE;
+}
 
-    if (options->opt_verbose)
-        printf("Generating config file.\n");
+/* writes a patch whose waveforms were left out of the buffer */
+static int copy_patch_file(PatchOutput *out, int dir_fd, const char *file_name, const char *file_path,
+                           const unsigned char *mem, size_t mem_size) {
+    size_t end, pos = 0;
+    int fd, i, ok = TRUE;
 
-    for (i = 0; i < UNSF_RANGE; i++) {
-        if (sample_bank->tonebank[i]) {
-            fprintf(options->cfg_fd, "\nbank %d #N %s\n", i, sample_bank->tonebank_name[i]);
-            for (j = 0; j < UNSF_RANGE; j++) {
-                if (sample_bank->voice_name[i][j]) {
-                    vlist = sample_bank->voice_velocity[i][j];
-                    if (vlist) {
-                        velcount = vlist->range_count;
-                        right_patches = vlist->right_patches[0];
-                    } else {
-                        fprintf(options->cfg_fd, "\t# %d %s could not be extracted\n", j,
-                                sample_bank->voice_name[i][j]);
-                        continue;
-                    }
-                    fprintf(options->cfg_fd, "\t%d %s/%s", j,
-                            sample_bank->tonebank_name[i], sample_bank->voice_name[i][j]);
-                    if (velcount > 1) fprintf(options->cfg_fd, "\t# %d velocity ranges", velcount);
-                    if (right_patches) {
-                        if (velcount == 1) fprintf(options->cfg_fd, "\t# stereo");
-                        else fprintf(options->cfg_fd, ", stereo");
-                    }
-                    fprintf(options->cfg_fd, "\n");
-                }
-            }
-        }
+#ifdef HAVE_OPENAT
+    if (dir_fd >= 0) fd = openat(dir_fd, file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    else
+#endif
+    fd = open(file_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "\nCould not open patch file %s\n", file_path);
+        return FALSE;
     }
-    for (i = 0; i < UNSF_RANGE; i++) {
-        if (sample_bank->drumset_name[i]) {
-            fprintf(options->cfg_fd, "\ndrumset %d #N %s\n", i, sample_bank->drumset_short_name[i]);
-            for (j = 0; j < UNSF_RANGE; j++) {
-                if (sample_bank->drum_name[i][j]) {
-                    vlist = sample_bank->drum_velocity[i][j];
-                    if (vlist) {
-                        velcount = vlist->range_count;
-                        right_patches = vlist->right_patches[0];
-                    } else {
-                        fprintf(options->cfg_fd, "\t# %d %s could not be extracted\n", j,
-                                sample_bank->drum_name[i][j]);
-                        continue;
-                    }
-                    fprintf(options->cfg_fd, "\t%d %s/%s", j,
-                            sample_bank->drumset_name[i], sample_bank->drum_name[i][j]);
-                    if (velcount > 1) fprintf(options->cfg_fd, "\t# %d velocity ranges", velcount);
-                    if (right_patches) {
-                        if (velcount == 1) fprintf(options->cfg_fd, "\t# stereo");
-                        else fprintf(options->cfg_fd, ", stereo");
-                    }
-                    fprintf(options->cfg_fd, "\n");
-                }
-            }
-        }
+    for (i = 0; ok && i <= out->view_count; i++) {
+        end = i < out->view_count ? out->views[i].offset : mem_size;
+        ok = write_all(fd, mem + pos, end - pos);
+        pos = end;
+        if (ok && i < out->view_count) ok = copy_waveform(out, fd, &out->views[i]);
     }
+    if (close(fd) != 0) ok = FALSE;
+    if (!ok) fprintf(stderr, "\nCould not write to patch file %s\n", file_path);
+    return ok;
 }
 
+/* TRUE if a waveform of the patch covers a whole block and lies at the
+ * same place within a block in the soundfont and in the patch file,
+ * the only way a file system can share the block instead of copying */
+static int patch_shares_blocks(PatchOutput *out) {
+    unsf_off_t src;
+    size_t dst, before = 0, length, skip;
+    long block = out->source_block;
+    int i;
 
-/* creates all the required patch files */
-UNSF_SYMBOL void unsf_convert_sf_to_gus(UnSF_Options *options) {
-    RIFF_CHUNK file, chunk, subchunk;
-    FILE *f;
-    size_t result;
-    int i, j;
-    int rc = 0;
-    char *config_file_path = NULL;
-    char *old_config_file_path = NULL;
-
-    /* SoundFont sample data */
-    short *sf_sample_data = NULL;
-    int sf_sample_data_size = 0;
+    for (i = 0; i < out->view_count; i++) {
+        src = out->smpl_offset + 2 * (unsf_off_t) (out->views[i].data - out->smpl_data);
+        dst = out->views[i].offset + before;
+        length = (size_t) out->views[i].length * 2;
+        before += length;
+        if ((long) (src % block) != (long) (dst % block)) continue;
+        skip = (block - dst % block) % block;
+        if (length >= skip + block) return TRUE;
+    }
+    return FALSE;
+}
 
-    sfPresetHeader *sf_presets = NULL;
-    int sf_num_presets = 0;
+#else
 
-    sfPresetBag *sf_preset_indexes = NULL;
-    int sf_num_preset_indexes = 0;
+static int copy_patch_file(PatchOutput *out, int dir_fd, const char *file_name, const char *file_path,
+                           const unsigned char *mem, size_t mem_size) {
+    return FALSE;
+}
 
-    sfGenList *sf_preset_generators = NULL;
-    int sf_num_preset_generators = 0;
+static int patch_shares_blocks(PatchOutput *out) {
+    return FALSE;
+}
 
-    sfInst *sf_instruments = NULL;
-    int sf_num_instruments = 0;
+#endif /* HAVE_COPY_FILE_RANGE */
 
-    sfInstBag *sf_instrument_indexes = NULL;
-    int sf_num_instrument_indexes = 0;
+/*----------------------------------------------------------------
+ * content-addressed patch store
+ *
+ * Patches are hashed and written once to <store>/xx/<digest>-<size>.pat,
+ * the bank directories only get hard links to them. When a link can't
+ * be made the cfg refers to the store file instead.
+ *----------------------------------------------------------------*/
 
-    /* SoundFont instrument generators */
-    sfGenList *sf_instrument_generators = NULL;
-    int sf_num_instrument_generators = 0;
+/* writes a file in one go, going through a temporary name of its own
+ * so that nobody ever sees a half written store entry, and concurrent
+ * runs storing the same patch never write to the same file */
+static int write_file_atomic(const char *file_path, const unsigned char *mem, size_t mem_size) {
+    static unsigned long tmp_counter = 0;
+    char suffix[32];
+    char *tmp_path = NULL;
+    FILE *pf = NULL;
+    int fd = -1;
+    int tries;
+    int ok = TRUE;
+
+    for (tries = 0; tries < 1000 && fd < 0; tries++) {
+        free(tmp_path);
+        sprintf(suffix, ".%lu.tmp", tmp_counter++);
+        tmp_path = unsf_concat(file_path, suffix);
+        fd = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL | O_BINARY, 0644);
+        if (fd < 0 && errno != EEXIST) break;
+    }
+    if (fd >= 0 && !(pf = fdopen(fd, "wb"))) close(fd);
+    if (!pf) {
+        fprintf(stderr, "\nCould not open patch file %s\n", tmp_path);
+        free(tmp_path);
+        return FALSE;
+    }
+    if (fwrite(mem, 1, mem_size, pf) != mem_size) {
+        fprintf(stderr, "\nCould not write to patch file %s\n", tmp_path);
+        ok = FALSE;
+    }
+    if (fclose(pf) != 0) ok = FALSE;
+    if (ok && !replace_file(tmp_path, file_path)) {
+        fprintf(stderr, "\nCould not rename %s to %s\n", tmp_path, file_path);
+        ok = FALSE;
+    }
+    if (!ok) remove(tmp_path);
+    free(tmp_path);
+    return ok;
+}
 
-    sfSample *sf_samples = NULL;
-    int sf_num_samples = 0;
+static int store_patch_file(UnSF_Options *options, PatchOutput *out, const char *file_path, const unsigned char *mem,
+                            size_t mem_size, char **cfg_path) {
+    char digest[48];
+    char *fanout, *store_name, *store_file;
+    struct stat st;
+    unsf_uint64 h;
+
+    h = unsf_hash(mem, mem_size, 0);
+    sprintf(digest, "%02x/%08lx%08lx-%lu", (unsigned int) ((h >> 56) & 0xFF),
+            (unsigned long) ((h >> 32) & 0xFFFFFFFFUL), (unsigned long) (h & 0xFFFFFFFFUL),
+            (unsigned long) mem_size);
+
+    store_name = unsf_concat(options->store_directory, digest);
+    store_file = unsf_concat(store_name, ".pat");
+
+    /* an entry of the wrong size was cut short, it is written again */
+    if (stat(store_file, &st) != 0 || (unsigned long) st.st_size != (unsigned long) mem_size) {
+        digest[2] = '\0';
+        fanout = unsf_concat(options->store_directory, digest);
+        if (sys_mkdir(fanout) < 0) {
+            fprintf(stderr, "Could not create directory %s, errno: %d, reason: %s\n", fanout, errno,
+                    strerror(errno));
+            free(fanout);
+            free(store_file);
+            free(store_name);
+            return FALSE;
+        }
+        free(fanout);
+        digest[2] = '/';
+        if (!write_file_atomic(store_file, mem, mem_size)) {
+            free(store_file);
+            free(store_name);
+            return FALSE;
+        }
+        if (options->opt_veryverbose) printf("stored %s\n", store_file);
+    } else if (options->opt_veryverbose) printf("%s is already in the store\n", store_file);
+
+    /* the cfg is read from the output directory, so a store file it
+     * refers to goes in with its absolute path */
+    free(*cfg_path);
+    *cfg_path = NULL;
+    if (sys_link(store_file, file_path) != 0) *cfg_path = unsf_concat(out->store_path, digest);
+    free(store_name);
+    free(store_file);
+    return TRUE;
+}
 
-    SampleBank sample_bank;
+/*----------------------------------------------------------------
+ * packed patch archive
+ *
+ * All patches go into a single <basename>.pak:
+ *
+ *   header   64 bytes: "UNSFPAK\0", u32 version, u32 entry count,
+ *            u64 index offset, u64 index size,
+ *            u64 name table offset, u64 name table size, 16 reserved
+ *   payloads one per patch, each starting on a 64 byte boundary
+ *   index    32 bytes per entry: u8 flags (1 = drum), u8 bank,
+ *            u8 program or drum key, u8 frame, u32 name offset,
+ *            u64 payload offset, u64 payload length, u32 name length,
+ *            u32 patch length; sorted by flags, bank and program
+ *   names    "<bank directory>/<patch name>" of every entry, as in the cfg
+ *
+ * All values are little endian. Identical patches are stored once and
+ * shared between their index entries.
+ *
+ * Version 2 archives may hold compressed patches, each one a frame of
+ * its own so that any patch can be read without the others. The frame
+ * byte says how it was packed: 1 for an LZ4 block (the block format
+ * only, without the frame header), plus 2 if the waveforms were delta
+ * encoded before, see delta_filter(). Patches that don't get smaller
+ * are stored as they are with a frame byte of 0. The patch length in
+ * the index is the length once unpacked.
+ *----------------------------------------------------------------*/
 
-#define BAD_SF() {                                          \
-   fprintf(stderr, "Error: bad SoundFont structure\n");     \
-   rc = -1;                                                 \
-   goto getout;                                             \
-}
-#define BAD_SEEK() {                                        \
-   fprintf(stderr, "Failed seek: %s\n", strerror(errno));   \
-   rc = -1;                                                 \
-   goto getout;                                             \
+static void put_le(unsigned char *p, unsf_uint64 val, int bytes) {
+    int i;
+    for (i = 0; i < bytes; i++) {
+        p[i] = (unsigned char) (val & 0xFF);
+        val >>= 8;
+    }
 }
 
-    unsf_mkdir(options->output_directory);
+/* LZ4 block format: sequences of a token (literal count and match length
+ * - 4 in four bits each, 15 meaning more in the bytes that follow), the
+ * literals, and a 16-bit match offset. The last 5 bytes are always
+ * literals and the last match starts at least 12 bytes before the end. */
 
-    config_file_path = unsf_concat(options->output_directory, options->basename);
-    old_config_file_path = config_file_path;
-    config_file_path = unsf_concat(config_file_path, ".cfg");
-    free(old_config_file_path);
+#define LZ_HASH_BITS 14
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5
+#define LZ_MATCH_LIMIT 12
+#define LZ_MAX_OFFSET 65535
 
-    if (!options->opt_no_write) {
-        if (!(options->cfg_fd = fopen(config_file_path, "wb"))) {
-            printf("Couldn't open %s for writing.\n", config_file_path);
-            free(config_file_path);
-            return;
-        } else
-            printf("Opened %s for writing.\n", config_file_path);
+static size_t lz_bound(size_t size) {
+    return size + size / 255 + 16;
+}
 
-    }
-    free(config_file_path);
-    config_file_path = NULL;
+static unsigned int lz_hash(const unsigned char *p) {
+    unsigned long v = p[0] | ((unsigned long) p[1] << 8) | ((unsigned long) p[2] << 16) |
+                      ((unsigned long) p[3] << 24);
+    return (unsigned int) (((v * 2654435761UL) & 0xFFFFFFFFUL) >> (32 - LZ_HASH_BITS));
+}
 
-    memset(&sample_bank, 0, sizeof(struct SampleBank));
+static unsigned char *lz_length(unsigned char *op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (unsigned char) len;
+    return op;
+}
+
+static unsigned char *lz_sequence(unsigned char *op, const unsigned char *literals, size_t literal_count,
+                                  size_t offset, size_t match) {
+    unsigned char *token = op++;
+
+    *token = (unsigned char) ((literal_count < 15 ? literal_count : 15) << 4);
+    if (literal_count >= 15) op = lz_length(op, literal_count - 15);
+    memcpy(op, literals, literal_count);
+    op += literal_count;
+    if (!match) return op;
+
+    *op++ = (unsigned char) (offset & 0xFF);
+    *op++ = (unsigned char) (offset >> 8);
+    match -= LZ_MIN_MATCH;
+    *token |= (unsigned char) (match < 15 ? match : 15);
+    if (match >= 15) op = lz_length(op, match - 15);
+    return op;
+}
+
+/* compresses src into dst, which has room for lz_bound(size) bytes;
+ * table holds 1 << LZ_HASH_BITS positions */
+static size_t lz_compress(const unsigned char *src, size_t size, unsigned char *dst, unsigned int *table) {
+    unsigned char *op = dst;
+    size_t ip = 0, anchor = 0, ref, len;
+    unsigned int h;
+
+    if (size > LZ_MATCH_LIMIT) {
+        memset(table, 0, sizeof(unsigned int) << LZ_HASH_BITS);
+        while (ip < size - LZ_MATCH_LIMIT) {
+            h = lz_hash(src + ip);
+            ref = table[h];
+            table[h] = (unsigned int) ip + 1;           /* 0 is an empty slot */
+            if (!ref-- || ip - ref > LZ_MAX_OFFSET || memcmp(src + ref, src + ip, LZ_MIN_MATCH)) {
+                ip++;
+                continue;
+            }
+            for (len = LZ_MIN_MATCH; ip + len < size - LZ_LAST_LITERALS && src[ref + len] == src[ip + len]; len++) ;
+            op = lz_sequence(op, src + anchor, ip - anchor, ip - ref, len);
+            ip += len;
+            anchor = ip;
+        }
+    }
+    op = lz_sequence(op, src + anchor, size - anchor, 0, 0);
+    return op - dst;
+}
+
+/* TRUE if src unpacks to exactly size bytes */
+static int lz_decompress(const unsigned char *src, size_t src_size, unsigned char *dst, size_t size) {
+    const unsigned char *ip = src, *end = src + src_size;
+    size_t op = 0, len, offset;
+    unsigned char token;
+
+    while (ip < end) {
+        token = *ip++;
+        len = token >> 4;
+        if (len == 15)
+            do {
+                if (ip == end) return FALSE;
+                len += *ip;
+            } while (*ip++ == 255);
+        if (len > (size_t) (end - ip) || len > size - op) return FALSE;
+        memcpy(dst + op, ip, len);
+        ip += len;
+        op += len;
+        if (ip == end) break;                           /* the last literals */
+
+        if (end - ip < 2) return FALSE;
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        len = token & 15;
+        if (len == 15)
+            do {
+                if (ip == end) return FALSE;
+                len += *ip;
+            } while (*ip++ == 255);
+        len += LZ_MIN_MATCH;
+        if (!offset || offset > op || len > size - op) return FALSE;
+        for (; len; len--, op++) dst[op] = dst[op - offset];
+    }
+    return op == size;
+}
+
+#define GUS_HEADER_SIZE 239
+#define GUS_SAMPLE_COUNT 198
+#define GUS_SAMPLE_SIZE 96
+
+/* Replaces the waveforms of a patch by the differences of consecutive
+ * samples, for 16-bit ones all the low bytes first and then all the
+ * high bytes, which leaves a lot more for LZ to find than raw PCM;
+ * decoding undoes it. The headers are copied as they are, so both ways
+ * find the waveforms by walking the headers in src. */
+static void delta_filter(unsigned char *dst, const unsigned char *src, size_t size, int decode) {
+    size_t pos = GUS_HEADER_SIZE, len, half, i;
+    unsigned int prev, val;
+    int s, samples;
+
+    if (size < GUS_HEADER_SIZE) {
+        memcpy(dst, src, size);
+        return;
+    }
+    memcpy(dst, src, GUS_HEADER_SIZE);
+    samples = src[GUS_SAMPLE_COUNT];
+    for (s = 0; s < samples && pos + GUS_SAMPLE_SIZE <= size; s++) {
+        memcpy(dst + pos, src + pos, GUS_SAMPLE_SIZE);
+        len = (size_t) get_le(src + pos + 8, 4);
+        half = src[pos + 55] & 1 ? len / 2 : 0;         /* 16-bit */
+        pos += GUS_SAMPLE_SIZE;
+        if (len > size - pos) break;
+        if (half && (len & 1)) dst[pos + len - 1] = src[pos + len - 1];
+
+        prev = 0;
+        if (!half) {
+            for (i = 0; i < len; i++) {
+                if (decode) dst[pos + i] = (unsigned char) (prev += src[pos + i]);
+                else {
+                    dst[pos + i] = (unsigned char) (src[pos + i] - prev);
+                    prev = src[pos + i];
+                }
+            }
+        } else if (decode) {
+            for (i = 0; i < half; i++) {
+                prev = (prev + (src[pos + i] | (src[pos + half + i] << 8))) & 0xFFFF;
+                dst[pos + 2 * i] = (unsigned char) (prev & 0xFF);
+                dst[pos + 2 * i + 1] = (unsigned char) (prev >> 8);
+            }
+        } else {
+            for (i = 0; i < half; i++) {
+                val = src[pos + 2 * i] | (src[pos + 2 * i + 1] << 8);
+                dst[pos + i] = (unsigned char) ((val - prev) & 0xFF);
+                dst[pos + half + i] = (unsigned char) (((val - prev) >> 8) & 0xFF);
+                prev = val;
+            }
+        }
+        pos += len;
+    }
+    memcpy(dst + pos, src + pos, size - pos);
+}
+
+/* packs a patch into out->frame, returning the frame byte; 0 if it
+ * doesn't get any smaller */
+static int archive_frame(PatchOutput *out, const unsigned char *mem, size_t mem_size, size_t *stored) {
+    size_t need = (size_t) mem_size + lz_bound(mem_size);
+    const unsigned char *src = mem;
+    int frame = ARCHIVE_LZ;
+
+    if (need > out->frame_alloced) {
+        MEM_HOLD(buffers, need - out->frame_alloced);
+        out->frame_alloced = need;
+        if (!(out->frame = (unsigned char *) unsf_realloc(out->frame, need))) BAD_ALLOCATE();
+    }
+    if (!out->lz_table) {
+        if (!(out->lz_table = (unsigned int *) unsf_malloc(sizeof(unsigned int) << LZ_HASH_BITS))) BAD_ALLOCATE();
+        MEM_HOLD(buffers, sizeof(unsigned int) << LZ_HASH_BITS);
+    }
+
+    /* the filtered patch goes behind the room for the compressed one */
+    if (out->archive_compress > 1) {
+        src = out->frame + lz_bound(mem_size);
+        delta_filter((unsigned char *) src, mem, mem_size, FALSE);
+        frame |= ARCHIVE_DELTA;
+    }
+    *stored = lz_compress(src, mem_size, out->frame, out->lz_table);
+    return *stored < (size_t) mem_size ? frame : 0;
+}
+
+static int archive_write(PatchOutput *out, const void *data, size_t size) {
+    if (size && fwrite(data, 1, size, out->archive_fd) != size) return FALSE;
+    out->archive_pos += size;
+    return TRUE;
+}
+
+static int archive_pad(PatchOutput *out) {
+    static const unsigned char zeros[ARCHIVE_ALIGN] = {0};
+    return archive_write(out, zeros, (size_t) ((ARCHIVE_ALIGN - out->archive_pos % ARCHIVE_ALIGN) % ARCHIVE_ALIGN));
+}
+
+static int archive_open(UnSF_Options *options, PatchOutput *out) {
+    unsigned char header[ARCHIVE_HEADER_SIZE];
+    char *path;
+    int i;
+
+    /* written as <name>.pak.tmp, which only replaces <name>.pak once it is
+     * complete */
+    out->archive_name = unsf_concat(options->basename, ".pak");
+    path = unsf_concat(options->output_directory, out->archive_name);
+    out->archive_path = unsf_concat(path, ".tmp");
+    free(path);
+    if (!(out->archive_fd = fopen(out->archive_path, "wb"))) {
+        fprintf(stderr, "Couldn't open %s for writing.\n", out->archive_path);
+        return FALSE;
+    }
+    unsf_counters.files++;
+    for (i = 0; i < ARCHIVE_BUCKETS; i++) out->buckets[i] = -1;
+
+    /* the real header is written once the index is known */
+    memset(header, 0, sizeof(header));
+    return archive_write(out, header, sizeof(header));
+}
+
+static ArchiveEntry *archive_new_entry(PatchOutput *out, int drum, int bank, int program, const char *dir,
+                                       const char *name) {
+    ArchiveEntry *entry;
+    unsigned long len = (unsigned long) (strlen(dir) + 1 + strlen(name));
+
+    if (out->entry_count == out->entries_alloced) {
+        out->entries_alloced = out->entries_alloced ? out->entries_alloced * 2 : 256;
+        out->entries = (ArchiveEntry *) unsf_realloc(out->entries, sizeof(ArchiveEntry) * out->entries_alloced);
+        if (!out->entries) BAD_ALLOCATE();
+    }
+    if (out->names_size + len + 1 > out->names_alloced) {
+        out->names_alloced = (out->names_size + len + 1 + 4095) & ~4095UL;
+        out->names = (char *) unsf_realloc(out->names, out->names_alloced);
+        if (!out->names) BAD_ALLOCATE();
+    }
+
+    entry = &out->entries[out->entry_count++];
+    entry->flags = drum ? ARCHIVE_DRUM : 0;
+    entry->bank = (unsigned char) bank;
+    entry->program = (unsigned char) program;
+    entry->frame = 0;
+    entry->name_offset = out->names_size;
+    entry->name_length = len;
+    entry->next = -1;
+    sprintf(out->names + out->names_size, "%s/%s", dir, name);
+    out->names_size += len + 1;
+    return entry;
+}
+
+/* appends a patch, or points at an identical patch already in the archive */
+static int archive_add(PatchOutput *out, int drum, int bank, int program, const char *dir, const char *name,
+                       const unsigned char *mem, size_t mem_size) {
+    ArchiveEntry *entry;
+    unsf_uint64 hash = unsf_hash(mem, mem_size, 0);
+    int bucket = (int) (hash & (ARCHIVE_BUCKETS - 1));
+    int i;
+
+    entry = archive_new_entry(out, drum, bank, program, dir, name);
+    entry->hash = hash;
+    entry->length = (unsf_uint64) mem_size;
+    entry->stored = entry->length;
+
+    for (i = out->buckets[bucket]; i >= 0; i = out->entries[i].next) {
+        if (out->entries[i].hash == hash && out->entries[i].length == entry->length) {
+            entry->offset = out->entries[i].offset;
+            entry->stored = out->entries[i].stored;
+            entry->frame = out->entries[i].frame;
+            return TRUE;
+        }
+    }
+    entry->next = out->buckets[bucket];
+    out->buckets[bucket] = out->entry_count - 1;
+
+    if (out->archive_compress) {
+        size_t stored;
+        entry->frame = (unsigned char) archive_frame(out, mem, mem_size, &stored);
+        if (entry->frame) {
+            mem = out->frame;
+            mem_size = stored;
+            entry->stored = stored;
+        }
+    }
+
+    if (!archive_pad(out)) return FALSE;
+    entry->offset = out->archive_pos;
+    if (!archive_write(out, mem, mem_size)) {
+        fprintf(stderr, "\nCould not write %s/%s to the patch archive\n", dir, name);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* adds an index entry for a drum key sharing the patch of another key */
+static void archive_alias(PatchOutput *out, int bank, int key, int owner, const char *dir, const char *name) {
+    ArchiveEntry *entry;
+    int i;
+
+    for (i = out->entry_count - 1; i >= 0; i--) {
+        entry = &out->entries[i];
+        if (entry->flags == ARCHIVE_DRUM && entry->bank == bank && entry->program == owner) break;
+    }
+    if (i < 0) return;
+    entry = archive_new_entry(out, TRUE, bank, key, dir, name);
+    entry->hash = out->entries[i].hash;
+    entry->offset = out->entries[i].offset;
+    entry->length = out->entries[i].length;
+    entry->stored = out->entries[i].stored;
+    entry->frame = out->entries[i].frame;
+}
+
+/* writes the index and name table, then the header pointing at them */
+static int compare_archive_entry(const void *a, const void *b) {
+    const ArchiveEntry *x = (const ArchiveEntry *) a, *y = (const ArchiveEntry *) b;
+
+    if (x->flags != y->flags) return x->flags - y->flags;
+    if (x->bank != y->bank) return x->bank - y->bank;
+    return x->program - y->program;
+}
+
+/* finishes the archive and puts it in place, or removes it if the
+ * conversion was cancelled */
+static int archive_close(UnSF_Options *options, PatchOutput *out) {
+    unsigned char header[ARCHIVE_HEADER_SIZE];
+    unsigned char rec[ARCHIVE_ENTRY_SIZE];
+    unsf_uint64 index_offset, names_offset;
+    char *path;
+    int i, ok;
+
+    /* the patches were added in the order they were done, which isn't
+     * the index order with opt_priority; the hash chains aren't needed
+     * any more */
+    if (out->entry_count > 1) qsort(out->entries, out->entry_count, sizeof(ArchiveEntry), compare_archive_entry);
+    ok = archive_pad(out);
+    index_offset = out->archive_pos;
+    for (i = 0; ok && i < out->entry_count; i++) {
+        memset(rec, 0, sizeof(rec));
+        rec[0] = out->entries[i].flags;
+        rec[1] = out->entries[i].bank;
+        rec[2] = out->entries[i].program;
+        rec[3] = out->entries[i].frame;
+        put_le(rec + 4, out->entries[i].name_offset, 4);
+        put_le(rec + 8, out->entries[i].offset, 8);
+        put_le(rec + 16, out->entries[i].stored, 8);
+        put_le(rec + 24, out->entries[i].name_length, 4);
+        if (out->archive_compress) put_le(rec + 28, out->entries[i].length, 4);
+        ok = archive_write(out, rec, sizeof(rec));
+    }
+    names_offset = out->archive_pos;
+    if (ok) ok = archive_write(out, out->names, out->names_size);
+
+    memset(header, 0, sizeof(header));
+    memcpy(header, "UNSFPAK", 8);
+    put_le(header + 8, out->archive_compress ? 2 : 1, 4);
+    put_le(header + 12, out->entry_count, 4);
+    put_le(header + 16, index_offset, 8);
+    put_le(header + 24, names_offset - index_offset, 8);
+    put_le(header + 32, names_offset, 8);
+    put_le(header + 40, out->names_size, 8);
+    if (ok && fseek(out->archive_fd, 0, SEEK_SET) != 0) ok = FALSE;
+    if (ok && fwrite(header, 1, sizeof(header), out->archive_fd) != sizeof(header)) ok = FALSE;
+    if (fclose(out->archive_fd) != 0) ok = FALSE;
+    out->archive_fd = NULL;
+    path = unsf_concat(options->output_directory, out->archive_name);
+    if (ok && !out->cancelled) ok = replace_file(out->archive_path, path);
+    free(path);
+    if (!ok) fprintf(stderr, "Could not write the patch archive %s\n", out->archive_name);
+    if (!ok || out->cancelled) remove(out->archive_path);
+
+    free(out->entries);
+    out->entries = NULL;
+    free(out->names);
+    out->names = NULL;
+    MEM_RELEASE(buffers, out->frame_alloced + (out->lz_table ? sizeof(unsigned int) << LZ_HASH_BITS : 0));
+    free(out->frame);
+    out->frame = NULL;
+    out->frame_alloced = 0;
+    free(out->lz_table);
+    out->lz_table = NULL;
+    return ok;
+}
+
+/* seeks to an offset from an archive header, FALSE if it isn't one this
+ * build can seek to */
+static int archive_seek(FILE *f, unsf_uint64 offset) {
+    unsf_off_t pos = (unsf_off_t) offset;
+
+    if (pos < 0 || (unsf_uint64) pos != offset) return FALSE;
+    return unsf_fseek(f, pos, SEEK_SET) == 0;
+}
+
+/* reads one patch out of a packed patch archive, unpacking it if need be */
+UNSF_SYMBOL unsigned char *unsf_archive_read(const char *archive_path, const char *name, size_t *size) {
+    unsigned char header[ARCHIVE_HEADER_SIZE];
+    unsigned char *index = NULL, *names = NULL, *rec = NULL, *data = NULL, *patch = NULL;
+    unsf_uint64 count, index_size, names_size, offset, stored, length;
+    size_t name_length = strlen(name);
+    FILE *f;
+    int i, frame;
+
+    if (!(f = fopen(archive_path, "rb"))) return NULL;
+    if (fread(header, 1, sizeof(header), f) != sizeof(header) || memcmp(header, "UNSFPAK", 8) != 0 ||
+        get_le(header + 8, 4) > 2)
+        goto done;
+    count = get_le(header + 12, 4);
+    index_size = get_le(header + 24, 8);
+    names_size = get_le(header + 40, 8);
+    if (index_size != count * ARCHIVE_ENTRY_SIZE || index_size > 0x10000000UL || names_size > 0x10000000UL)
+        goto done;
+    if (!(index = (unsigned char *) unsf_malloc((size_t) index_size + 1)) ||
+        !(names = (unsigned char *) unsf_malloc((size_t) names_size + 1)))
+        goto done;
+    if (!archive_seek(f, get_le(header + 16, 8)) ||
+        fread(index, 1, (size_t) index_size, f) != index_size ||
+        !archive_seek(f, get_le(header + 32, 8)) ||
+        fread(names, 1, (size_t) names_size, f) != names_size)
+        goto done;
+
+    for (i = 0; i < (int) count; i++) {
+        rec = index + i * ARCHIVE_ENTRY_SIZE;
+        if (get_le(rec + 24, 4) == name_length && get_le(rec + 4, 4) + name_length <= names_size &&
+            !memcmp(names + get_le(rec + 4, 4), name, name_length))
+            break;
+    }
+    if (i == (int) count) goto done;
+
+    frame = rec[3];
+    offset = get_le(rec + 8, 8);
+    stored = get_le(rec + 16, 8);
+    length = frame ? get_le(rec + 28, 4) : stored;
+    if (stored > 0x40000000UL || length > 0x40000000UL) goto done;
+    if (!(data = (unsigned char *) unsf_malloc((size_t) stored + 1)) ||
+        !archive_seek(f, offset) || fread(data, 1, (size_t) stored, f) != stored)
+        goto done;
+
+    if (!frame) {
+        patch = data;
+        data = NULL;
+    } else if ((patch = (unsigned char *) unsf_malloc((size_t) length + 1)) != NULL) {
+        if (!lz_decompress(data, (size_t) stored, patch, (size_t) length)) {
+            free(patch);
+            patch = NULL;
+        } else if (frame & ARCHIVE_DELTA) {
+            /* the packed bytes aren't needed any more, so they make room for the filter */
+            free(data);
+            if ((data = (unsigned char *) unsf_malloc((size_t) length + 1)) != NULL) {
+                delta_filter(data, patch, (size_t) length, TRUE);
+                free(patch);
+                patch = data;
+                data = NULL;
+            } else {
+                free(patch);
+                patch = NULL;
+            }
+        }
+    }
+    if (patch) *size = (size_t) length;
+
+done:
+    fclose(f);
+    free(index);
+    free(names);
+    free(data);
+    return patch;
+}
+
+/*----------------------------------------------------------------
+ * asynchronous patch writer (Linux io_uring)
+ *
+ * Up to ASYNC_SLOTS patches are in flight at once. Each slot goes
+ * through open, write (again after a short write) and close on the
+ * ring, and its buffer is reused for a later patch once the close has
+ * completed, so the conversion only waits for the disk when all slots
+ * are busy. Without io_uring, or when the kernel turns it down, the
+ * stdio writer above is used.
+ *----------------------------------------------------------------*/
+
+#ifdef HAVE_IO_URING
+
+#define ASYNC_SLOTS 32
+#define ASYNC_ENTRIES 64
+#define ASYNC_BATCH 8
+
+#define ASYNC_FREE 0
+#define ASYNC_OPEN 1
+#define ASYNC_WRITE 2
+#define ASYNC_CLOSE 3
+
+typedef struct AsyncSlot {
+    int state;
+    int fd;
+    int failed;
+    int dir_fd;                         /* opened relative to this directory if >= 0 */
+    char *path;
+    const char *name;                   /* the file name at the end of path */
+    unsigned char *buf;
+    size_t size;
+    size_t done;
+    size_t alloced;
+    VelocityRangeList **vlist;          /* dropped if the patch can't be written */
+} AsyncSlot;
+
+struct AsyncWriter {
+    int ring_fd;
+    int broken;                         /* the kernel refused an operation, use stdio */
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    unsigned to_submit;
+    int in_flight;
+    AsyncSlot slots[ASYNC_SLOTS];
+};
+
+static void async_free(AsyncWriter *w) {
+    int i;
+
+    if (w->sqes && w->sqes != MAP_FAILED) munmap(w->sqes, w->sqes_size);
+    if (w->cq_ring && w->cq_ring != MAP_FAILED && w->cq_ring != w->sq_ring) munmap(w->cq_ring, w->cq_ring_size);
+    if (w->sq_ring && w->sq_ring != MAP_FAILED) munmap(w->sq_ring, w->sq_ring_size);
+    if (w->ring_fd >= 0) close(w->ring_fd);
+    for (i = 0; i < ASYNC_SLOTS; i++) {
+        free(w->slots[i].path);
+        free(w->slots[i].buf);
+        MEM_RELEASE(buffers, w->slots[i].alloced);
+    }
+    free(w);
+}
+
+static int async_open(PatchOutput *out) {
+    struct io_uring_params p;
+    AsyncWriter *w;
+    char *sq, *cq;
+
+    if (!(w = (AsyncWriter *) unsf_calloc(1, sizeof(AsyncWriter)))) BAD_ALLOCATE();
+    memset(&p, 0, sizeof(p));
+    w->ring_fd = (int) syscall(__NR_io_uring_setup, ASYNC_ENTRIES, &p);
+    if (w->ring_fd < 0) {
+        async_free(w);
+        return FALSE;
+    }
+
+    w->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    w->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (w->cq_ring_size > w->sq_ring_size) w->sq_ring_size = w->cq_ring_size;
+        w->cq_ring_size = w->sq_ring_size;
+    }
+    w->sq_ring = mmap(NULL, w->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, w->ring_fd,
+                      IORING_OFF_SQ_RING);
+    if (w->sq_ring != MAP_FAILED && (p.features & IORING_FEAT_SINGLE_MMAP)) w->cq_ring = w->sq_ring;
+    else if (w->sq_ring != MAP_FAILED)
+        w->cq_ring = mmap(NULL, w->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, w->ring_fd,
+                          IORING_OFF_CQ_RING);
+    w->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    if (w->sq_ring != MAP_FAILED && w->cq_ring != MAP_FAILED)
+        w->sqes = (struct io_uring_sqe *) mmap(NULL, w->sqes_size, PROT_READ | PROT_WRITE,
+                                               MAP_SHARED | MAP_POPULATE, w->ring_fd, IORING_OFF_SQES);
+    if (w->sq_ring == MAP_FAILED || w->cq_ring == MAP_FAILED || w->sqes == MAP_FAILED) {
+        async_free(w);
+        return FALSE;
+    }
+
+    sq = (char *) w->sq_ring;
+    cq = (char *) w->cq_ring;
+    w->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    w->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    w->sq_array = (unsigned *) (sq + p.sq_off.array);
+    w->cq_head = (unsigned *) (cq + p.cq_off.head);
+    w->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    w->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+    w->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    out->async = w;
+    return TRUE;
+}
+
+/* queues the next operation of a slot; there is never more than one
+ * per slot, so the ring can't fill up */
+static void async_prep(AsyncWriter *w, int n) {
+    AsyncSlot *slot = &w->slots[n];
+    unsigned tail = *w->sq_tail;
+    unsigned index = tail & *w->sq_mask;
+    struct io_uring_sqe *sqe = &w->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    switch (slot->state) {
+        case ASYNC_OPEN:
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = slot->dir_fd >= 0 ? slot->dir_fd : AT_FDCWD;
+            sqe->addr = (unsigned long) (slot->dir_fd >= 0 ? slot->name : slot->path);
+            sqe->len = 0644;
+            sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+            break;
+        case ASYNC_WRITE:
+            sqe->opcode = IORING_OP_WRITE;
+            sqe->fd = slot->fd;
+            sqe->addr = (unsigned long) (slot->buf + slot->done);
+            sqe->len = (unsigned int) MIN(slot->size - slot->done, 0x40000000UL);
+            sqe->off = slot->done;
+            break;
+        case ASYNC_CLOSE:
+            sqe->opcode = IORING_OP_CLOSE;
+            sqe->fd = slot->fd;
+            break;
+    }
+    sqe->user_data = n;
+    w->sq_array[index] = index;
+    __atomic_store_n(w->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    w->to_submit++;
+}
+
+static void async_done(AsyncWriter *w, AsyncSlot *slot) {
+    if (slot->failed) {
+        if (*slot->vlist) MEM_RELEASE(banks, sizeof(VelocityRangeList));
+        free(*slot->vlist);
+        *slot->vlist = NULL;
+    }
+    slot->state = ASYNC_FREE;
+    w->in_flight--;
+}
+
+/* the kernel does not know one of the operations: finish the patch
+ * with stdio and stop using the ring for new ones */
+static void async_fallback(AsyncWriter *w, AsyncSlot *slot) {
+    w->broken = TRUE;
+    if (slot->fd >= 0) close(slot->fd);
+    slot->failed = !write_file(slot->dir_fd, slot->name, slot->path, slot->buf, slot->size);
+    async_done(w, slot);
+}
+
+/* advances a slot on the completion of its last operation */
+static void async_complete(AsyncWriter *w, int n, int res) {
+    AsyncSlot *slot = &w->slots[n];
+
+    /* kernels before 5.6 don't know these operations */
+    if ((res == -EINVAL || res == -EOPNOTSUPP) && slot->state != ASYNC_CLOSE) {
+        async_fallback(w, slot);
+        return;
+    }
+
+    switch (slot->state) {
+        case ASYNC_OPEN:
+            if (res < 0) {
+                fprintf(stderr, "\nCould not open patch file %s: %s\n", slot->path, strerror(-res));
+                slot->failed = TRUE;
+                async_done(w, slot);
+                return;
+            }
+            slot->fd = res;
+            slot->state = ASYNC_WRITE;
+            break;
+        case ASYNC_WRITE:
+            if (res <= 0) {
+                fprintf(stderr, "\nCould not write to patch file %s\n", slot->path);
+                slot->failed = TRUE;
+                slot->state = ASYNC_CLOSE;
+                break;
+            }
+            slot->done += res;
+            if (slot->done == slot->size) slot->state = ASYNC_CLOSE;
+            break;
+        case ASYNC_CLOSE:
+            if (res == -EINVAL || res == -EOPNOTSUPP) {
+                w->broken = TRUE;
+                if (close(slot->fd) != 0) slot->failed = TRUE;
+            } else if (res < 0) slot->failed = TRUE;
+            async_done(w, slot);
+            return;
+    }
+    async_prep(w, n);
+}
+
+/* submits what is queued and handles the completions, waiting for at
+ * least one if asked to. If the ring itself fails, the patches in it
+ * are written again with stdio, as is everything after them; FALSE
+ * then. A write still pending in the kernel only puts the same bytes
+ * at the same place. */
+static int async_run(AsyncWriter *w, int wait) {
+    unsigned head, tail;
+    int i, ret;
+
+    do {
+        ret = (int) syscall(__NR_io_uring_enter, w->ring_fd, w->to_submit, wait ? 1 : 0,
+                            wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0) {
+        fprintf(stderr, "io_uring_enter failed: %s, writing with stdio\n", strerror(errno));
+        for (i = 0; i < ASYNC_SLOTS; i++)
+            if (w->slots[i].state != ASYNC_FREE) async_fallback(w, &w->slots[i]);
+        w->to_submit = 0;
+        w->broken = TRUE;
+        return FALSE;
+    }
+    w->to_submit -= ret;
+
+    head = *w->cq_head;
+    tail = __atomic_load_n(w->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &w->cqes[head & *w->cq_mask];
+        int n = (int) cqe->user_data, res = cqe->res;
+        __atomic_store_n(w->cq_head, ++head, __ATOMIC_RELEASE);
+        async_complete(w, n, res);
+    }
+    return TRUE;
+}
+
+/* hands a patch to the ring; FALSE if it has to be written with stdio */
+static int async_queue(PatchOutput *out, int dir_fd, const char *file_name, const char *file_path,
+                       const unsigned char *mem, size_t mem_size, VelocityRangeList **vlist) {
+    AsyncWriter *w = out->async;
+    AsyncSlot *slot;
+    int i, n;
+    double t;
+
+    if (!w || w->broken) return FALSE;
+
+    /* wait for a free slot, and for an earlier write of the same file
+     * (drum keys without a name of their own) so the last one wins */
+    for (;;) {
+        n = -1;
+        for (i = 0; i < ASYNC_SLOTS; i++) {
+            if (w->slots[i].state == ASYNC_FREE) {
+                if (n < 0) n = i;
+            } else if (!strcmp(w->slots[i].path, file_path)) break;
+        }
+        if (i == ASYNC_SLOTS && n >= 0) break;
+        t = unsf_clock();
+        async_run(w, TRUE);
+        trace_add(out, "io wait", "io", t);
+        if (w->broken) return FALSE;
+    }
+
+    slot = &w->slots[n];
+    if (slot->alloced < mem_size) {
+        free(slot->buf);
+        MEM_RELEASE(buffers, slot->alloced);
+        slot->alloced = (mem_size + 65535) & ~(size_t) 65535;
+        MEM_HOLD(buffers, slot->alloced);
+        if (!(slot->buf = (unsigned char *) unsf_malloc(slot->alloced))) BAD_ALLOCATE();
+    }
+    memcpy(slot->buf, mem, mem_size);
+    free(slot->path);
+    if (!(slot->path = unsf_strdup(file_path))) BAD_ALLOCATE();
+    slot->name = slot->path + strlen(file_path) - strlen(file_name);
+    slot->dir_fd = dir_fd;
+    slot->size = mem_size;
+    slot->done = 0;
+    slot->fd = -1;
+    slot->failed = FALSE;
+    slot->vlist = vlist;
+    slot->state = ASYNC_OPEN;
+    w->in_flight++;
+    async_prep(w, n);
+
+    if (w->to_submit >= ASYNC_BATCH) async_run(w, FALSE);
+    return TRUE;
+}
+
+/* waits for all patches in flight */
+static void async_flush(PatchOutput *out) {
+    double t = unsf_clock();
+
+    if (!out->async || !out->async->in_flight) return;
+    while (out->async->in_flight) async_run(out->async, TRUE);
+    trace_add(out, "io wait", "io", t);
+}
+
+static void async_close(PatchOutput *out) {
+    if (!out->async) return;
+    async_flush(out);
+    async_free(out->async);
+    out->async = NULL;
+}
+
+#else
+
+static int async_open(PatchOutput *out) {
+    return FALSE;
+}
+
+static int async_queue(PatchOutput *out, int dir_fd, const char *file_name, const char *file_path,
+                       const unsigned char *mem, size_t mem_size, VelocityRangeList **vlist) {
+    return FALSE;
+}
+
+static void async_flush(PatchOutput *out) {
+}
+
+static void async_close(PatchOutput *out) {
+}
+
+#endif /* HAVE_IO_URING */
+
+/* 16 bit samples are kept in host order, which is already the patch
+ * byte order on little endian machines */
+static int host_is_little_endian(void) {
+    const unsigned short one = 1;
+    return *(const unsigned char *) &one;
+}
+
+/* size of a patch with the waveforms left out of its buffer put back */
+static unsigned long patch_size(PatchOutput *out, size_t mem_size) {
+    unsigned long size = mem_size;
+    int i;
+
+    for (i = 0; i < out->view_count; i++) size += (unsigned long) out->views[i].length * 2;
+    return size;
+}
+
+/* hands a finished patch to the caller's sink, the buffer split up
+ * around the waveforms left out of it */
+static int sink_patch(UnSF_Options *options, PatchOutput *out, int drum, int bank, int program,
+                      const char *dir, const char *name, const unsigned char *mem, size_t mem_size) {
+    UnSF_Patch patch;
+    size_t pos = 0;
+    int i, count = 0;
+
+    if (out->segments_alloced < 2 * out->view_count + 1) {
+        out->segments_alloced = 2 * out->view_count + 1;
+        out->segments = (UnSF_Segment *) unsf_realloc(out->segments, sizeof(UnSF_Segment) * out->segments_alloced);
+        if (!out->segments) BAD_ALLOCATE();
+    }
+
+    patch.size = 0;
+    for (i = 0; i < out->view_count; i++) {
+        if (out->views[i].offset > pos) {
+            out->segments[count].data = mem + pos;
+            out->segments[count++].size = out->views[i].offset - pos;
+            pos = out->views[i].offset;
+        }
+        out->segments[count].data = out->views[i].data;
+        out->segments[count++].size = (size_t) out->views[i].length * 2;
+        patch.size += (size_t) out->views[i].length * 2;
+    }
+    if (mem_size > pos) {
+        out->segments[count].data = mem + pos;
+        out->segments[count++].size = mem_size - pos;
+    }
+
+    patch.drum = drum;
+    patch.bank = bank;
+    patch.program = program;
+    patch.dir = dir;
+    patch.name = name;
+    patch.size += mem_size;
+    patch.segment_count = count;
+    patch.segments = out->segments;
+    return options->patch_sink(options->sink_data, &patch) != 0;
+}
+
+/* puts the waveforms left out of the buffer back in, into out->flat,
+ * for the writers that take a patch in one piece */
+static const unsigned char *flatten_patch(PatchOutput *out, const unsigned char *mem, size_t *mem_size) {
+    size_t size = patch_size(out, *mem_size), pos = 0, n = 0, end, k;
+    const PatchView *view;
+    int i;
+
+    if (size > out->flat_alloced) {
+        MEM_RELEASE(buffers, out->flat_alloced);
+        out->flat_alloced = (size + 65535) & ~(size_t) 65535;
+        MEM_HOLD(buffers, out->flat_alloced);
+        free(out->flat);
+        if (!(out->flat = (unsigned char *) unsf_malloc(out->flat_alloced))) BAD_ALLOCATE();
+    }
+    for (i = 0; i <= out->view_count; i++) {
+        end = i < out->view_count ? out->views[i].offset : *mem_size;
+        memcpy(out->flat + n, mem + pos, end - pos);
+        n += end - pos;
+        pos = end;
+        if (i == out->view_count) break;
+        view = &out->views[i];
+        if (host_is_little_endian()) memcpy(out->flat + n, view->data, (size_t) view->length * 2);
+        else {
+            for (k = 0; k < (size_t) view->length; k++) {
+                out->flat[n + 2 * k] = (unsigned char) (view->data[k] & 0xFF);
+                out->flat[n + 2 * k + 1] = (unsigned char) ((view->data[k] >> 8) & 0xFF);
+            }
+        }
+        n += (size_t) view->length * 2;
+    }
+    *mem_size = n;
+    return out->flat;
+}
+
+/* writes a finished patch to <output directory>/<dir>/<name>.pat, or
+ * wherever the output goes; a patch that can't be written loses its
+ * velocity list so that the cfg leaves it out */
+static void write_patch_file(UnSF_Options *options, PatchOutput *out, int drum, int bank, int program,
+                             const char *dir, const char *name, const unsigned char *mem, size_t mem_size,
+                             char **cfg_path, VelocityRangeList **vlist) {
+    char *file_path;
+    const char *file_name;
+    unsigned long size = patch_size(out, mem_size);
+    int dir_fd, ok, existed = TRUE;
+
+    if (options->patch_sink) ok = sink_patch(options, out, drum, bank, program, dir, name, mem, mem_size);
+    else if (out->tar_fd) {
+        file_path = (char *) unsf_malloc(strlen(dir) + strlen(name) + 6);
+        if (!file_path) BAD_ALLOCATE();
+        sprintf(file_path, "%s/%s.pat", dir, name);
+        ok = tar_add(out, file_path, FALSE, mem, mem_size);
+        free(file_path);
+    } else if (out->archive_fd) ok = archive_add(out, drum, bank, program, dir, name, mem, mem_size);
+    else {
+        file_path = (char *) unsf_malloc(strlen(options->output_directory) + strlen(dir) + strlen(name) + 6);
+        if (!file_path) BAD_ALLOCATE();
+        sprintf(file_path, "%s%s/%s.pat", options->output_directory, dir, name);
+
+        /* the bank directories are open already, so each patch costs one lookup */
+        dir_fd = bank_directory_fd(out, dir);
+        file_name = file_path + strlen(file_path) - strlen(name) - 4;
+
+        /* a new file every time, so that nothing is written through a link */
+        existed = unlink_patch(dir_fd, file_name, file_path);
+
+        /* the kernel copies the waveforms where that can share blocks */
+        if (out->view_count && out->source_fd >= 0 &&
+            (options->opt_writer == UNSF_WRITER_COPY || patch_shares_blocks(out)))
+            ok = copy_patch_file(out, dir_fd, file_name, file_path, mem, mem_size);
+        else {
+            if (out->view_count) mem = flatten_patch(out, mem, &mem_size);
+            if (options->store_directory) ok = store_patch_file(options, out, file_path, mem, mem_size, cfg_path);
+            else if (async_queue(out, dir_fd, file_name, file_path, mem, mem_size, vlist)) ok = TRUE;
+            else ok = write_file(dir_fd, file_name, file_path, mem, mem_size);
+        }
+        free(file_path);
+    }
+
+    if (!ok) {
+        if (*vlist) MEM_RELEASE(banks, sizeof(VelocityRangeList));
+        free(*vlist);
+        *vlist = NULL;
+        return;
+    }
+    unsf_counters.bytes_written += size;
+    if (!options->patch_sink && !out->tar_fd && !out->archive_fd) {
+        unsf_counters.files++;
+        out->written[drum][bank][program] = existed ? PATCH_REPLACED : PATCH_CREATED;
+    }
+}
+
+/* Drum keys sounding the same zones get byte-identical patches, so a
+ * key can point at the patch of an earlier key instead of encoding its
+ * own. Keys whose zones differ but would land in the same file get a
+ * file of their own. */
+static int share_drum_patch(UnSF_Options *options, SampleBank *sample_bank, int bank, int key) {
+    int k, clash = FALSE;
+    char *name = sample_bank->drum_name[bank][key];
+    unsf_uint64 zones = sample_bank->drum_zones[bank][key];
+
+    /* the patch depends on the key itself in these cases */
+    if (options->drum_velocity_override[bank][key] != -1) return FALSE;
+    if (options->opt_drum && options->opt_adjust_sample_flags) return FALSE;
+
+    for (k = 0; k < key; k++) {
+        if (!sample_bank->drum_name[bank][k] || sample_bank->drum_alias[bank][k]) continue;
+        if (!sample_bank->drum_velocity[bank][k] || options->drum_velocity_override[bank][k] != -1) continue;
+        if (strcmp(sample_bank->drum_name[bank][k], name)) continue;
+        if (sample_bank->drum_zones[bank][k] == zones) {
+            sample_bank->drum_alias[bank][key] = k + 1;
+            if (options->opt_verbose)
+                printf("drumset #%d drum #%d shares the patch of drum #%d\n", bank, key, k);
+            return TRUE;
+        }
+        clash = TRUE;
+    }
+
+    if (clash) {
+        char *unique = (char *) unsf_malloc(strlen(name) + 8);
+        if (!unique) BAD_ALLOCATE();
+        sprintf(unique, "%s-%d", name, key);
+        free(name);
+        sample_bank->drum_name[bank][key] = unique;
+    }
+    return FALSE;
+}
+
+/*----------------------------------------------------------------
+ * incremental conversion
+ *
+ * <basename>.manifest next to the cfg lists, for every patch file
+ * written, a hash of everything it was made from: the resolved zones,
+ * the sample data they use, the velocity layers and the options that
+ * change the output. A patch whose inputs hash the same and whose file
+ * is still there is not converted again, and files the last run wrote
+ * that are no longer produced are removed.
+ *----------------------------------------------------------------*/
+
+static Manifest *manifest_create(void) {
+    Manifest *m;
+    int i;
+
+    if (!(m = (Manifest *) unsf_calloc(1, sizeof(Manifest)))) BAD_ALLOCATE();
+    for (i = 0; i < MANIFEST_BUCKETS; i++) m->buckets[i] = -1;
+    return m;
+}
+
+static void manifest_free(Manifest *m) {
+    int i;
+
+    if (!m) return;
+    for (i = 0; i < m->count; i++) free(m->entries[i].path);
+    free(m->entries);
+    free(m);
+}
+
+static int manifest_bucket(const char *path) {
+    return (int) (unsf_hash(path, strlen(path), 0) & (MANIFEST_BUCKETS - 1));
+}
+
+static ManifestEntry *manifest_find(Manifest *m, const char *path) {
+    int i;
+
+    for (i = m->buckets[manifest_bucket(path)]; i >= 0; i = m->entries[i].next)
+        if (!strcmp(m->entries[i].path, path)) return &m->entries[i];
+    return NULL;
+}
+
+static ManifestEntry *manifest_add(Manifest *m, const char *path, unsf_uint64 hash, long size) {
+    ManifestEntry *entry;
+    int bucket = manifest_bucket(path);
+
+    if (m->count == m->alloced) {
+        m->alloced = m->alloced ? m->alloced * 2 : 256;
+        m->entries = (ManifestEntry *) unsf_realloc(m->entries, sizeof(ManifestEntry) * m->alloced);
+        if (!m->entries) BAD_ALLOCATE();
+    }
+    entry = &m->entries[m->count];
+    if (!(entry->path = unsf_strdup(path))) BAD_ALLOCATE();
+    entry->hash = hash;
+    entry->size = size;
+    entry->vlist = NULL;
+    entry->next = m->buckets[bucket];
+    m->buckets[bucket] = m->count++;
+    return entry;
+}
+
+static char *manifest_file_name(UnSF_Options *options) {
+    char *base = unsf_concat(options->output_directory, options->basename);
+    char *file_name = unsf_concat(base, ".manifest");
+    free(base);
+    return file_name;
+}
+
+/* TRUE for "<bank directory>/<name>.pat", the only kind of path a
+ * manifest holds. Anything else, like an absolute path or one with a
+ * "..", did not come from unsf and is never removed. */
+static int manifest_path_ok(const char *path) {
+    const char *slash = strchr(path, '/');
+    size_t length = strlen(path);
+
+    if (!slash || slash == path || strchr(slash + 1, '/') || strpbrk(path, "\\:")) return FALSE;
+    if ((slash - path == 1 && path[0] == '.') || (slash - path == 2 && !strncmp(path, "..", 2))) return FALSE;
+    return length > (size_t) (slash - path) + 5 && !strcmp(path + length - 4, ".pat");
+}
+
+/* reads the manifest of the last run; empty if there was none. Lines
+ * that aren't 16 hex digits of hash, a size and a patch path are
+ * skipped. */
+static Manifest *manifest_load(UnSF_Options *options) {
+    Manifest *m = manifest_create();
+    char *file_name = manifest_file_name(options);
+    char line[1024], hex[17], *end;
+    unsigned long hi, lo;
+    long size;
+    int pos;
+    FILE *f;
+
+    if ((f = fopen(file_name, "r"))) {
+        if (fgets(line, sizeof(line), f) && atoi(line + strlen("# unsf manifest ")) == MANIFEST_VERSION) {
+            while (fgets(line, sizeof(line), f)) {
+                line[strcspn(line, "\r\n")] = '\0';
+                pos = 0;
+                if (sscanf(line, "%16[0-9a-fA-F] %ld %n", hex, &size, &pos) != 2 || strlen(hex) != 16 ||
+                    line[16] != ' ' || !pos || size < 0 || !manifest_path_ok(line + pos))
+                    continue;
+                lo = strtoul(hex + 8, &end, 16);
+                hex[8] = '\0';
+                hi = strtoul(hex, &end, 16);
+                manifest_add(m, line + pos, UNSF_U64(hi, lo), size);
+            }
+        }
+        fclose(f);
+    }
+    free(file_name);
+    return m;
+}
+
+static void manifest_save(UnSF_Options *options, Manifest *m) {
+    char *file_name = manifest_file_name(options);
+    char *tmp_name = unsf_concat(file_name, ".tmp");
+    ManifestEntry *entry;
+    FILE *f;
+    int i, ok;
+
+    if (!(f = fopen(tmp_name, "w"))) {
+        fprintf(stderr, "Couldn't open %s for writing.\n", tmp_name);
+        free(tmp_name);
+        free(file_name);
+        return;
+    }
+    ok = fprintf(f, "# unsf manifest %d\n", MANIFEST_VERSION) > 0;
+    for (i = 0; ok && i < m->count; i++) {
+        entry = &m->entries[i];
+        if (entry->vlist && !*entry->vlist) continue;      /* not written after all */
+        ok = fprintf(f, "%08lx%08lx %ld %s\n", (unsigned long) ((entry->hash >> 32) & 0xFFFFFFFFUL),
+                     (unsigned long) (entry->hash & 0xFFFFFFFFUL), entry->size, entry->path) > 0;
+    }
+    if (fclose(f) != 0) ok = FALSE;
+    if (!ok || rename(tmp_name, file_name) != 0) {
+        fprintf(stderr, "Could not write %s\n", file_name);
+        remove(tmp_name);
+    }
+    free(tmp_name);
+    free(file_name);
+}
+
+/* removes the patch files of the last run that this one didn't make */
+static void manifest_prune(UnSF_Options *options, PatchOutput *out) {
+    char *file_path, *slash;
+    int i;
+
+    for (i = 0; i < out->manifest_old->count; i++) {
+        if (manifest_find(out->manifest_new, out->manifest_old->entries[i].path)) continue;
+        if (!manifest_path_ok(out->manifest_old->entries[i].path)) continue;
+        file_path = unsf_concat(options->output_directory, out->manifest_old->entries[i].path);
+        if (remove(file_path) == 0) {
+            if (options->opt_verbose) printf("removed stale %s\n", file_path);
+            /* and the bank directory, if that was the last of it */
+            if ((slash = strrchr(file_path, '/')) != NULL) {
+                *slash = '\0';
+                remove(file_path);
+            }
+        }
+        free(file_path);
+    }
+}
+
+/* everything but the zones that goes into a patch */
+static unsf_uint64 patch_input_seed(UnSF_Options *options, int drum, int bank, int program, const char *name,
+                                    VelocityRangeList *vlist, SampleBank *sample_bank) {
+    int params[10];
+    unsf_uint64 h;
+
+    params[0] = MANIFEST_VERSION;
+    params[1] = drum;
+    params[2] = bank;
+    /* drum keys sounding the same zones make the same patch, see share_drum_patch() */
+    params[3] = drum && !(options->opt_drum && options->opt_adjust_sample_flags) ? -1 : program;
+    params[4] = options->opt_8bit;
+    params[5] = options->opt_small;
+    params[6] = options->opt_mono;
+    params[7] = options->opt_drum;
+    params[8] = options->opt_adjust_sample_flags;
+    params[9] = options->opt_adjust_volume;
+    h = unsf_hash(params, sizeof(params), 0);
+    h = unsf_hash(name, strlen(name), h);
+    h = unsf_hash(sample_bank->cpyrt, strlen(sample_bank->cpyrt), h);
+    if (vlist) h = unsf_hash(vlist, sizeof(VelocityRangeList), h);
+    return h;
+}
+
+/* converts all velocity layers and channels of a patch into mem */
+static int convert_patch(UnSF_Options *options, int drum, int bank, int program, int sf_num_presets,
+                         sfPresetHeader *sf_presets, sfPresetBag *sf_preset_indexes,
+                         sfGenList *sf_preset_generators, sfInst *sf_instruments, sfInstBag *sf_instrument_indexes,
+                         sfGenList *sf_instrument_generators, sfSample *sf_samples, unsigned char **mem,
+                         size_t *mem_alloced, size_t *mem_size, short *sf_sample_data, SampleBank *sample_bank,
+                         PatchOutput *out) {
+    VelocityRangeList *vlist;
+    TraceEvent *e;
+    char *name, *bank_name;
+    int k, ok, velcount, right_patches;
+    int wanted_velmin, wanted_velmax;
+    unsigned long size;
+    double t;
+
+    if (drum) {
+        vlist = sample_bank->drum_velocity[bank][program];
+        name = sample_bank->drum_name[bank][program];
+        bank_name = sample_bank->drumset_name[bank];
+        if (!vlist)
+            fprintf(stderr, "Uh oh, drum #%d %s has no velocity list\n", bank, bank_name);
+        options->opt_drum_bank = bank;
+    } else {
+        vlist = sample_bank->voice_velocity[bank][program];
+        name = sample_bank->voice_name[bank][program];
+        bank_name = sample_bank->tonebank_name[bank];
+        options->opt_bank = bank;
+    }
+    if (vlist) velcount = vlist->range_count;
+    else velcount = 1;
+    if (options->opt_small) velcount = 1;
+    options->opt_header = TRUE;
+    for (k = 0; k < velcount; k++) {
+        if (vlist) {
+            wanted_velmin = vlist->velmin[k];
+            wanted_velmax = vlist->velmax[k];
+            right_patches = vlist->right_patches[k];
+        } else {
+            wanted_velmin = 0;
+            wanted_velmax = 127;
+            right_patches = drum ? sample_bank->drum_samples_right[bank][program] :
+                            sample_bank->voice_samples_right[bank][program];
+        }
+        options->opt_left_channel = TRUE;
+        options->opt_right_channel = FALSE;
+        t = unsf_clock();
+        size = options->opt_header ? 0 : patch_size(out, *mem_size) + (unsigned long) out->inspect_size;
+        ok = grab_soundfont(options, program, drum, name, wanted_velmin, wanted_velmax,
+                            sf_num_presets, sf_presets, sf_preset_indexes, sf_preset_generators,
+                            sf_instruments, sf_instrument_indexes, sf_instrument_generators,
+                            sf_samples, mem, mem_alloced, mem_size, sf_sample_data, sample_bank, out);
+        if ((e = trace_patch(out, "layer", drum, bank, program, t,
+                             patch_size(out, *mem_size) + (unsigned long) out->inspect_size - size))) {
+            e->layer = k;
+            e->channel = right_patches && !options->opt_mono ? "left" : "mono";
+        }
+        if (!ok) {
+            fprintf(stderr, drum ? "Could not create left/mono patch %s for bank %s\n" :
+                            "Could not create patch %s for bank %s\n", name, bank_name);
+            fprintf(stderr, "\tlayer %d of %d layer(s)\n", k + 1, velcount);
+            return FALSE;
+        }
+        options->opt_header = FALSE;
+        if (right_patches && !options->opt_mono) {
+            options->opt_left_channel = FALSE;
+            options->opt_right_channel = TRUE;
+            t = unsf_clock();
+            size = patch_size(out, *mem_size) + (unsigned long) out->inspect_size;
+            ok = grab_soundfont(options, program, drum, name, wanted_velmin, wanted_velmax,
+                                sf_num_presets, sf_presets, sf_preset_indexes, sf_preset_generators,
+                                sf_instruments, sf_instrument_indexes, sf_instrument_generators,
+                                sf_samples, mem, mem_alloced, mem_size, sf_sample_data, sample_bank, out);
+            if ((e = trace_patch(out, "layer", drum, bank, program, t,
+                                 patch_size(out, *mem_size) + (unsigned long) out->inspect_size - size))) {
+                e->layer = k;
+                e->channel = "right";
+            }
+            if (!ok) {
+                fprintf(stderr, "Could not create right patch %s for bank %s\n", name, bank_name);
+                fprintf(stderr, "\tlayer %d of %d layer(s)\n", k + 1, velcount);
+                return FALSE;
+            }
+        }
+    }
+    return TRUE;
+}
+
+/* converts and writes one patch, unless it is unchanged since the last run */
+static void make_patch(UnSF_Options *options, int drum, int bank, int program, int sf_num_presets,
+                       sfPresetHeader *sf_presets, sfPresetBag *sf_preset_indexes, sfGenList *sf_preset_generators,
+                       sfInst *sf_instruments, sfInstBag *sf_instrument_indexes,
+                       sfGenList *sf_instrument_generators, sfSample *sf_samples, unsigned char **mem,
+                       size_t *mem_alloced, size_t *mem_size, short *sf_sample_data, SampleBank *sample_bank,
+                       PatchOutput *out) {
+    VelocityRangeList **vlist;
+    ManifestEntry *entry;
+    char *dir, *name, **cfg_path, *path = NULL;
+    int ok;
+    double t, encode, start = unsf_clock();
+
+    if (drum) {
+        vlist = &sample_bank->drum_velocity[bank][program];
+        dir = sample_bank->drumset_name[bank];
+        name = sample_bank->drum_name[bank][program];
+        cfg_path = &sample_bank->drum_path[bank][program];
+    } else {
+        vlist = &sample_bank->voice_velocity[bank][program];
+        dir = sample_bank->tonebank_name[bank];
+        name = sample_bank->voice_name[bank][program];
+        cfg_path = &sample_bank->voice_path[bank][program];
+    }
+
+    if (out->manifest_new) {
+        struct stat st;
+        char *file_path;
+
+        t = unsf_clock();
+        out->resolve_only = TRUE;
+        out->input_hash = patch_input_seed(options, drum, bank, program, name, *vlist, sample_bank);
+        ok = convert_patch(options, drum, bank, program, sf_num_presets, sf_presets, sf_preset_indexes,
+                           sf_preset_generators, sf_instruments, sf_instrument_indexes, sf_instrument_generators,
+                           sf_samples, mem, mem_alloced, mem_size, sf_sample_data, sample_bank, out);
+        out->resolve_only = FALSE;
+        out->stats.resolve += unsf_clock() - t;
+        if (!ok) {
+            if (*vlist) MEM_RELEASE(banks, sizeof(VelocityRangeList));
+            free(*vlist);
+            *vlist = NULL;
+            return;
+        }
+
+        path = unsf_patch_name(dir, name);
+        path = (char *) unsf_realloc(path, strlen(path) + 5);
+        if (!path) BAD_ALLOCATE();
+        strcat(path, ".pat");
+
+        /* drum keys without a name of their own all go to the same file,
+         * so compare with what this run left there if it got to it first */
+        if ((entry = manifest_find(out->manifest_new, path))) ok = entry->hash == out->input_hash;
+        else if ((entry = manifest_find(out->manifest_old, path)) && entry->hash == out->input_hash) {
+            file_path = unsf_concat(options->output_directory, path);
+            ok = stat(file_path, &st) == 0 && (long) st.st_size == entry->size;
+            free(file_path);
+            if (ok) manifest_add(out->manifest_new, path, entry->hash, entry->size)->vlist = vlist;
+        } else ok = FALSE;
+        if (ok) {
+            if (options->opt_veryverbose) printf("%s is unchanged\n", path);
+            trace_patch(out, "unchanged", drum, bank, program, start, 0);
+            free(path);
+            return;
+        }
+    }
+
+    /* the encoding inside convert_patch() is counted on its own */
+    t = unsf_clock();
+    encode = out->stats.encode;
+    ok = convert_patch(options, drum, bank, program, sf_num_presets, sf_presets, sf_preset_indexes,
+                       sf_preset_generators, sf_instruments, sf_instrument_indexes, sf_instrument_generators,
+                       sf_samples, mem, mem_alloced, mem_size, sf_sample_data, sample_bank, out);
+    out->stats.resolve += unsf_clock() - t - (out->stats.encode - encode);
+    if (!ok) {
+        if (*vlist) MEM_RELEASE(banks, sizeof(VelocityRangeList));
+        free(*vlist);
+        *vlist = NULL;
+        free(path);
+        return;
+    }
+    if (out->inspect) out->patch_sizes[drum][bank][program] = *mem_size + out->inspect_size;
+    out->progress.bytes_done += (double) patch_size(out, *mem_size) + (double) out->inspect_size;
+    if (options->opt_no_write) {
+        trace_patch(out, "patch", drum, bank, program, start, *mem_size + (size_t) out->inspect_size);
+        return;
+    }
+
+    if (path) {
+        /* an entry already made for this file belongs to the patch overwritten now */
+        entry = manifest_find(out->manifest_new, path);
+        if (!entry) entry = manifest_add(out->manifest_new, path, out->input_hash, patch_size(out, *mem_size));
+        entry->hash = out->input_hash;
+        entry->size = patch_size(out, *mem_size);
+        entry->vlist = vlist;
+        free(path);
+    }
+    t = unsf_clock();
+    write_patch_file(options, out, drum, bank, program, dir, name, *mem, *mem_size, cfg_path, vlist);
+    out->stats.write += unsf_clock() - t;
+    trace_patch(out, "write", drum, bank, program, t, patch_size(out, *mem_size));
+    trace_patch(out, "patch", drum, bank, program, start, patch_size(out, *mem_size));
+}
+
+/* writes the cfg; a partial one only lists the patches done so far */
+static void gen_config_file(UnSF_Options *options, SampleBank *sample_bank, PatchOutput *out, int partial) {
+    int i, j;
+    VelocityRangeList *vlist;
+    UnSF_CfgEntry entry;
+    char *path = NULL;
+
+    if (options->opt_no_write) return;
+
+    if (options->opt_verbose)
+        printf("Generating config file.\n");
+
+    memset(&entry, 0, sizeof(entry));
+
+    /* patches are looked up inside the archive */
+    if (out->archive_name) {
+        path = unsf_concat(out->archive_name, "#");
+        entry.type = UNSF_CFG_DIR;
+        entry.name = path;
+        emit_cfg(options, out, &entry);
+        free(path);
+    }
+
+    for (i = 0; i < UNSF_RANGE; i++) {
+        if (sample_bank->tonebank[i]) {
+            memset(&entry, 0, sizeof(entry));
+            entry.type = UNSF_CFG_BANK;
+            entry.bank = i;
+            entry.name = sample_bank->tonebank_name[i];
+            emit_cfg(options, out, &entry);
+            for (j = 0; j < UNSF_RANGE; j++) {
+                if (sample_bank->voice_name[i][j]) {
+                    if (partial && !out->done[0][i][j]) continue;
+                    vlist = sample_bank->voice_velocity[i][j];
+                    entry.program = j;
+                    if (!vlist) {
+                        entry.type = UNSF_CFG_MISSING;
+                        entry.name = sample_bank->voice_name[i][j];
+                        emit_cfg(options, out, &entry);
+                        continue;
+                    }
+                    path = NULL;
+                    entry.type = UNSF_CFG_PATCH;
+                    if (sample_bank->voice_path[i][j]) entry.name = sample_bank->voice_path[i][j];
+                    else entry.name = path = unsf_patch_name(sample_bank->tonebank_name[i],
+                                                             sample_bank->voice_name[i][j]);
+                    entry.velocity_ranges = vlist->range_count;
+                    entry.stereo = vlist->right_patches[0] != 0;
+                    emit_cfg(options, out, &entry);
+                    free(path);
+                }
+            }
+        }
+    }
+    for (i = 0; i < UNSF_RANGE; i++) {
+        if (sample_bank->drumset_name[i]) {
+            memset(&entry, 0, sizeof(entry));
+            entry.type = UNSF_CFG_DRUMSET;
+            entry.bank = i;
+            entry.name = sample_bank->drumset_short_name[i];
+            emit_cfg(options, out, &entry);
+            for (j = 0; j < UNSF_RANGE; j++) {
+                if (sample_bank->drum_name[i][j]) {
+                    int owner = j;
+                    if (partial && !out->done[1][i][j]) continue;
+                    vlist = sample_bank->drum_velocity[i][j];
+                    entry.program = j;
+                    if (sample_bank->drum_alias[i][j]) owner = sample_bank->drum_alias[i][j] - 1;
+                    if (!vlist || !sample_bank->drum_velocity[i][owner]) {
+                        entry.type = UNSF_CFG_MISSING;
+                        entry.name = sample_bank->drum_name[i][j];
+                        emit_cfg(options, out, &entry);
+                        continue;
+                    }
+                    path = NULL;
+                    entry.type = UNSF_CFG_PATCH;
+                    if (sample_bank->drum_path[i][owner]) entry.name = sample_bank->drum_path[i][owner];
+                    else entry.name = path = unsf_patch_name(sample_bank->drumset_name[i],
+                                                             sample_bank->drum_name[i][owner]);
+                    entry.velocity_ranges = vlist->range_count;
+                    entry.stereo = vlist->right_patches[0] != 0;
+                    emit_cfg(options, out, &entry);
+                    free(path);
+                }
+            }
+        }
+    }
+}
+
+static void json_string(FILE *f, const char *str) {
+    putc('"', f);
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\') fprintf(f, "\\%c", *str);
+        else if ((unsigned char) *str < 0x20) fprintf(f, "\\u%04x", (unsigned char) *str);
+        else putc(*str, f);
+    }
+    putc('"', f);
+}
+
+/* one patch of the inspect listing; owner is the key whose patch a
+ * shared drum key uses, or the program itself */
+static void inspect_patch(UnSF_Options *options, PatchOutput *out, int drum, int bank, int program, int owner,
+                          const char *dir, const char *name, const char *path, VelocityRangeList *vlist,
+                          InspectFile *files, int *file_count, int *listed) {
+    unsf_uint64 size = out->patch_sizes[drum][bank][owner];
+    char *patch_path = NULL;
+
+    if (vlist && !path) path = patch_path = unsf_patch_name(dir, name);
+    if (options->opt_inspect == UNSF_INSPECT_JSON) {
+        printf("%s\n    {\"drum\": %s, \"bank\": %d, \"program\": %d, \"name\": ", *listed ? "," : "",
+               drum ? "true" : "false", bank, program);
+        json_string(stdout, vlist ? path : name);
+        if (!vlist) printf(", \"missing\": true}");
+        else if (owner != program) printf(", \"same_as\": %d}", owner);
+        else
+            printf(", \"velocity_ranges\": %d, \"stereo\": %s, \"size\": %lu}", vlist->range_count,
+                   vlist->right_patches[0] ? "true" : "false", (unsigned long) size);
+    } else if (!vlist) printf("\t%d %s\tcould not be extracted\n", program, name);
+    else if (owner != program) printf("\t%d %s\tsame patch as %d\n", program, path, owner);
+    else
+        printf("\t%d %s\t%lu bytes, %d velocity range%s%s\n", program, path, (unsigned long) size,
+               vlist->range_count, vlist->range_count == 1 ? "" : "s", vlist->right_patches[0] ? ", stereo" : "");
+    (*listed)++;
+
+    if (vlist && owner == program) {
+        if (!(files[*file_count].path = unsf_strdup(path))) BAD_ALLOCATE();
+        files[*file_count].order = *file_count;
+        files[*file_count].size = size;
+        (*file_count)++;
+    }
+    free(patch_path);
+}
+
+static int compare_inspect_file(const void *a, const void *b) {
+    const InspectFile *fa = (const InspectFile *) a, *fb = (const InspectFile *) b;
+    int c = strcmp(fa->path, fb->path);
+
+    return c ? c : fa->order - fb->order;
+}
+
+/* prints what a conversion would produce, laid out like the cfg. Keys
+ * without a name of their own end up in one file, the last one written,
+ * so the total counts each file once. */
+static void inspect_report(UnSF_Options *options, SampleBank *sample_bank, PatchOutput *out) {
+    InspectFile *files;
+    unsf_uint64 total = 0;
+    int i, j, owner, listed = 0, file_count = 0, unique = 0;
+    int json = options->opt_inspect == UNSF_INSPECT_JSON;
+    VelocityRangeList *vlist;
+
+    if (!(files = (InspectFile *) unsf_malloc(sizeof(InspectFile) * 2 * UNSF_RANGE * UNSF_RANGE))) BAD_ALLOCATE();
+    if (json) {
+        printf("{\n  \"soundfont\": ");
+        json_string(stdout, options->opt_soundfont);
+        printf(",\n  \"patches\": [");
+    } else printf("soundfont %s\n", options->opt_soundfont);
+
+    for (i = 0; i < UNSF_RANGE; i++) {
+        if (!sample_bank->tonebank[i]) continue;
+        if (!json) printf("bank %d %s\n", i, sample_bank->tonebank_name[i]);
+        for (j = 0; j < UNSF_RANGE; j++) {
+            if (!sample_bank->voice_name[i][j]) continue;
+            vlist = sample_bank->voice_velocity[i][j];
+            inspect_patch(options, out, FALSE, i, j, j, sample_bank->tonebank_name[i], sample_bank->voice_name[i][j],
+                          sample_bank->voice_path[i][j], vlist, files, &file_count, &listed);
+        }
+    }
+    for (i = 0; i < UNSF_RANGE; i++) {
+        if (!sample_bank->drumset_name[i]) continue;
+        if (!json) printf("drumset %d %s\n", i, sample_bank->drumset_short_name[i]);
+        for (j = 0; j < UNSF_RANGE; j++) {
+            if (!sample_bank->drum_name[i][j]) continue;
+            owner = sample_bank->drum_alias[i][j] ? sample_bank->drum_alias[i][j] - 1 : j;
+            vlist = sample_bank->drum_velocity[i][owner] ? sample_bank->drum_velocity[i][j] : NULL;
+            inspect_patch(options, out, TRUE, i, j, owner, sample_bank->drumset_name[i],
+                          sample_bank->drum_name[i][vlist ? owner : j], sample_bank->drum_path[i][owner], vlist,
+                          files, &file_count, &listed);
+        }
+    }
+
+    qsort(files, file_count, sizeof(InspectFile), compare_inspect_file);
+    for (i = 0; i < file_count; i++) {
+        if (i + 1 == file_count || strcmp(files[i].path, files[i + 1].path)) {
+            total += files[i].size;
+            unique++;
+        }
+        free(files[i].path);
+    }
+    free(files);
+
+    if (json)
+        printf("\n  ],\n  \"file_count\": %d,\n  \"total_size\": %lu\n}\n", unique, (unsigned long) total);
+    else printf("%d patch files, %lu bytes\n", unique, (unsigned long) total);
+}
+
+/* writes the cfg as it stands to <name>.cfg.tmp and renames it over
+ * <name>.cfg, so that a player loading it never sees half of one */
+static void publish_cfg(UnSF_Options *options, SampleBank *sample_bank, PatchOutput *out, int partial) {
+    char *tmp_path = unsf_concat(out->publish_path, ".tmp");
+    FILE *f;
+    int ok;
+
+    /* only patches that are on disk may be listed */
+    async_flush(out);
+    out->cfg_size = out->cfg_head;
+    gen_config_file(options, sample_bank, out, partial);
+    out->published_at = time(NULL);
+
+    if (!(f = fopen(tmp_path, "wb"))) {
+        fprintf(stderr, "Couldn't open %s for writing.\n", tmp_path);
+        free(tmp_path);
+        return;
+    }
+    ok = fwrite(out->cfg_text, 1, out->cfg_size, f) == out->cfg_size;
+    if (fclose(f) != 0) ok = FALSE;
+    if (ok) ok = replace_file(tmp_path, out->publish_path);
+    if (!ok) {
+        fprintf(stderr, "Could not write %s\n", out->publish_path);
+        remove(tmp_path);
+    } else {
+        unsf_counters.bytes_written += out->cfg_size;
+        if (!partial) unsf_counters.files++;
+        else if (options->opt_verbose) printf("\nPublished %s\n", out->publish_path);
+    }
+    free(tmp_path);
+}
+
+/* TRUE once the caller has asked for the conversion to stop */
+static int cancelled(UnSF_Options *options, PatchOutput *out) {
+    if (!out->cancelled && options->cancel && *options->cancel) {
+        out->cancelled = TRUE;
+        if (options->opt_verbose)
+            printf("\nConversion cancelled.\n");
+    }
+    return out->cancelled;
+}
+
+static void report_progress(UnSF_Options *options, PatchOutput *out) {
+    UnSF_Progress *progress = &out->progress;
+
+    if (!options->progress) return;
+    progress->seconds = unsf_clock() - out->progress_start;
+    progress->bytes_total = progress->patches_done ?
+                            progress->bytes_done * progress->patches_total / progress->patches_done : 0;
+    progress->bytes_per_second = progress->seconds > 0 ? progress->bytes_done / progress->seconds : 0;
+    options->progress(options->progress_data, progress);
+}
+
+/* marks a patch done, republishing the cfg at most once a second */
+static void patch_done(UnSF_Options *options, SampleBank *sample_bank, PatchOutput *out, int drum, int bank,
+                       int program) {
+    out->done[drum][bank][program] = TRUE;
+    out->progress.patches_done++;
+    report_progress(options, out);
+    if (out->progressive && time(NULL) != out->published_at && !cancelled(options, out))
+        publish_cfg(options, sample_bank, out, TRUE);
+}
+
+static void cost_mark(PatchOutput *out, CostMark *mark) {
+    mark->samples = unsf_counters.samples;
+    mark->input = out->sample_bytes;
+    mark->output = out->progress.bytes_done;
+    mark->resolve = out->stats.resolve;
+    mark->encode = out->stats.encode;
+    mark->write = out->stats.write;
+}
+
+/* records what the patch made since mark cost */
+static void cost_add(SampleBank *sample_bank, PatchOutput *out, int drum, int bank, int program,
+                     const CostMark *mark) {
+    VelocityRangeList *vlist = drum ? sample_bank->drum_velocity[bank][program] :
+                               sample_bank->voice_velocity[bank][program];
+    PatchCost *cost;
+
+    if (out->cost_count == out->costs_alloced) {
+        out->costs_alloced = out->costs_alloced ? out->costs_alloced * 2 : 256;
+        out->costs = (PatchCost *) unsf_realloc(out->costs, sizeof(PatchCost) * out->costs_alloced);
+        if (!out->costs) BAD_ALLOCATE();
+    }
+    cost = &out->costs[out->cost_count++];
+    cost->drum = drum;
+    cost->bank = bank;
+    cost->program = program;
+    cost->layers = vlist ? vlist->range_count : 0;
+    cost->stereo = vlist && vlist->right_patches[0];
+    cost->samples = unsf_counters.samples - mark->samples;
+    cost->input = out->sample_bytes - mark->input;
+    cost->output = out->progress.bytes_done - mark->output;
+    cost->resolve = out->stats.resolve - mark->resolve;
+    cost->encode = out->stats.encode - mark->encode;
+    cost->write = out->stats.write - mark->write;
+}
+
+static int compare_patch_cost(const void *a, const void *b) {
+    const PatchCost *ca = (const PatchCost *) a, *cb = (const PatchCost *) b;
+
+    if (ca->output != cb->output) return ca->output < cb->output ? 1 : -1;
+    if (ca->drum != cb->drum) return ca->drum - cb->drum;
+    if (ca->bank != cb->bank) return ca->bank - cb->bank;
+    return ca->program - cb->program;
+}
+
+static void csv_string(FILE *f, const char *str) {
+    putc('"', f);
+    for (; *str; str++) {
+        if (*str == '"') putc('"', f);
+        putc(*str, f);
+    }
+    putc('"', f);
+}
+
+/* writes <basename>.report.csv or .json, the largest patches first */
+static void cost_report_write(UnSF_Options *options, SampleBank *sample_bank, PatchOutput *out) {
+    int i, json = options->opt_report == UNSF_REPORT_JSON;
+    char *base = unsf_concat(options->output_directory, options->basename);
+    char *path = unsf_concat(base, json ? ".report.json" : ".report.csv");
+    char *name;
+    const char *status;
+    PatchCost *c;
+    FILE *f;
+
+    free(base);
+    if (!(f = fopen(path, "w"))) {
+        fprintf(stderr, "Couldn't open %s for writing.\n", path);
+        free(path);
+        return;
+    }
+    unsf_counters.files++;
+
+    qsort(out->costs, out->cost_count, sizeof(PatchCost), compare_patch_cost);
+    if (json) fprintf(f, "[");
+    else fprintf(f, "drum,bank,program,name,velocity_ranges,stereo,samples,input_bytes,output_bytes,"
+                    "resolve_ms,encode_ms,write_ms,status\n");
+    for (i = 0; i < out->cost_count; i++) {
+        c = &out->costs[i];
+        if (c->drum)
+            name = unsf_patch_name(sample_bank->drumset_name[c->bank], sample_bank->drum_name[c->bank][c->program]);
+        else
+            name = unsf_patch_name(sample_bank->tonebank_name[c->bank], sample_bank->voice_name[c->bank][c->program]);
+        /* a patch found unchanged by -u makes no output */
+        if (!c->layers) status = "failed";
+        else if (!c->output) status = "unchanged";
+        else status = "converted";
+
+        if (json) {
+            fprintf(f, "%s\n  {\"drum\": %s, \"bank\": %d, \"program\": %d, \"name\": ", i ? "," : "",
+                    c->drum ? "true" : "false", c->bank, c->program);
+            json_string(f, name);
+            fprintf(f, ", \"velocity_ranges\": %d, \"stereo\": %s, \"samples\": %lu, \"input_bytes\": %.0f, "
+                       "\"output_bytes\": %.0f, \"resolve_ms\": %.3f, \"encode_ms\": %.3f, \"write_ms\": %.3f, "
+                       "\"status\": \"%s\"}", c->layers, c->stereo ? "true" : "false", c->samples, c->input,
+                    c->output, c->resolve * 1000, c->encode * 1000, c->write * 1000, status);
+        } else {
+            fprintf(f, "%d,%d,%d,", c->drum, c->bank, c->program);
+            csv_string(f, name);
+            fprintf(f, ",%d,%d,%lu,%.0f,%.0f,%.3f,%.3f,%.3f,%s\n", c->layers, c->stereo, c->samples, c->input,
+                    c->output, c->resolve * 1000, c->encode * 1000, c->write * 1000, status);
+        }
+        free(name);
+    }
+    if (json) fprintf(f, "\n]\n");
+    if (fclose(f) != 0) fprintf(stderr, "Could not write %s\n", path);
+    else if (options->opt_verbose) printf("Wrote %s\n", path);
+    free(path);
+}
+
+static void make_melodic_bank(UnSF_Options *options, int i, int sf_num_presets, sfPresetHeader *sf_presets,
+                              sfPresetBag *sf_preset_indexes, sfGenList *sf_preset_generators,
+                              sfInst *sf_instruments, sfInstBag *sf_instrument_indexes,
+                              sfGenList *sf_instrument_generators, sfSample *sf_samples, short *sf_sample_data,
+                              SampleBank *sample_bank, PatchOutput *out, unsigned char **mem, size_t *mem_alloced,
+                              size_t *mem_size) {
+    CostMark mark;
+    int j;
+
+    for (j = 0; j < UNSF_RANGE && !cancelled(options, out); j++) {
+        if (sample_bank->voice_name[i][j]) {
+            if (options->opt_report) cost_mark(out, &mark);
+            make_patch(options, FALSE, i, j, sf_num_presets, sf_presets, sf_preset_indexes,
+                       sf_preset_generators, sf_instruments, sf_instrument_indexes,
+                       sf_instrument_generators, sf_samples, mem, mem_alloced, mem_size, sf_sample_data,
+                       sample_bank, out);
+            if (options->opt_report) cost_add(sample_bank, out, FALSE, i, j, &mark);
+            patch_done(options, sample_bank, out, FALSE, i, j);
+        }
+    }
+}
+
+static void make_drumset(UnSF_Options *options, int i, int sf_num_presets, sfPresetHeader *sf_presets,
+                         sfPresetBag *sf_preset_indexes, sfGenList *sf_preset_generators,
+                         sfInst *sf_instruments, sfInstBag *sf_instrument_indexes,
+                         sfGenList *sf_instrument_generators, sfSample *sf_samples, short *sf_sample_data,
+                         SampleBank *sample_bank, PatchOutput *out, unsigned char **mem, size_t *mem_alloced,
+                         size_t *mem_size) {
+    CostMark mark;
+    int j;
+
+    for (j = 0; j < UNSF_RANGE && !cancelled(options, out); j++) {
+        if (sample_bank->drum_name[i][j]) {
+            if (options->opt_drum_share && share_drum_patch(options, sample_bank, i, j)) {
+                if (out->archive_fd)
+                    archive_alias(out, i, j, sample_bank->drum_alias[i][j] - 1,
+                                  sample_bank->drumset_name[i], sample_bank->drum_name[i][j]);
+            } else {
+                if (options->opt_report) cost_mark(out, &mark);
+                make_patch(options, TRUE, i, j, sf_num_presets, sf_presets, sf_preset_indexes,
+                           sf_preset_generators, sf_instruments, sf_instrument_indexes,
+                           sf_instrument_generators, sf_samples, mem, mem_alloced, mem_size, sf_sample_data,
+                           sample_bank, out);
+                if (options->opt_report) cost_add(sample_bank, out, TRUE, i, j, &mark);
+            }
+            patch_done(options, sample_bank, out, TRUE, i, j);
+        }
+    }
+}
+
+static void make_patch_files(UnSF_Options *options, int sf_num_presets, sfPresetHeader *sf_presets,
+                             sfPresetBag *sf_preset_indexes, sfGenList *sf_preset_generators,
+                             sfInst *sf_instruments, sfInstBag *sf_instrument_indexes,
+                             sfGenList *sf_instrument_generators, sfSample *sf_samples, short *sf_sample_data,
+                             SampleBank *sample_bank, PatchOutput *out) {
+    int i, j;
+    double t;
+
+    /* scratch buffer for generating new patch files */
+    unsigned char *mem = NULL;
+    size_t mem_size = 0;
+    size_t mem_alloced = 0;
+
+    out->zero_copy = (options->patch_sink && !options->opt_8bit && host_is_little_endian() && !out->sf3_samples) ||
+                     out->source_fd >= 0;
+
+    for (i = 0; i < UNSF_RANGE; i++) {
+        for (j = 0; j < UNSF_RANGE; j++) {
+            if (sample_bank->tonebank[i] && sample_bank->voice_name[i][j]) out->progress.patches_total++;
+            if (sample_bank->drumset_name[i] && sample_bank->drum_name[i][j]) out->progress.patches_total++;
+        }
+    }
+    out->progress_start = unsf_clock();
+    report_progress(options, out);
+
+    /* GM bank 0 and the standard drumset first, so that a player can
+     * start on them while the rest is converted */
+    if (options->opt_priority) {
+        if (options->opt_verbose)
+            printf("Priority patch files.\n");
+        if (sample_bank->tonebank[0])
+            make_melodic_bank(options, 0, sf_num_presets, sf_presets, sf_preset_indexes, sf_preset_generators,
+                              sf_instruments, sf_instrument_indexes, sf_instrument_generators, sf_samples,
+                              sf_sample_data, sample_bank, out, &mem, &mem_alloced, &mem_size);
+        if (sample_bank->drumset_name[0])
+            make_drumset(options, 0, sf_num_presets, sf_presets, sf_preset_indexes, sf_preset_generators,
+                         sf_instruments, sf_instrument_indexes, sf_instrument_generators, sf_samples,
+                         sf_sample_data, sample_bank, out, &mem, &mem_alloced, &mem_size);
+        if (out->progressive && !cancelled(options, out)) publish_cfg(options, sample_bank, out, TRUE);
+        if (options->opt_verbose)
+            printf("\n");
+    }
+
+    if (options->opt_verbose)
+        printf("Melodic patch files.\n");
+    for (i = options->opt_priority ? 1 : 0; i < UNSF_RANGE; i++) {
+        if (sample_bank->tonebank[i])
+            make_melodic_bank(options, i, sf_num_presets, sf_presets, sf_preset_indexes, sf_preset_generators,
+                              sf_instruments, sf_instrument_indexes, sf_instrument_generators, sf_samples,
+                              sf_sample_data, sample_bank, out, &mem, &mem_alloced, &mem_size);
+    }
+    if (options->opt_verbose)
+        printf("\nDrum patch files.\n");
+    for (i = options->opt_priority ? 1 : 0; i < UNSF_RANGE; i++) {
+        if (sample_bank->drumset_name[i])
+            make_drumset(options, i, sf_num_presets, sf_presets, sf_preset_indexes, sf_preset_generators,
+                         sf_instruments, sf_instrument_indexes, sf_instrument_generators, sf_samples,
+                         sf_sample_data, sample_bank, out, &mem, &mem_alloced, &mem_size);
+    }
+    if (options->opt_verbose)
+        printf("\n");
+
+    /* the cfg needs to know which patches made it */
+    t = unsf_clock();
+    async_flush(out);
+    out->stats.write += unsf_clock() - t;
+
+    /* clean up after outselves */
+    MEM_RELEASE(patch, mem_alloced + sizeof(PatchView) * out->views_alloced);
+    free(mem);
+    free(out->views);
+    out->views = NULL;
+    free(out->segments);
+    out->segments = NULL;
+    MEM_RELEASE(buffers, out->flat_alloced);
+    free(out->flat);
+    out->flat = NULL;
+    out->flat_alloced = 0;
+}
+
+
+/* removes what a cancelled conversion made: the patch files that
+ * weren't there before, then the bank directories it made, if nothing
+ * else is in them. Patch files it replaced are left, with the new
+ * patches in them. The cfg and a patch archive only replace the old ones
+ * once the conversion is done; in priority mode the cfg already has, so
+ * it is published once more without the removed patches, or removed if
+ * there was none before. */
+static void remove_partial_output(UnSF_Options *options, SampleBank *sample_bank, PatchOutput *out) {
+    char *name, *path;
+    char *(*names)[UNSF_RANGE];
+    int drum, i, j, k;
+
+    for (drum = 0; drum < 2; drum++) {
+        names = drum ? sample_bank->drum_name : sample_bank->voice_name;
+        for (i = 0; i < UNSF_RANGE; i++) {
+            for (j = 0; j < UNSF_RANGE; j++) {
+                if (!out->written[drum][i][j]) continue;
+                /* drum keys can share a file, and the first key written
+                 * to it tells whether it was there: with io_uring the
+                 * file may still be in flight for the later ones */
+                for (k = 0; k < j; k++)
+                    if (out->written[drum][i][k] && !strcmp(names[i][k], names[i][j])) break;
+                if (k < j || out->written[drum][i][j] != PATCH_CREATED) continue;
+                for (k = j; k < UNSF_RANGE; k++)
+                    if (names[i][k] && !strcmp(names[i][k], names[i][j])) out->done[drum][i][k] = FALSE;
+                if (drum) name = unsf_patch_name(sample_bank->drumset_name[i], sample_bank->drum_name[i][j]);
+                else name = unsf_patch_name(sample_bank->tonebank_name[i], sample_bank->voice_name[i][j]);
+                path = (char *) unsf_malloc(strlen(options->output_directory) + strlen(name) + 5);
+                if (!path) BAD_ALLOCATE();
+                sprintf(path, "%s%s.pat", options->output_directory, name);
+                remove(path);
+                free(path);
+                free(name);
+            }
+        }
+    }
+
+    for (drum = 0; drum < 2; drum++) {
+        for (i = 0; i < UNSF_RANGE; i++) {
+            if (!out->made_dir[drum][i]) continue;
+            path = unsf_concat(options->output_directory,
+                               drum ? sample_bank->drumset_name[i] : sample_bank->tonebank_name[i]);
+            sys_rmdir(path);
+            free(path);
+        }
+    }
+
+    if (!out->progressive) return;
+    if (out->cfg_existed) publish_cfg(options, sample_bank, out, TRUE);
+    else remove(out->publish_path);
+}
+
+static int compare_smpl_range(const void *a, const void *b) {
+    unsigned long sa = ((const SmplRange *) a)->start, sb = ((const SmplRange *) b)->start;
+
+    return sa < sb ? -1 : sa > sb;
+}
+
+/* the stretches of smpl that the instrument zones point at, in order and
+ * merged where they overlap. Each sample is followed by the 46 guard
+ * points the specification asks for. */
+static int smpl_ranges(sfGenList *igen, int igen_count, sfSample *samples, int sample_count, unsigned long frames,
+                       SmplRange **ranges) {
+    SmplRange *r;
+    sfSample *sample;
+    int i, n = 0, count = 0;
+
+    if (!(r = (SmplRange *) unsf_malloc(sizeof(SmplRange) * (igen_count ? igen_count : 1)))) BAD_ALLOCATE();
+    for (i = 0; i < igen_count; i++) {
+        if (igen[i].sfGenOper != SFGEN_sampleID || igen[i].genAmount.wAmount >= sample_count) continue;
+        sample = &samples[igen[i].genAmount.wAmount];
+        if (sample->dwStart >= frames) continue;
+        r[n].start = sample->dwStart;
+        r[n].end = MIN(MAX(sample->dwEnd, sample->dwEndloop), frames);
+        r[n].end += MIN(46UL, frames - r[n].end);
+        if (r[n].end > r[n].start) n++;
+    }
+    qsort(r, n, sizeof(SmplRange), compare_smpl_range);
+    for (i = 0; i < n; i++) {
+        if (count && r[i].start <= r[count - 1].end) r[count - 1].end = MAX(r[count - 1].end, r[i].end);
+        else r[count++] = r[i];
+    }
+    *ranges = r;
+    return count;
+}
+
+/* creates all the required patch files */
+UNSF_SYMBOL void unsf_convert_sf_to_gus(UnSF_Options *options) {
+    RIFF_CHUNK file, chunk, subchunk;
+    SfInput in;
+    SmplRange *ranges = NULL;
+    FILE *f, *old_cfg;
+    size_t result;
+    int i, j;
+    int rc = 0;
+    int progressive;
+    char *config_file_path = NULL;
+    char *old_config_file_path = NULL;
+    double start = unsf_clock(), t = start;
+    clock_t cpu = clock();
+    UnSF_PerfCounters perf;
+
+    /* SoundFont sample data */
+    short *sf_sample_data = NULL;
+    unsigned long sf_sample_data_size = 0;
+
+    sfPresetHeader *sf_presets = NULL;
+    int sf_num_presets = 0;
+
+    sfPresetBag *sf_preset_indexes = NULL;
+    int sf_num_preset_indexes = 0;
+
+    sfGenList *sf_preset_generators = NULL;
+    int sf_num_preset_generators = 0;
+
+    sfInst *sf_instruments = NULL;
+    int sf_num_instruments = 0;
+
+    sfInstBag *sf_instrument_indexes = NULL;
+    int sf_num_instrument_indexes = 0;
+
+    /* SoundFont instrument generators */
+    sfGenList *sf_instrument_generators = NULL;
+    int sf_num_instrument_generators = 0;
+
+    sfSample *sf_samples = NULL;
+    int sf_num_samples = 0;
+
+    /* too large for the stack on some platforms */
+    SampleBank *sample_bank = NULL;
+    PatchOutput *out = NULL;
+
+#define BAD_SF() {                                          \
+   fprintf(stderr, "Error: bad SoundFont structure\n");     \
+   rc = -1;                                                 \
+   goto getout;                                             \
+}
+#define BAD_SEEK() {                                        \
+   fprintf(stderr, "Failed seek: %s\n", strerror(errno));   \
+   rc = -1;                                                 \
+   goto getout;                                             \
+}
+#define BAD_SIZE() {                                        \
+   fprintf(stderr, "Error: SoundFont too large\n");         \
+   rc = -1;                                                 \
+   goto getout;                                             \
+}
+
+    if (options->opt_inspect) options->opt_no_write = TRUE;
+    memset(&unsf_counters, 0, sizeof(unsf_counters));
+    memset(&unsf_memory, 0, sizeof(unsf_memory));
+    memset(&unsf_memory_peak, 0, sizeof(unsf_memory_peak));
+
+    /* with a sink or a tar stream nothing touches the disk */
+    if (!options->patch_sink && !options->tar_fd && !options->opt_inspect) {
+        unsf_mkdir(options->output_directory);
+        if (options->store_directory && !options->opt_no_write && unsf_mkdir(options->store_directory) < 0)
+            return;
+    }
+
+    config_file_path = unsf_concat(options->output_directory, options->basename);
+    old_config_file_path = config_file_path;
+    config_file_path = unsf_concat(config_file_path, ".cfg");
+    free(old_config_file_path);
+
+    /* the cfg is kept in memory and only ever replaces the old one as a
+     * whole: at the end, or in priority mode as patches get done */
+    progressive = options->opt_priority && !options->opt_no_write && !options->patch_sink && !options->tar_fd &&
+                  !options->opt_archive;
+    if (options->opt_no_write || options->patch_sink || options->tar_fd) {
+        free(config_file_path);
+        config_file_path = NULL;
+    }
 
-    f = fopen(options->opt_soundfont, "rb");
+    /* "-" is standard input */
+    if (!strcmp(options->opt_soundfont, "-")) {
+        f = stdin;
+#ifdef _WIN32
+        _setmode(_fileno(stdin), _O_BINARY);
+#elif defined(__OS2__)
+        setmode(fileno(stdin), O_BINARY);
+#endif
+    } else f = fopen(options->opt_soundfont, "rb");
     if (!f) {
         fprintf(stderr, "Error opening file\n");
+        free(config_file_path);
         return;
     }
+    in.f = f;
+    in.pos = unsf_ftell(f);
+    in.seekable = in.pos >= 0 && unsf_fseek(f, in.pos, SEEK_SET) == 0;
+    if (!in.seekable) in.pos = 0;
+
+    if (!(sample_bank = (SampleBank *) unsf_calloc(1, sizeof(SampleBank)))) BAD_ALLOCATE();
+    MEM_HOLD(banks, sizeof(SampleBank));
+    if (!(out = (PatchOutput *) unsf_calloc(1, sizeof(PatchOutput)))) BAD_ALLOCATE();
+    out->root_fd = -1;
+    out->source_fd = -1;
+    out->inspect = options->opt_inspect;
+    perf_open(options, out);
+    if (options->trace_file) {
+        out->trace_start = start;
+        out->trace_tid = trace_thread_id();
+    }
+    if (options->tar_fd && !options->patch_sink && !options->opt_no_write) {
+        out->tar_fd = options->tar_fd;
+        out->tar_mtime = (unsigned long) time(NULL);
+        out->cfg_in_memory = TRUE;
+    }
+    if (config_file_path) {
+        out->publish_path = config_file_path;
+        config_file_path = NULL;
+        out->cfg_in_memory = TRUE;
+        out->progressive = progressive;
+        if (progressive && (old_cfg = fopen(out->publish_path, "rb")) != NULL) {
+            out->cfg_existed = TRUE;
+            fclose(old_cfg);
+        }
+    }
+    if (options->store_directory && !options->patch_sink && !out->tar_fd && !options->opt_no_write &&
+        !(out->store_path = sys_fullpath(options->store_directory))) {
+        fprintf(stderr, "Could not find the store directory %s, errno: %d, reason: %s\n", options->store_directory,
+                errno, strerror(errno));
+        rc = -1;
+        goto getout;
+    }
 
-    file.id = get32(f);
+    file.id = get32(&in);
     if (file.id != CID_RIFF) {
         fprintf(stderr, "Error: bad SoundFont header\n");
         rc = -1;
         goto getout;
     }
 
-    file.size = get32(f);
-    calc_end(&file, f);
-    file.type = get32(f);
+    file.size = getu32(&in);
+    if (!calc_end(&file, &in)) BAD_SIZE();
+    file.type = get32(&in);
     if (file.type != CID_sfbk) {
         fprintf(stderr, "Error: bad SoundFont header\n");
         rc = -1;
         goto getout;
     }
 
-    while (ftell(f) < file.end) {
-        chunk.id = get32(f);
-        chunk.size = get32(f);
-        calc_end(&chunk, f);
+    while (in.pos < file.end) {
+        chunk.id = get32(&in);
+        chunk.size = getu32(&in);
+        if (!calc_end(&chunk, &in)) BAD_SIZE();
 
         switch (chunk.id) {
 
             case CID_LIST:
                 /* a list of other chunks */
-                chunk.type = get32(f);
+                chunk.type = get32(&in);
 
-                while (ftell(f) < chunk.end) {
-                    subchunk.id = get32(f);
-                    subchunk.size = get32(f);
-                    calc_end(&subchunk, f);
+                while (in.pos < chunk.end) {
+                    subchunk.id = get32(&in);
+                    subchunk.size = getu32(&in);
+                    if (!calc_end(&subchunk, &in)) BAD_SIZE();
 
                     switch (chunk.type) {
 
@@ -3248,46 +6596,49 @@ UNSF_SYMBOL void unsf_convert_sf_to_gus(UnSF_Options *options) {
                             switch (subchunk.id) {
 
                                 case CID_ifil:
-                                    if (get16(f) < 2) {
+                                    i = get16(&in);
+                                    if (i < 2) {
                                         fprintf(stderr,
                                                 "Error: this is a SoundFont 1.x file, and I only understand version 2 (.sf2)\n");
                                         rc = -1;
                                         goto getout;
                                     }
-                                    get16(f);
+                                    /* SoundFont 3, with Ogg Vorbis samples */
+                                    if (i == 3) out->sf3 = TRUE;
+                                    get16(&in);
                                     break;
 
                                 case CID_INAM:
-                                    print_sf_string(options, f, "Bank name:", options->opt_no_write, &sample_bank);
+                                    print_sf_string(options, &in, "Bank name:", options->opt_no_write, sample_bank, out);
                                     break;
 
                                 case CID_irom:
-                                    print_sf_string(options, f, "ROM name:", options->opt_no_write, &sample_bank);
+                                    print_sf_string(options, &in, "ROM name:", options->opt_no_write, sample_bank, out);
                                     break;
 
                                 case CID_ICRD:
-                                    print_sf_string(options, f, "Date:", options->opt_no_write, &sample_bank);
+                                    print_sf_string(options, &in, "Date:", options->opt_no_write, sample_bank, out);
                                     break;
 
                                 case CID_IENG:
-                                    print_sf_string(options, f, "Made by:", options->opt_no_write, &sample_bank);
+                                    print_sf_string(options, &in, "Made by:", options->opt_no_write, sample_bank, out);
                                     break;
 
                                 case CID_IPRD:
-                                    print_sf_string(options, f, "Target:", options->opt_no_write, &sample_bank);
+                                    print_sf_string(options, &in, "Target:", options->opt_no_write, sample_bank, out);
                                     break;
 
                                 case CID_ICOP:
-                                    print_sf_string(options, f, "Copyright:", options->opt_no_write, &sample_bank);
+                                    print_sf_string(options, &in, "Copyright:", options->opt_no_write, sample_bank, out);
                                     break;
 
                                 case CID_ISFT:
-                                    print_sf_string(options, f, "Tools:", options->opt_no_write, &sample_bank);
+                                    print_sf_string(options, &in, "Tools:", options->opt_no_write, sample_bank, out);
                                     break;
                             }
 
                             /* skip unknown chunks and extra data */
-                            if (fseek(f, subchunk.end, SEEK_SET) < 0) BAD_SEEK();
+                            if (!sf_skip_to(&in, subchunk.end)) BAD_SEEK();
                             break;
 
                         case CID_pdta:
@@ -3298,25 +6649,27 @@ UNSF_SYMBOL void unsf_convert_sf_to_gus(UnSF_Options *options) {
                                     /* preset headers */
                                     sf_num_presets = subchunk.size / 38;
 
-                                    if ((sf_num_presets * 38 != subchunk.size) ||
+                                    if (((unsigned long) sf_num_presets * 38 != subchunk.size) ||
                                         (sf_num_presets < 2) || (sf_presets)) BAD_SF();
 
-                                    sf_presets = (sfPresetHeader *) malloc(sizeof(sfPresetHeader) * sf_num_presets);
+                                    sf_presets = (sfPresetHeader *) unsf_calloc(sf_num_presets, sizeof(sfPresetHeader));
                                     if (!sf_presets) BAD_ALLOCATE();
 
+                                    MEM_HOLD(pdta, sf_num_presets * sizeof(sfPresetHeader));
+
                                     for (i = 0; i < sf_num_presets; i++) {
-                                        result = fread(sf_presets[i].achPresetName, 20, 1, f);
-                                        if (result != 1) {
+                                        result = sf_read(&in, sf_presets[i].achPresetName, 20);
+                                        if (result != 20) {
                                             fputs("Reading error (CID_phdr)", stderr);
                                             rc = -1;
                                             goto getout;
                                         }
-                                        sf_presets[i].wPreset = get16(f);
-                                        sf_presets[i].wBank = get16(f);
-                                        sf_presets[i].wPresetBagNdx = get16(f);
-                                        sf_presets[i].dwLibrary = get32(f);
-                                        sf_presets[i].dwGenre = get32(f);
-                                        sf_presets[i].dwMorphology = get32(f);
+                                        sf_presets[i].wPreset = get16(&in);
+                                        sf_presets[i].wBank = get16(&in);
+                                        sf_presets[i].wPresetBagNdx = get16(&in);
+                                        sf_presets[i].dwLibrary = get32(&in);
+                                        sf_presets[i].dwGenre = get32(&in);
+                                        sf_presets[i].dwMorphology = get32(&in);
                                     }
                                     break;
 
@@ -3324,15 +6677,17 @@ UNSF_SYMBOL void unsf_convert_sf_to_gus(UnSF_Options *options) {
                                     /* preset index list */
                                     sf_num_preset_indexes = subchunk.size / 4;
 
-                                    if ((sf_num_preset_indexes * 4 != subchunk.size) ||
+                                    if (((unsigned long) sf_num_preset_indexes * 4 != subchunk.size) ||
                                         (sf_preset_indexes)) BAD_SF();
 
-                                    sf_preset_indexes = (sfPresetBag *) malloc(sizeof(sfPresetBag) * sf_num_preset_indexes);
+                                    sf_preset_indexes = (sfPresetBag *) unsf_calloc(sf_num_preset_indexes, sizeof(sfPresetBag));
                                     if (!sf_preset_indexes) BAD_ALLOCATE();
 
+                                    MEM_HOLD(pdta, sf_num_preset_indexes * sizeof(sfPresetBag));
+
                                     for (i = 0; i < sf_num_preset_indexes; i++) {
-                                        sf_preset_indexes[i].wGenNdx = get16(f);
-                                        sf_preset_indexes[i].wModNdx = get16(f);
+                                        sf_preset_indexes[i].wGenNdx = get16(&in);
+                                        sf_preset_indexes[i].wModNdx = get16(&in);
                                     }
                                     break;
 
@@ -3340,15 +6695,17 @@ UNSF_SYMBOL void unsf_convert_sf_to_gus(UnSF_Options *options) {
                                     /* preset generator list */
                                     sf_num_preset_generators = subchunk.size / 4;
 
-                                    if ((sf_num_preset_generators * 4 != subchunk.size) ||
+                                    if (((unsigned long) sf_num_preset_generators * 4 != subchunk.size) ||
                                         (sf_preset_generators)) BAD_SF();
 
-                                    sf_preset_generators = (sfGenList *) malloc(sizeof(sfGenList) * sf_num_preset_generators);
+                                    sf_preset_generators = (sfGenList *) unsf_calloc(sf_num_preset_generators, sizeof(sfGenList));
                                     if (!sf_preset_generators) BAD_ALLOCATE();
 
+                                    MEM_HOLD(pdta, sf_num_preset_generators * sizeof(sfGenList));
+
                                     for (i = 0; i < sf_num_preset_generators; i++) {
-                                        sf_preset_generators[i].sfGenOper = get16(f);
-                                        sf_preset_generators[i].genAmount.wAmount = get16(f);
+                                        sf_preset_generators[i].sfGenOper = get16(&in);
+                                        sf_preset_generators[i].genAmount.wAmount = get16(&in);
                                     }
                                     break;
 
@@ -3356,20 +6713,22 @@ UNSF_SYMBOL void unsf_convert_sf_to_gus(UnSF_Options *options) {
                                     /* instrument names and indices */
                                     sf_num_instruments = subchunk.size / 22;
 
-                                    if ((sf_num_instruments * 22 != subchunk.size) ||
+                                    if (((unsigned long) sf_num_instruments * 22 != subchunk.size) ||
                                         (sf_num_instruments < 2) || (sf_instruments)) BAD_SF();
 
-                                    sf_instruments = (sfInst *) malloc(sizeof(sfInst) * sf_num_instruments);
+                                    sf_instruments = (sfInst *) unsf_calloc(sf_num_instruments, sizeof(sfInst));
                                     if (!sf_instruments) BAD_ALLOCATE();
 
+                                    MEM_HOLD(pdta, sf_num_instruments * sizeof(sfInst));
+
                                     for (i = 0; i < sf_num_instruments; i++) {
-                                        result = fread(sf_instruments[i].achInstName, 20, 1, f);
-                                        if (result != 1) {
+                                        result = sf_read(&in, sf_instruments[i].achInstName, 20);
+                                        if (result != 20) {
                                             fputs("Reading error (CID_inst)", stderr);
                                             rc = -1;
                                             goto getout;
                                         }
-                                        sf_instruments[i].wInstBagNdx = get16(f);
+                                        sf_instruments[i].wInstBagNdx = get16(&in);
                                     }
                                     break;
 
@@ -3377,15 +6736,17 @@ UNSF_SYMBOL void unsf_convert_sf_to_gus(UnSF_Options *options) {
                                     /* instrument index list */
                                     sf_num_instrument_indexes = subchunk.size / 4;
 
-                                    if ((sf_num_instrument_indexes * 4 != subchunk.size) ||
+                                    if (((unsigned long) sf_num_instrument_indexes * 4 != subchunk.size) ||
                                         (sf_instrument_indexes)) BAD_SF();
 
-                                    sf_instrument_indexes = (sfInstBag *) malloc(sizeof(sfInstBag) * sf_num_instrument_indexes);
+                                    sf_instrument_indexes = (sfInstBag *) unsf_calloc(sf_num_instrument_indexes, sizeof(sfInstBag));
                                     if (!sf_instrument_indexes) BAD_ALLOCATE();
 
+                                    MEM_HOLD(pdta, sf_num_instrument_indexes * sizeof(sfInstBag));
+
                                     for (i = 0; i < sf_num_instrument_indexes; i++) {
-                                        sf_instrument_indexes[i].wInstGenNdx = get16(f);
-                                        sf_instrument_indexes[i].wInstModNdx = get16(f);
+                                        sf_instrument_indexes[i].wInstGenNdx = get16(&in);
+                                        sf_instrument_indexes[i].wInstModNdx = get16(&in);
                                     }
                                     break;
 
@@ -3393,15 +6754,17 @@ UNSF_SYMBOL void unsf_convert_sf_to_gus(UnSF_Options *options) {
                                     /* instrument generator list */
                                     sf_num_instrument_generators = subchunk.size / 4;
 
-                                    if ((sf_num_instrument_generators * 4 != subchunk.size) ||
+                                    if (((unsigned long) sf_num_instrument_generators * 4 != subchunk.size) ||
                                         (sf_instrument_generators)) BAD_SF();
 
-                                    sf_instrument_generators = (sfGenList *) malloc(sizeof(sfGenList) * sf_num_instrument_generators);
+                                    sf_instrument_generators = (sfGenList *) unsf_calloc(sf_num_instrument_generators, sizeof(sfGenList));
                                     if (!sf_instrument_generators) BAD_ALLOCATE();
 
+                                    MEM_HOLD(pdta, sf_num_instrument_generators * sizeof(sfGenList));
+
                                     for (i = 0; i < sf_num_instrument_generators; i++) {
-                                        sf_instrument_generators[i].sfGenOper = get16(f);
-                                        sf_instrument_generators[i].genAmount.wAmount = get16(f);
+                                        sf_instrument_generators[i].sfGenOper = get16(&in);
+                                        sf_instrument_generators[i].genAmount.wAmount = get16(&in);
                                     }
                                     break;
 
@@ -3409,34 +6772,36 @@ UNSF_SYMBOL void unsf_convert_sf_to_gus(UnSF_Options *options) {
                                     /* sample headers */
                                     sf_num_samples = subchunk.size / 46;
 
-                                    if ((sf_num_samples * 46 != subchunk.size) ||
+                                    if (((unsigned long) sf_num_samples * 46 != subchunk.size) ||
                                         (sf_num_samples < 2) || (sf_samples)) BAD_SF();
 
-                                    sf_samples = (sfSample *) malloc(sizeof(sfSample) * sf_num_samples);
+                                    sf_samples = (sfSample *) unsf_calloc(sf_num_samples, sizeof(sfSample));
                                     if (!sf_samples) BAD_ALLOCATE();
 
+                                    MEM_HOLD(pdta, sf_num_samples * sizeof(sfSample));
+
                                     for (i = 0; i < sf_num_samples; i++) {
-                                        result = fread(sf_samples[i].achSampleName, 20, 1, f);
-                                        if (result != 1) {
+                                        result = sf_read(&in, sf_samples[i].achSampleName, 20);
+                                        if (result != 20) {
                                             fputs("Reading error (CID_shdr)", stderr);
                                             rc = -1;
                                             goto getout;
                                         }
-                                        sf_samples[i].dwStart = get32(f);
-                                        sf_samples[i].dwEnd = get32(f);
-                                        sf_samples[i].dwStartloop = get32(f);
-                                        sf_samples[i].dwEndloop = get32(f);
-                                        sf_samples[i].dwSampleRate = get32(f);
-                                        sf_samples[i].byOriginalKey = get8(f);
-                                        sf_samples[i].chCorrection = get8(f);
-                                        sf_samples[i].wSampleLink = get16(f);
-                                        sf_samples[i].sfSampleType = get16(f);
+                                        sf_samples[i].dwStart = getu32(&in);
+                                        sf_samples[i].dwEnd = getu32(&in);
+                                        sf_samples[i].dwStartloop = getu32(&in);
+                                        sf_samples[i].dwEndloop = getu32(&in);
+                                        sf_samples[i].dwSampleRate = getu32(&in);
+                                        sf_samples[i].byOriginalKey = get8(&in);
+                                        sf_samples[i].chCorrection = get8(&in);
+                                        sf_samples[i].wSampleLink = get16(&in);
+                                        sf_samples[i].sfSampleType = get16(&in);
                                     }
                                     break;
                             }
 
                             /* skip unknown chunks and extra data */
-                            if (fseek(f, subchunk.end, SEEK_SET) < 0) BAD_SEEK();
+                            if (!sf_skip_to(&in, subchunk.end)) BAD_SEEK();
                             break;
 
                         case CID_sdta:
@@ -3445,25 +6810,61 @@ UNSF_SYMBOL void unsf_convert_sf_to_gus(UnSF_Options *options) {
 
                                 case CID_smpl:
                                     /* sample waveform (all in one) */
-                                    if (sf_sample_data) BAD_SF();
+                                    if (sf_sample_data || out->sf3_data) BAD_SF();
+
+                                    /* compressed samples are only decoded when needed */
+                                    if (out->sf3) {
+                                        if ((size_t) subchunk.size != subchunk.size) BAD_SIZE();
+                                        out->sf3_size = subchunk.size;
+                                        out->sf3_data = (unsigned char *) unsf_malloc(subchunk.size ? subchunk.size : 1);
+                                        if (!out->sf3_data) BAD_ALLOCATE();
+                                        MEM_HOLD(samples, subchunk.size);
+                                        if (sf_read(&in, out->sf3_data, subchunk.size) != subchunk.size) BAD_SF();
+                                        break;
+                                    }
+
+                                    /* a listing only needs to know how long it is */
+                                    if (out->inspect) {
+                                        out->smpl_frames = subchunk.size / 2;
+                                        break;
+                                    }
 
                                     sf_sample_data_size = subchunk.size / 2;
-                                    sf_sample_data = (short *) malloc(sizeof(short) * sf_sample_data_size);
+                                    if ((size_t) sf_sample_data_size != sf_sample_data_size) BAD_SIZE();
+                                    sf_sample_data = (short *) unsf_calloc(sf_sample_data_size ? sf_sample_data_size : 1,
+                                                                      sizeof(short));
                                     if (!sf_sample_data) BAD_ALLOCATE();
+                                    MEM_HOLD(samples, sf_sample_data_size * sizeof(short));
+                                    out->smpl_offset = in.pos;
+                                    out->smpl_data = sf_sample_data;
+                                    out->smpl_frames = sf_sample_data_size;
+
+                                    if (!sf_samples || !sf_instrument_generators) {
+                                        if (!sf_read_samples(&in, sf_sample_data, sf_sample_data_size)) BAD_SF();
+                                        break;
+                                    }
 
-                                    for (i = 0; i < sf_sample_data_size; i++)
-                                        sf_sample_data[i] = get16(f);
-
+                                    /* pdta came first, so only what the instruments use is read */
+                                    j = smpl_ranges(sf_instrument_generators, sf_num_instrument_generators, sf_samples,
+                                                    sf_num_samples, sf_sample_data_size, &ranges);
+                                    for (i = 0; i < j; i++) {
+                                        if (!sf_skip_to(&in, out->smpl_offset + (unsf_off_t) ranges[i].start * 2))
+                                            BAD_SEEK();
+                                        if (!sf_read_samples(&in, sf_sample_data + ranges[i].start,
+                                                             ranges[i].end - ranges[i].start)) BAD_SF();
+                                    }
+                                    free(ranges);
+                                    ranges = NULL;
                                     break;
                             }
 
                             /* skip unknown chunks and extra data */
-                            if (fseek(f, subchunk.end, SEEK_SET) < 0) BAD_SEEK();
+                            if (!sf_skip_to(&in, subchunk.end)) BAD_SEEK();
                             break;
 
                         default:
                             /* unrecognised chunk */
-                            if (fseek(f, chunk.end, SEEK_SET) < 0) BAD_SEEK();
+                            if (!sf_skip_to(&in, chunk.end)) BAD_SEEK();
                             break;
                     }
                 }
@@ -3471,65 +6872,174 @@ UNSF_SYMBOL void unsf_convert_sf_to_gus(UnSF_Options *options) {
 
             default:
                 /* not a list so we're not interested */
-                if (fseek(f, chunk.end, SEEK_SET) < 0) BAD_SEEK();
+                if (!sf_skip_to(&in, chunk.end)) BAD_SEEK();
                 break;
         }
 
-        if (feof(f)) BAD_SF();
+        if (feof(in.f)) BAD_SF();
     }
 
     getout:
 
     /* convert SoundFont to .pat format, and add it to the output datafile */
     if (rc == 0) {
-        if ((!sf_sample_data) || (!sf_presets) ||
+        out->stats.parse = unsf_clock() - t;
+        perf_add(out, &out->stats.perf.parse, &out->perf_start);
+        trace_add(out, "parse", "phase", t);
+        if ((!sf_sample_data && !out->sf3_data && !out->smpl_frames) || (!sf_presets) ||
             (!sf_preset_indexes) || (!sf_preset_generators) ||
             (!sf_instruments) || (!sf_instrument_indexes) ||
             (!sf_instrument_generators) || (!sf_samples)) BAD_SF();
+        if (out->sf3_data && !sf3_prepare(options, out, sf_samples, sf_num_samples)) {
+            rc = -1;
+            goto getout;
+        }
 
         if (options->opt_verbose)
             printf("\n");
 
+        t = unsf_clock();
+        perf_read(out, &perf);
         grab_soundfont_banks(options, sf_num_presets, sf_presets, sf_preset_indexes, sf_preset_generators,
-                             sf_instruments, sf_instrument_indexes, sf_instrument_generators, sf_samples, &sample_bank);
-        make_directories(options, &sample_bank);
-        sort_velocity_layers(options, &sample_bank);
-        shorten_drum_names(&sample_bank);
+                             sf_instruments, sf_instrument_indexes, sf_instrument_generators, sf_samples, sample_bank);
+        out->stats.banks = unsf_clock() - t;
+        perf_add(out, &out->stats.perf.banks, &perf);
+        trace_add(out, "banks", "phase", t);
+        t = unsf_clock();
+        perf_read(out, &perf);
+        make_directories(options, sample_bank, out);
+        out->stats.directories = unsf_clock() - t;
+        perf_add(out, &out->stats.perf.directories, &perf);
+        trace_add(out, "directories", "phase", t);
+        t = unsf_clock();
+        perf_read(out, &perf);
+        sort_velocity_layers(options, sample_bank);
+        shorten_drum_names(sample_bank);
+        out->stats.layers = unsf_clock() - t;
+        perf_add(out, &out->stats.perf.layers, &perf);
+        trace_add(out, "velocity layers", "phase", t);
+        out->archive_compress = options->opt_compress;
+        if (options->opt_archive && !options->opt_no_write && !options->patch_sink && !out->tar_fd && !archive_open(options, out)) {
+            rc = -1;
+            goto getout;
+        }
+        if (!options->opt_no_write && !options->patch_sink && !out->tar_fd && !out->archive_fd &&
+            !options->store_directory) {
+#ifdef HAVE_COPY_FILE_RANGE
+            /* 16-bit patches hold the waveforms exactly as they are in smpl.
+             * Blocks can only be shared within one file system. */
+            struct stat source_st, output_st;
+
+            if ((options->opt_writer == UNSF_WRITER_AUTO || options->opt_writer == UNSF_WRITER_COPY) &&
+                !options->opt_8bit && !out->sf3_data && in.seekable && fstat(fileno(f), &source_st) == 0 &&
+                (options->opt_writer == UNSF_WRITER_COPY ||
+                 (stat(options->output_directory[0] ? options->output_directory : ".", &output_st) == 0 &&
+                  source_st.st_dev == output_st.st_dev))) {
+                out->source_fd = fileno(f);
+                out->source_block = source_st.st_blksize > 0 ? (long) source_st.st_blksize : 4096;
+            }
+#endif
+            if (options->opt_writer == UNSF_WRITER_AUTO || options->opt_writer == UNSF_WRITER_ASYNC)
+                async_open(out);
+            if (options->opt_incremental) {
+                out->manifest_old = manifest_load(options);
+                out->manifest_new = manifest_create();
+            }
+        }
+        out->cfg_head = out->cfg_size;
+        t = unsf_clock();
+        perf_read(out, &perf);
         make_patch_files(options, sf_num_presets, sf_presets, sf_preset_indexes, sf_preset_generators, sf_instruments,
-                         sf_instrument_indexes, sf_instrument_generators, sf_samples, sf_sample_data, &sample_bank);
-        gen_config_file(options, &sample_bank);
+                         sf_instrument_indexes, sf_instrument_generators, sf_samples, sf_sample_data, sample_bank,
+                         out);
+        if (out->archive_fd) archive_close(options, out);
+        async_close(out);
+        if (options->opt_report && !out->cancelled && !options->patch_sink && !out->tar_fd)
+            cost_report_write(options, sample_bank, out);
+        if (out->manifest_new && !out->cancelled) {
+            manifest_prune(options, out);
+            manifest_save(options, out->manifest_new);
+        }
+        out->stats.patches = unsf_clock() - t;
+        perf_add(out, &out->stats.perf.patches, &perf);
+        trace_add(out, "patches", "phase", t);
+        t = unsf_clock();
+        perf_read(out, &perf);
+        if (out->cancelled) remove_partial_output(options, sample_bank, out);
+        else if (out->inspect) inspect_report(options, sample_bank, out);
+        else if (out->publish_path) publish_cfg(options, sample_bank, out, FALSE);
+        else gen_config_file(options, sample_bank, out, FALSE);
+        if (out->tar_fd && !out->cancelled) tar_close(options, out);
+        out->stats.config = unsf_clock() - t;
+        perf_add(out, &out->stats.perf.config, &perf);
+        trace_add(out, "config", "phase", t);
+    }
+
+    out->stats.total = unsf_clock() - start;
+    perf_add(out, &out->stats.perf.total, &out->perf_start);
+    perf_close(out);
+    out->stats.cpu = (double) (clock() - cpu) / CLOCKS_PER_SEC;
+    out->stats.counters = unsf_counters;
+    out->stats.memory = unsf_memory;
+    out->stats.memory_peak = unsf_memory_peak;
+    out->stats.max_rss = max_rss();
+    if (options->stats) *options->stats = out->stats;
+    if (options->trace_file) {
+        trace_add(out, "convert", "phase", start);
+        trace_write(options, out);
     }
 
+    close_directories(out);
+    manifest_free(out->manifest_old);
+    manifest_free(out->manifest_new);
+    free(out->archive_name);
+    free(out->archive_path);
+    free(out->store_path);
+    free(out->cfg_text);
+    free(out->publish_path);
+    free(out->trace);
+    free(out->costs);
+    sf3_free(out);
+    free(out->sf3_data);
+    free(out);
+
     /* cleaning up after strdup */
     for (i = 0; i < UNSF_RANGE; i++) {
-        if (sample_bank.tonebank[i]) {
-            free(sample_bank.tonebank_name[i]);
-            sample_bank.tonebank_name[i] = NULL;
+        if (sample_bank->tonebank[i]) {
+            free(sample_bank->tonebank_name[i]);
+            sample_bank->tonebank_name[i] = NULL;
         }
 
-        if (sample_bank.drumset_name[i]) {
-            free(sample_bank.drumset_name[i]);
-            sample_bank.drumset_name[i] = NULL;
+        if (sample_bank->drumset_name[i]) {
+            free(sample_bank->drumset_name[i]);
+            sample_bank->drumset_name[i] = NULL;
 
-            free(sample_bank.drumset_short_name[i]);
-            sample_bank.drumset_short_name[i] = NULL;
+            free(sample_bank->drumset_short_name[i]);
+            sample_bank->drumset_short_name[i] = NULL;
         }
 
         for (j = 0; j < UNSF_RANGE; j++) {
-            free(sample_bank.voice_name[i][j]);
-            sample_bank.voice_name[i][j] = NULL;
+            free(sample_bank->voice_name[i][j]);
+            sample_bank->voice_name[i][j] = NULL;
+
+            free(sample_bank->drum_name[i][j]);
+            sample_bank->drum_name[i][j] = NULL;
+
+            free(sample_bank->drum_velocity[i][j]);
+            sample_bank->drum_velocity[i][j] = NULL;
 
-            free(sample_bank.drum_name[i][j]);
-            sample_bank.drum_name[i][j] = NULL;
+            free(sample_bank->voice_velocity[i][j]);
+            sample_bank->voice_velocity[i][j] = NULL;
 
-            free(sample_bank.drum_velocity[i][j]);
-            sample_bank.drum_velocity[i][j] = NULL;
+            free(sample_bank->voice_path[i][j]);
+            sample_bank->voice_path[i][j] = NULL;
 
-            free(sample_bank.voice_velocity[i][j]);
-            sample_bank.voice_velocity[i][j] = NULL;
+            free(sample_bank->drum_path[i][j]);
+            sample_bank->drum_path[i][j] = NULL;
         }
 
     }
+    free(sample_bank);
 
     /* oh, how polite I am... */
     if (sf_sample_data) {
@@ -3572,7 +7082,8 @@ UNSF_SYMBOL void unsf_convert_sf_to_gus(UnSF_Options *options) {
         sf_samples = NULL;
     }
 
-    if (f)
+    free(ranges);
+    if (f && f != stdin)
         fclose(f);
 }
 
@@ -3584,3 +7095,117 @@ UNSF_SYMBOL UnSF_Options unsf_initialization(void) {
 
     return options;
 }
+
+#ifdef UNSF_KERNELS
+#include "libunsf_kernels.h"
+
+/* folds a block of bytes into a checksum */
+static unsigned long kernel_fold(unsigned long sum, const void *data, size_t size) {
+    const unsigned char *p = (const unsigned char *) data;
+
+    while (size--) sum = sum * 31 + *p++;
+    return sum;
+}
+
+static unsigned char *kernel_mem = NULL;
+static size_t kernel_mem_alloced = 0;
+
+double unsf_kernel_clock(void) {
+    return unsf_clock();
+}
+
+unsigned long unsf_kernel_get16(FILE *f, unsigned long count) {
+    SfInput in;
+    unsigned long sum = 0;
+
+    in.f = f;
+    in.pos = 0;
+    in.seekable = 1;
+    while (count--) sum += (unsigned long) get16(&in);
+    return sum;
+}
+
+unsigned long unsf_kernel_getname(const char *names, int count) {
+    unsigned long sum = 0;
+    int i;
+
+    for (i = 0; i < count; i++) sum += (unsigned long) getname((char *) names + i * 20)[0];
+    return sum;
+}
+
+unsigned long unsf_kernel_apply_generator(const unsigned short *gens, int count, int preset) {
+    /* the velocity override tables make the options too big to set up
+     * on every call */
+    static UnSF_Options options;
+    static int have_options = FALSE;
+    SF_Meta sf_meta;
+    sfGenList g;
+    int i;
+
+    if (!have_options) {
+        options = unsf_initialization();
+        have_options = TRUE;
+    }
+    memset(&sf_meta, 0, sizeof(sf_meta));
+    for (i = 0; i < count; i++) {
+        g.sfGenOper = gens[i * 2];
+        g.genAmount.wAmount = gens[i * 2 + 1];
+        apply_generator(&options, &sf_meta, &g, preset, FALSE);
+    }
+    return kernel_fold(0, &sf_meta, sizeof(sf_meta));
+}
+
+unsigned long unsf_kernel_root_pitch(const int *keys, const int *tunes, int count) {
+    SF_Meta sf_meta;
+    SP_Meta sp_meta;
+    unsigned long sum = 0;
+    int i;
+
+    memset(&sf_meta, 0, sizeof(sf_meta));
+    memset(&sp_meta, 0, sizeof(sp_meta));
+    sf_meta.keymax = 127;
+    for (i = 0; i < count; i++) {
+        sf_meta.key = keys[i];
+        sf_meta.tune = tunes[i];
+        sum += (unsigned long) calc_root_pitch(&sp_meta, &sf_meta) + sp_meta.freq_center;
+    }
+    return sum;
+}
+
+unsigned long unsf_kernel_envelope(const int *timecents, int count, int rate) {
+    unsigned long sum = 0;
+    int i;
+
+    for (i = 0; i < count; i++) sum += (unsigned long) msec2gus(timecent2msec(timecents[i]), rate);
+    return sum;
+}
+
+int unsf_kernel_adjust_volume(const short *pcm, int length) {
+    return adjust_volume(pcm, 0, length);
+}
+
+size_t unsf_kernel_pcm8(const short *pcm, int length, float vol) {
+    size_t size = 0;
+
+    /* a patch buffer always starts out with the header */
+    mem_write_block("GF1PATCH110\0ID#000002\0", 22, &kernel_mem, &size, &kernel_mem_alloced);
+    mem_write_pcm8(pcm, length, vol, &kernel_mem, &size, &kernel_mem_alloced);
+    return size;
+}
+
+size_t unsf_kernel_mem_write8(size_t count) {
+    unsigned char *mem = NULL;
+    size_t size = 0, alloced = 0, i;
+
+    mem_write_block("GF1PATCH110\0ID#000002\0", 22, &mem, &size, &alloced);
+    for (i = 0; i < count; i++) mem_write8((int) (i & 0xFF), &mem, &size, &alloced);
+    free(mem);
+    return size;
+}
+
+void unsf_kernel_free(void) {
+    free(kernel_mem);
+    kernel_mem = NULL;
+    kernel_mem_alloced = 0;
+}
+#endif
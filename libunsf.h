@@ -39,6 +39,157 @@
 extern "C" {
 #endif
 
+/* a piece of a patch handed to patch_sink; concatenated in order the
+segments of a patch make up the .pat file */
+typedef struct UnSF_Segment
+{
+    const void *data;
+    size_t size;
+} UnSF_Segment;
+
+typedef struct UnSF_Patch
+{
+    int drum;                       /* 1 for a drumset, 0 for a melodic bank */
+    int bank;
+    int program;                    /* program, or key in a drumset */
+    const char *dir;                /* bank directory name, as used in the cfg */
+    const char *name;               /* patch name without .pat */
+    size_t size;                    /* sum of the segment sizes */
+    int segment_count;
+    const UnSF_Segment *segments;
+} UnSF_Patch;
+
+/* kinds of cfg records handed to cfg_sink */
+#define UNSF_CFG_INFO       0       /* soundfont info: name is the title, text the value */
+#define UNSF_CFG_DIR        1       /* "dir <name>" */
+#define UNSF_CFG_BANK       2       /* "bank <bank> #N <name>" */
+#define UNSF_CFG_DRUMSET    3       /* "drumset <bank> #N <name>" */
+#define UNSF_CFG_PATCH      4       /* "<program> <name>" within the last bank or drumset */
+#define UNSF_CFG_MISSING    5       /* program <program> named <name> could not be extracted */
+
+/* how much work a conversion did, to tell an algorithmic change from
+noise in the timings. The byte totals are doubles so that they don't wrap
+where long is 32 bits. */
+typedef struct UnSF_Counters
+{
+    unsigned long presets_scanned;  /* preset headers looked at to find the patches */
+    unsigned long zones_visited;    /* preset and instrument zones */
+    unsigned long generators;       /* generators applied */
+    unsigned long samples;          /* waveforms put into patches */
+    unsigned long files;            /* patch, cfg and archive files written, again if overwritten */
+    unsigned long directories;      /* directories created */
+    unsigned long allocations;      /* heap allocations made by the library */
+    double allocated;               /* bytes asked for by those */
+    double bytes_read;              /* from the soundfont */
+    double bytes_written;           /* patches and cfg, wherever they went */
+} UnSF_Counters;
+
+/* bytes of memory held by the main structures of a conversion */
+typedef struct UnSF_Memory
+{
+    double samples;                 /* the sample data, compressed for SoundFont 3 */
+    double pdta;                    /* preset, instrument and sample headers, bags and generators */
+    double banks;                   /* SampleBank and the velocity layer lists */
+    double patch;                   /* the buffer a patch is put together in */
+    double cache;                   /* decoded SoundFont 3 samples */
+    double buffers;                 /* async write, archive and cfg buffers */
+    double total;
+} UnSF_Memory;
+
+/* what the processor did in a stage, from its hardware counters */
+typedef struct UnSF_PerfCounters
+{
+    double cycles;
+    double instructions;
+    double cache_misses;
+    double branch_misses;
+} UnSF_PerfCounters;
+
+/* bits of UnSF_Perf.available */
+#define UNSF_PERF_CYCLES        1
+#define UNSF_PERF_INSTRUCTIONS  2
+#define UNSF_PERF_CACHE_MISSES  4
+#define UNSF_PERF_BRANCH_MISSES 8
+
+/* the hardware counters of the conversion stages, counted in user space
+for the calling thread. encode is only the waveform loop of each patch,
+within patches. available tells which counters could be opened, 0 when
+none could: not Linux, a kernel without perf events, or one that doesn't
+allow them, as in most containers. The counts are scaled up when the
+kernel had to share the counters with other users. */
+typedef struct UnSF_Perf
+{
+    int available;
+    UnSF_PerfCounters parse;
+    UnSF_PerfCounters banks;
+    UnSF_PerfCounters directories;
+    UnSF_PerfCounters layers;
+    UnSF_PerfCounters patches;
+    UnSF_PerfCounters encode;
+    UnSF_PerfCounters config;
+    UnSF_PerfCounters total;
+} UnSF_Perf;
+
+/* where a conversion spent its time, in seconds of a monotonic clock.
+The patch stage is split into resolving the zones of each patch, encoding
+it and writing it out. Conversion runs on the calling thread, so cpu is
+that thread's share of the processor time. */
+typedef struct UnSF_Stats
+{
+    double parse;                   /* reading the RIFF chunks */
+    double banks;                   /* finding the banks, programs and velocity layers */
+    double directories;
+    double layers;                  /* sorting the velocity layers, naming drums */
+    double patches;
+    double resolve;
+    double encode;
+    double write;
+    double config;
+    double total;
+    double cpu;
+    UnSF_Counters counters;
+    UnSF_Memory memory;             /* held when the conversion finished */
+    UnSF_Memory memory_peak;        /* the most held at any time */
+    double max_rss;                 /* resident set high-water of the process in bytes, 0 if unknown */
+    UnSF_Perf perf;                 /* with opt_perf */
+} UnSF_Stats;
+
+/* handed to the progress callback after every patch */
+typedef struct UnSF_Progress
+{
+    int patches_done;
+    int patches_total;
+    double bytes_done;              /* of the patches made so far */
+    double bytes_total;             /* estimated from the patches made so far, 0 before the first */
+    double seconds;                 /* since the first patch was started */
+    double bytes_per_second;
+} UnSF_Progress;
+
+/* opt_writer */
+#define UNSF_WRITER_AUTO    0
+#define UNSF_WRITER_STDIO   1
+#define UNSF_WRITER_ASYNC   2
+#define UNSF_WRITER_COPY    3
+
+/* opt_inspect listings */
+#define UNSF_INSPECT_TEXT   1
+#define UNSF_INSPECT_JSON   2
+
+/* opt_report formats */
+#define UNSF_REPORT_CSV     1
+#define UNSF_REPORT_JSON    2
+
+typedef struct UnSF_CfgEntry
+{
+    int type;
+    int bank;
+    int program;
+    const char *name;
+    const char *text;
+    int velocity_ranges;
+    int stereo;
+} UnSF_CfgEntry;
+
 typedef struct UnSF_Options
 {
     int opt_8bit;
@@ -58,7 +209,87 @@ typedef struct UnSF_Options
     int opt_adjust_volume;
     char *basename;
     char *output_directory;
+    /* no longer opened: the cfg is written to <basename>.cfg.tmp and
+    renamed over <basename>.cfg once the conversion is done */
     FILE *cfg_fd;
+    /* optional content-addressed patch store, shared between runs and fonts;
+    patches are written here once and hard linked into the bank directories. */
+    char *store_directory;
+    /* drum keys sounding the same zones share one patch file */
+    int opt_drum_share;
+    /* write all patches into a single indexed <basename>.pak instead of bank directories */
+    int opt_archive;
+    /* compress each patch in the archive on its own: 1 LZ, 2 LZ after
+    delta encoding the waveforms; unsf_archive_read() unpacks them */
+    int opt_compress;
+    /* only convert patches whose inputs changed since the last run, going
+    by <basename>.manifest, and remove the ones no longer produced */
+    int opt_incremental;
+    /* in-memory output: when patch_sink is set nothing is written to disk,
+    every finished patch goes to patch_sink and every cfg line to cfg_sink.
+    Segments are only valid during the call; waveforms that need no
+    conversion point straight into the loaded sample data. Returning 0
+    from patch_sink marks the patch as failed. */
+    int (*patch_sink)(void *sink_data, const UnSF_Patch *patch);
+    void (*cfg_sink)(void *sink_data, const UnSF_CfgEntry *entry);
+    void *sink_data;
+    /* if set, the bank directories, patches and cfg are written to this
+    stream as a ustar archive instead of to output_directory */
+    FILE *tar_fd;
+    /* convert GM bank 0 and the standard drumset first; with plain patch
+    files the cfg is then republished as patches are done, so a player can
+    load it long before the conversion is finished */
+    int opt_priority;
+    /* SoundFont 3: decoder for the Ogg Vorbis samples, for builds without
+    libvorbisfile or to use another one. Decodes the mono stream data/size
+    into frames samples at pcm, returning 0 on failure. Without a decoder
+    a font with compressed samples is an error. */
+    int (*vorbis_decoder)(const void *data, size_t size, short *pcm, unsigned long frames);
+    /* bytes of decoded SoundFont 3 samples kept around, 0 for 32 MiB */
+    size_t sample_cache_size;
+    /* UNSF_INSPECT_TEXT or UNSF_INSPECT_JSON: print the banks, patches,
+    velocity ranges, stereo and predicted patch sizes to stdout instead of
+    converting. The sample data is skipped, not read. Implies opt_no_write. */
+    int opt_inspect;
+    /* if set, filled in with the timings and counts of the conversion */
+    UnSF_Stats *stats;
+    /* if set, a Chrome trace of the conversion is written to this file:
+    its phases and, for each patch, the velocity layers and channels
+    resolved and encoded and the writing out, with their sizes */
+    const char *trace_file;
+    /* if set, called once before the first patch and again after each
+    one. The structure is only valid during the call. */
+    void (*progress)(void *progress_data, const UnSF_Progress *progress);
+    void *progress_data;
+    /* if set, the conversion stops before the next patch once *cancel is
+    non-zero; it may be set from another thread or a signal handler. The
+    patch files and bank directories the conversion created are removed;
+    patch files it replaced keep the new patches. The cfg and a patch
+    archive only replace those of an earlier run when the conversion is
+    done, so they are left as they were, except that in priority mode the
+    cfg is republished without the removed patches. A tar stream is left
+    without its end. */
+    volatile int *cancel;
+    /* UNSF_REPORT_CSV or UNSF_REPORT_JSON: write what each patch cost to
+    <basename>.report.csv or .json next to the cfg, largest patch first:
+    its velocity layers, stereo, samples, input and output bytes and the
+    time spent resolving, encoding and writing it. Not with patch_sink or
+    tar_fd, which keep everything off the disk. */
+    int opt_report;
+    /* with stats set, also read the processor's cycle, instruction, cache
+    miss and branch miss counters around each stage, through
+    perf_event_open on Linux. Where they can't be had the conversion runs
+    as usual and stats->perf.available is 0. */
+    int opt_perf;
+    /* how plain patch files are written, UNSF_WRITER_AUTO by default:
+    through io_uring where the kernel has it, else with stdio. Where the
+    soundfont is on the same file system as the output, a 16-bit patch
+    with a waveform lying block-aligned like in the soundfont is copied
+    with copy_file_range() instead, so XFS or btrfs can share the
+    blocks. The other values pin one writer, falling back to stdio
+    where it can't be used; UNSF_WRITER_COPY copies every 16-bit
+    patch. */
+    int opt_writer;
     /* manually set the velocity of either a instrument or drum since most
     applications do not know about the extended patch format. */
     signed char melody_velocity_override[128][128];
@@ -67,6 +298,11 @@ typedef struct UnSF_Options
 
 UNSF_SYMBOL UnSF_Options unsf_initialization(void);
 UNSF_SYMBOL void unsf_convert_sf_to_gus(UnSF_Options *options);
+/* reads the patch <name> ("<bank directory>/<patch name>", as in the cfg)
+out of a .pak archive and unpacks it, for players loading instruments as
+they need them. Returns a malloc()ed copy of the patch file and sets
+*size, or NULL if the patch can't be found or read. */
+UNSF_SYMBOL unsigned char *unsf_archive_read(const char *archive_path, const char *name, size_t *size);
 
 #if defined(__cplusplus)
 }
@@ -0,0 +1,57 @@
+#ifndef UNSF_LIBUNSF_KERNELS_H
+#define UNSF_LIBUNSF_KERNELS_H
+
+/* The hot inner functions of libunsf.c, reachable from outside only when
+ * libunsf.c is compiled with UNSF_KERNELS. This is for the unsf-kernels
+ * benchmark and is neither installed nor part of the library API.
+ *
+ * Each entry point runs the current kernel over a whole input, so a call
+ * costs far more than its own overhead, and returns something computed
+ * from every result so the work can't be optimized away.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/* seconds on the clock the conversion stages are timed with */
+double unsf_kernel_clock(void);
+
+/* get16() over count words of f, from where it stands */
+unsigned long unsf_kernel_get16(FILE *f, unsigned long count);
+
+/* getname() over count names of 20 characters each, back to back */
+unsigned long unsf_kernel_getname(const char *names, int count);
+
+/* apply_generator() of count generators, given as operator and amount
+ * pairs, to one zone; preset as in a preset zone */
+unsigned long unsf_kernel_apply_generator(const unsigned short *gens, int count, int preset);
+
+/* calc_root_pitch() for count original keys and pitch corrections */
+unsigned long unsf_kernel_root_pitch(const int *keys, const int *tunes, int count);
+
+/* msec2gus(timecent2msec()) for count envelope timecents, against rate */
+unsigned long unsf_kernel_envelope(const int *timecents, int count, int rate);
+
+/* adjust_volume() of length samples */
+int unsf_kernel_adjust_volume(const short *pcm, int length);
+
+/* the -8 waveform conversion of length samples into a buffer kept
+ * between calls; returns the bytes written */
+size_t unsf_kernel_pcm8(const short *pcm, int length, float vol);
+
+/* mem_write8() of count bytes into a buffer growing from nothing, freed
+ * again afterwards */
+size_t unsf_kernel_mem_write8(size_t count);
+
+/* frees the buffer unsf_kernel_pcm8() keeps */
+void unsf_kernel_free(void);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
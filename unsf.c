@@ -19,6 +19,9 @@
 #include <stdlib.h>
 #ifndef _WIN32
 #include <unistd.h>
+#else
+#include <io.h>
+#include <fcntl.h>
 #endif
 
 #include "libunsf.h"
@@ -46,15 +49,117 @@ static char *fix_outdir(const char *src) {
     return buf;
 }
 
+/* --profile goes to stderr, next to the other messages */
+static void print_memory(const char *what, double held, double peak) {
+    fprintf(stderr, "  %-15s %12.0f %11.0f\n", what, held, peak);
+}
+
+/* a counter the kernel didn't give is shown as - */
+static void print_count(int available, int bit, double count) {
+    if (available & bit) fprintf(stderr, " %14.0f", count);
+    else fprintf(stderr, " %14s", "-");
+}
+
+static void print_perf(const char *what, int available, const UnSF_PerfCounters *c) {
+    fprintf(stderr, "  %-15s", what);
+    print_count(available, UNSF_PERF_CYCLES, c->cycles);
+    print_count(available, UNSF_PERF_INSTRUCTIONS, c->instructions);
+    if ((available & UNSF_PERF_CYCLES) && (available & UNSF_PERF_INSTRUCTIONS) && c->cycles > 0)
+        fprintf(stderr, " %5.2f", c->instructions / c->cycles);
+    else fprintf(stderr, " %5s", "-");
+    print_count(available, UNSF_PERF_CACHE_MISSES, c->cache_misses);
+    print_count(available, UNSF_PERF_BRANCH_MISSES, c->branch_misses);
+    fprintf(stderr, "\n");
+}
+
+static void print_profile(const UnSF_Stats *stats) {
+    fprintf(stderr, "Profile (seconds):\n");
+    fprintf(stderr, "  parse           %9.4f\n", stats->parse);
+    fprintf(stderr, "  banks           %9.4f\n", stats->banks);
+    fprintf(stderr, "  directories     %9.4f\n", stats->directories);
+    fprintf(stderr, "  velocity layers %9.4f\n", stats->layers);
+    fprintf(stderr, "  patches         %9.4f\n", stats->patches);
+    fprintf(stderr, "    resolve       %9.4f\n", stats->resolve);
+    fprintf(stderr, "    encode        %9.4f\n", stats->encode);
+    fprintf(stderr, "    write         %9.4f\n", stats->write);
+    fprintf(stderr, "  config          %9.4f\n", stats->config);
+    fprintf(stderr, "  total           %9.4f (cpu %.4f)\n", stats->total, stats->cpu);
+    fprintf(stderr, "Counts:\n");
+    fprintf(stderr, "  presets scanned %9lu\n", stats->counters.presets_scanned);
+    fprintf(stderr, "  zones visited   %9lu\n", stats->counters.zones_visited);
+    fprintf(stderr, "  generators      %9lu\n", stats->counters.generators);
+    fprintf(stderr, "  samples         %9lu\n", stats->counters.samples);
+    fprintf(stderr, "  files           %9lu\n", stats->counters.files);
+    fprintf(stderr, "  directories     %9lu\n", stats->counters.directories);
+    fprintf(stderr, "  allocations     %9lu (%.0f bytes)\n", stats->counters.allocations, stats->counters.allocated);
+    fprintf(stderr, "  bytes read      %9.0f\n", stats->counters.bytes_read);
+    fprintf(stderr, "  bytes written   %9.0f\n", stats->counters.bytes_written);
+    fprintf(stderr, "Memory (bytes):    held at end        peak\n");
+    print_memory("samples", stats->memory.samples, stats->memory_peak.samples);
+    print_memory("pdta", stats->memory.pdta, stats->memory_peak.pdta);
+    print_memory("banks", stats->memory.banks, stats->memory_peak.banks);
+    print_memory("patch buffer", stats->memory.patch, stats->memory_peak.patch);
+    print_memory("sample cache", stats->memory.cache, stats->memory_peak.cache);
+    print_memory("write buffers", stats->memory.buffers, stats->memory_peak.buffers);
+    print_memory("total", stats->memory.total, stats->memory_peak.total);
+    if (stats->max_rss > 0) fprintf(stderr, "  max rss         %24.0f\n", stats->max_rss);
+    if (!stats->perf.available) {
+        fprintf(stderr, "Hardware counters: not available\n");
+        return;
+    }
+    fprintf(stderr, "Hardware counters:         cycles   instructions   ipc   cache misses  branch misses\n");
+    print_perf("parse", stats->perf.available, &stats->perf.parse);
+    print_perf("banks", stats->perf.available, &stats->perf.banks);
+    print_perf("directories", stats->perf.available, &stats->perf.directories);
+    print_perf("velocity layers", stats->perf.available, &stats->perf.layers);
+    print_perf("patches", stats->perf.available, &stats->perf.patches);
+    print_perf("  encode", stats->perf.available, &stats->perf.encode);
+    print_perf("config", stats->perf.available, &stats->perf.config);
+    print_perf("total", stats->perf.available, &stats->perf.total);
+}
+
 int main(int argc, char *argv[]) {
-    int i, c;
+    int i, c, opt_tar = 0;
+    UnSF_Stats stats;
     char *inname;
     char *sep1, *sep2;
 
     UnSF_Options options = unsf_initialization();
 
-    while ((c = getopt(argc, argv, "FVvnsdmO:M:D:")) > 0)
+    /* long options, getopt only knows the short ones */
+    for (i = 1; i < argc; i++)
+        if (!strcmp(argv[i], "--tar") || !strcmp(argv[i], "--json") || !strcmp(argv[i], "--profile")) {
+            if (argv[i][2] == 't') opt_tar = 1;
+            else if (argv[i][2] == 'j') options.opt_inspect = UNSF_INSPECT_JSON;
+            else {
+                options.stats = &stats;
+                options.opt_perf = 1;
+            }
+            memmove(argv + i, argv + i + 1, (argc - i) * sizeof(char *));
+            argc--;
+            i--;
+        } else if (!strcmp(argv[i], "--trace") && i + 1 < argc) {
+            options.trace_file = argv[i + 1];
+            memmove(argv + i, argv + i + 2, (argc - i - 1) * sizeof(char *));
+            argc -= 2;
+            i--;
+        } else if (!strcmp(argv[i], "--report") && i + 1 < argc) {
+            if (!strcmp(argv[i + 1], "csv")) options.opt_report = UNSF_REPORT_CSV;
+            else if (!strcmp(argv[i + 1], "json")) options.opt_report = UNSF_REPORT_JSON;
+            else {
+                fprintf(stderr, "--report takes csv or json\n");
+                return 1;
+            }
+            memmove(argv + i, argv + i + 2, (argc - i - 1) * sizeof(char *));
+            argc -= 2;
+            i--;
+        }
+
+    while ((c = getopt(argc, argv, "FVvnlsdkmaupzO:M:D:S:")) > 0)
         switch (c) {
+            case 'S':
+                options.store_directory = optarg;
+                break;
             case 'v':
                 if (options.opt_verbose) options.opt_veryverbose = 1;
                 else options.opt_verbose = 1;
@@ -62,12 +167,31 @@ int main(int argc, char *argv[]) {
             case 'n':
                 options.opt_no_write = 1;
                 break;
+            case 'l':
+                if (!options.opt_inspect) options.opt_inspect = UNSF_INSPECT_TEXT;
+                break;
             case 's':
                 options.opt_small = 1;
                 break;
             case 'd':
                 options.opt_drum = 1;
                 break;
+            case 'k':
+                options.opt_drum_share = 1;
+                break;
+            case 'a':
+                options.opt_archive = 1;
+                break;
+            case 'z':
+                options.opt_archive = 1;
+                options.opt_compress++;
+                break;
+            case 'u':
+                options.opt_incremental = 1;
+                break;
+            case 'p':
+                options.opt_priority = 1;
+                break;
             case 'm':
                 options.opt_mono = 1;
                 break;
@@ -92,23 +216,26 @@ int main(int argc, char *argv[]) {
                     break;
                 } /* if missing, fall through */
             case 'O':
-                options.output_directory = optarg;
+                if (!strcmp(optarg, "-")) opt_tar = 1;
+                else options.output_directory = optarg;
                 break;
             default:
-                fprintf(stderr, "usage: unsf [-v] [-n] [-s] [-d] [-m] [-F] [-V] [-O <output directory>]\n"
-                        "[-M <bank>:<instrument>=<layer>] [-D <bank>:<instrument>=<layer>] <filename>\n");
+                fprintf(stderr, "usage: unsf [-v] [-n] [-l] [--json] [-s] [-d] [-k] [-m] [-a] [-z] [-u] [-p] [-F] [-V] [--tar] [--profile] [--trace <file>] [--report csv|json] [-O <output directory>|-] [-S <store directory>]\n"
+                        "[-M <bank>:<instrument>=<layer>] [-D <bank>:<instrument>=<layer>] <filename>|-\n");
                 return 1;
         }
 
     if (argc - optind != 1) {
-        fprintf(stderr, "usage: unsf [-v] [-n] [-s] [-d] [-m] [-F] [-V] [-O <output directory>]\n"
-                "[-M <bank>:<instrument>=<layer>] [-D <bank>:<instrument>=<layer>] <filename>\n");
+        fprintf(stderr, "usage: unsf [-v] [-n] [-l] [--json] [-s] [-d] [-k] [-m] [-a] [-z] [-u] [-p] [-F] [-V] [--tar] [--profile] [--trace <file>] [--report csv|json] [-O <output directory>|-] [-S <store directory>]\n"
+                "[-M <bank>:<instrument>=<layer>] [-D <bank>:<instrument>=<layer>] <filename>|-\n");
         exit(1);
     }
 
 
     inname = strrchr(argv[optind], '/');
     inname = inname ? inname + 1 : argv[optind];
+    /* a font read from standard input has no name to go by */
+    if (!strcmp(argv[optind], "-")) inname = "stdin";
 
     if (!(options.basename = (char *) malloc(sizeof(char) * strlen(inname) + 1))) {
         fprintf(stderr, "Memory allocation of %lu failed\n", (unsigned long)strlen(inname) + 1);
@@ -125,17 +252,38 @@ int main(int argc, char *argv[]) {
     }
 
     options.output_directory = fix_outdir(options.output_directory);
+    if (options.store_directory) options.store_directory = fix_outdir(options.store_directory);
     options.opt_soundfont = argv[optind];
 
-    printf("Reading %s\n", options.opt_soundfont);
-    printf("Writing out to: %s\n", options.output_directory);
+    if (opt_tar) {
+        /* the archive takes stdout, the messages go to stderr */
+        fflush(stdout);
+        if (!(options.tar_fd = fdopen(dup(1), "wb")) || dup2(2, 1) < 0) {
+            fprintf(stderr, "Could not stream to stdout\n");
+            exit(1);
+        }
+#ifdef _WIN32
+        _setmode(_fileno(options.tar_fd), _O_BINARY);
+#endif
+    }
+
+    /* a listing has stdout to itself */
+    if (!options.opt_inspect) {
+        if (!strcmp(options.opt_soundfont, "-")) printf("Reading standard input\n");
+        else printf("Reading %s\n", options.opt_soundfont);
+        if (opt_tar) printf("Writing out to: standard output\n");
+        else printf("Writing out to: %s\n", options.output_directory);
+    }
 
     unsf_convert_sf_to_gus(&options);
+    if (options.stats) print_profile(options.stats);
 
     if (options.basename) free(options.basename);
     if (!options.opt_no_write && options.cfg_fd) fclose(options.cfg_fd);
+    if (options.tar_fd) fclose(options.tar_fd);
     free(options.output_directory);
-    printf("Finished!\n");
+    free(options.store_directory);
+    if (!options.opt_inspect) printf("Finished!\n");
 
     return 0;
 }